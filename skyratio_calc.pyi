@@ -4,7 +4,14 @@
 このファイルはnanobindによってエクスポートされたC++関数の型情報を提供します。
 """
 
-from typing import List
+from enum import Enum
+from typing import Callable, Dict, List, Optional, Union, overload
+
+import numpy as np
+import numpy.typing as npt
+
+# (N, 3) の float32 / float64 C連続配列
+PointArray = npt.NDArray[Union[np.float32, np.float64]]
 
 
 class HitResult:
@@ -25,6 +32,156 @@ class HitResult:
     position: List[float]
     distance: float
 
+class BvhBuilder(Enum):
+    """BVHの構築方法"""
+
+    Binned = ...
+    """ビン分割SAH（デフォルト）。構築と走査のバランスが良い"""
+
+    Quick = ...
+    """中央分割。構築が最速で走査は遅め（一度きりの問い合わせ向け）。compact_storage では Binned になる"""
+
+    HighQuality = ...
+    """空間分割付きSAH。構築は遅いが走査が最速（大量の測定点向け）。形状の変更時はリフィットせず作り直す"""
+
+
+class BvhLayout(Enum):
+    """走査に使うBVHのノードレイアウト"""
+
+    Standard = ...
+    """2分木（デフォルト）。256本単位のパケット走査を使う"""
+
+    SoA = ...
+    """子ノードのAABBをSoAで並べた2分木（AVX / NEON が必要）"""
+
+    Wide4 = ...
+    """4分木（SSE / NEON が必要）"""
+
+    Wide8 = ...
+    """8分木（AVX2 が必要）"""
+
+
+class BuildOptions:
+    """BVHの構築方法とレイアウト"""
+
+    builder: BvhBuilder
+    """構築方法（デフォルト: BvhBuilder.Binned）"""
+
+    layout: BvhLayout
+    """走査に使うレイアウト（デフォルト: BvhLayout.Standard）。使えない環境では Standard で走査する"""
+
+    optimize: bool
+    """構築後に部分木の付け替えで木を最適化するかどうか（デフォルト: False。HighQuality では行わない）"""
+
+    analytic_primitives: bool
+    """
+    ボックス・球を三角形に分割せず、専用のBVHで解析的に交差判定するかどうか（デフォルト: False）
+
+    三角形のBVHと合わせて走査します。球は分割による誤差がなくなり、ボックス・球の多いシーンではBVHが小さくなります。
+    有効な間は triangle_count() にボックス・球を含みません。
+    """
+
+    threads: int
+    """
+    build で三角形分割・単精度バッファへの変換と、BVHの構築に使うスレッド数（デフォルト: 0。0以下なら論理コア数）
+
+    2スレッド以上で三角形が131072個以上あれば、木の上の数段を三角形の重心の中央値で分け、部分木をスレッドごとに並列で構築してつなぎます（Quick を除く）。
+    木の形はスレッド数で変わりますが、交差の結果は変わりません（距離がまったく同じ三角形のどれを返すかだけが変わることがあります）。
+    """
+
+    def __init__(self) -> None: ...
+
+
+class CullOptions:
+    """SceneRaycaster.extract_region で除く三角形の条件"""
+
+    min_elevation_deg: float
+    """この仰角以上のレイが測定点の領域から届かない三角形を除く（デフォルト: 20.0。結果は変わらない）"""
+
+    min_angular_size_deg: float
+    """見かけの大きさがこの角度未満の三角形を除く（デフォルト: 0.0 で除かない。近似）"""
+
+    merge_small: bool
+    """除く代わりに、近くの小さな三角形ごとに外接する箱へまとめる（デフォルト: False。遮蔽を大きく見積もる近似）"""
+
+    def __init__(self) -> None: ...
+
+
+class QueryStats:
+    """
+    処理段階ごとの時間とカウンタ（SceneRaycaster.stats() / SkyRatioChecker.stats()）
+
+    段階ごとの時間はスレッドごとの値の合計なので、並列実行時は total_seconds より大きくなることがあります。
+    """
+
+    total_seconds: float
+    """呼び出し全体の経過時間(秒)"""
+
+    tessellation_seconds: float
+    """ボックス・球の三角形分割と、BVHに渡す単精度バッファへの変換の時間(秒)"""
+
+    build_seconds: float
+    """BVHの構築・リフィットの時間(秒)。far_field_culling では領域ごとのシーンの作成を含む"""
+
+    setup_seconds: float
+    """方向表の作成とレイの生成の時間(秒)"""
+
+    traversal_seconds: float
+    """BVHの走査の時間(秒)"""
+
+    conversion_seconds: float
+    """走査結果を HitResult / 遮蔽マスクへ変換する時間(秒)"""
+
+    integration_seconds: float
+    """ホライズンの抽出と天空率の積分の時間(秒)"""
+
+    builds: int
+    """BVHを作り直した回数"""
+
+    refits: int
+    """BVHをリフィットした回数"""
+
+    rays: int
+    """飛ばしたレイの数"""
+
+    hits: int
+    """当たった（遮られた）レイの数"""
+
+    scalar_nodes_visited: int
+    """最近接ヒットの1本ずつの走査と Projection で訪れたBVHノード数
+
+    パケット走査と遮蔽判定（check のデフォルト）は tiny_bvh が訪れたノード数を返さないため数えません。
+    そのため0でもノードを訪れなかったとは限りません。三角形の交差判定の回数も tiny_bvh が返さないため提供していません。
+    """
+
+    projected: int
+    """Projection で投影した三角形・ボックス・球の数"""
+
+    checkpoints: int
+    """評価した測定点の数"""
+
+    allocations: int
+    """問い合わせごとに確保した作業バッファの数"""
+
+    def __init__(self) -> None: ...
+
+
+class QueryContext:
+    """
+    問い合わせの作業バッファ
+
+    raycast に渡すと、レイの作業バッファを解放せずに次の呼び出しで使い回します。
+    同じ大きさの問い合わせを繰り返す場合は、確保が最初の1回だけになります。
+    1つの QueryContext を複数のスレッドで同時に使わないでください。
+    """
+
+    def __init__(self) -> None: ...
+
+    def memory_usage(self) -> int:
+        """確保済みの作業バッファの大きさ(バイト)"""
+        ...
+
+
 class SceneRaycaster:
     """
     3Dシーンを構築し、レイキャスト（光線追跡）を実行するクラス
@@ -49,7 +206,7 @@ class SceneRaycaster:
         pos: List[float],
         size: List[float],
         euler: List[float]
-    ) -> None:
+    ) -> int:
         """
         ボックスをシーンに追加
         
@@ -57,6 +214,9 @@ class SceneRaycaster:
             pos: ボックスの中心位置 [x, y, z]
             size: ボックスのサイズ [width, height, depth]
             euler: オイラー角（回転） [rx, ry, rz] (ラジアン)
+
+        Returns:
+            ボックスのID（update_box / remove_box で使用）
         """
         ...
     
@@ -64,55 +224,360 @@ class SceneRaycaster:
         self,
         center: List[float],
         radius: float
-    ) -> None:
+    ) -> int:
         """
         球体をシーンに追加
         
         Args:
             center: 球体の中心位置 [x, y, z]
             radius: 球体の半径
+
+        Returns:
+            球体のID（update_sphere / remove_sphere で使用）
         """
         ...
+
+    def update_box(self, id: int, pos: List[float], size: List[float], euler: List[float]) -> None:
+        """
+        追加済みボックスの位置・サイズ・回転を変更
+
+        次のbuildではBVHを作り直さず、変更した部分だけをリフィットします。
+        """
+        ...
+
+    def update_sphere(self, id: int, center: List[float], radius: float) -> None:
+        """追加済み球体の位置・半径を変更（次のbuildでリフィット）"""
+        ...
+
+    def remove_box(self, id: int) -> None:
+        """ボックスを削除（IDは再利用されず、次のbuildでリフィット）"""
+        ...
+
+    def remove_sphere(self, id: int) -> None:
+        """球体を削除（IDは再利用されず、次のbuildでリフィット）"""
+        ...
+
+    def needs_build(self) -> bool:
+        """次のbuildで再構築またはリフィットが必要かどうか"""
+        ...
+
+    def triangle_count(self) -> int:
+        """build後の三角形数（メッシュ＋ボックス・球のテッセレーション。analytic_primitives ではメッシュのみ）"""
+        ...
+
+    def has_geometry(self) -> bool:
+        """build後に交差判定する形状（三角形または解析的に扱うボックス・球）があるかどうか"""
+        ...
+
+    def content_hash(self) -> int:
+        """build時点の形状の内容のハッシュ（三角形・ボックス・球と analytic_primitives から求める。同じ内容なら別のインスタンスでも同じ値）"""
+        ...
     
+    @overload
+    def add_mesh(self, vertices: PointArray) -> None: ...
+    @overload
+    def add_mesh(self, vertices: List[List[float]]) -> None: ...
     def add_mesh(
         self,
-        vertices: List[List[float]]
+        vertices: Union[PointArray, List[List[float]]]
     ) -> None:
         """
         メッシュをシーンに追加
         
         Args:
-            vertices: 頂点のリスト。各頂点は[x, y, z]の形式で、
+            vertices: 頂点のリスト、または (N, 3) の NumPy 配列（float32 / float64）。
                      3つの頂点で1つの三角形を構成する
+
+        Raises:
+            ValueError: 頂点数が3の倍数でない場合
+        """
+        ...
+
+    def add_indexed_mesh(self, vertices: List[List[float]], indices: List[List[int]]) -> None:
+        """
+        頂点とインデックスでメッシュを追加
+
+        Args:
+            vertices: 頂点のリスト
+            indices: 三角形ごとの頂点番号のリスト（このメッシュの頂点に対する0始まりの番号）
+
+        Raises:
+            IndexError: 頂点番号が範囲外の場合
+        """
+        ...
+
+    def import_mesh(
+        self,
+        filepath: str,
+        weld: bool = False,
+        weld_tolerance: float = 0.0,
+        progress: Optional[Callable[[int, int], None]] = None
+    ) -> int:
+        """
+        STL（バイナリ/ASCII）、OBJ、PLY（ASCII/バイナリ）ファイルを読み込んでメッシュを追加
+
+        ファイルはメモリマップしてC++側で直接パースするため、Pythonのリストを経由しません。
+        形式は拡張子で判別し、多角形は扇形に三角形分割します。
+
+        Args:
+            filepath: メッシュファイルのパス（.stl / .obj / .ply）
+            weld: 同じ位置の頂点を1つにまとめるかどうか（潰れた三角形は除かれる）
+            weld_tolerance: 0なら座標が完全に一致する頂点のみ、正の値ならこの幅のグリッドで
+                            同じセルに入る頂点をまとめる
+            progress: 進捗コールバック。読み込んだバイト数と全体のバイト数を受け取る
+
+        Returns:
+            追加した三角形数
+
+        Raises:
+            ValueError: 対応していない拡張子の場合
+            RuntimeError: ファイルが開けない・形式が正しくない場合
         """
         ...
     
+    build_options: BuildOptions
+    """
+    BVHの構築方法・レイアウト
+
+    取得するとコピーが返るので、変更したオブジェクトを代入してください。
+    構築方法・optimize・analytic_primitives が変わると次のbuildで作り直し、レイアウトだけならその場で変換します。
+
+    Example:
+        options = skyratio_calc.BuildOptions()
+        options.builder = skyratio_calc.BvhBuilder.HighQuality
+        options.layout = skyratio_calc.BvhLayout.Wide4
+        scene.build_options = options
+    """
+
+    def traversal_layout(self) -> BvhLayout:
+        """実際に走査に使っているレイアウト（要求したレイアウトが使えない場合は Standard）"""
+        ...
+
+    @staticmethod
+    def layout_supported(layout: BvhLayout) -> bool:
+        """このビルド（コンパイル時の命令セット）でレイアウトが使えるかどうか"""
+        ...
+
     def build(self) -> None:
         """
         BVH（Bounding Volume Hierarchy）を構築
         
         オブジェクトを追加した後、この関数を呼び出してから
         raycastを実行する必要があります。
+        変更がなければ何もせず、update_* / remove_* による変更だけなら
+        BVHを作り直さずにリフィットします。
+        三角形分割と変換、大きなシーンのBVHの構築は build_options.threads のスレッドで並列に行います。
         """
         ...
+
+    collect_stats: bool
+    """
+    build / raycast / occluded の段階ごとの時間とカウンタを集計するかどうか（デフォルト: False）
+
+    無効な間はほぼコストがかかりません。is_occluded（1本ずつ）は集計しません。
+    """
+
+    def stats(self) -> QueryStats:
+        """collect_stats を有効にしてからの計測の積算"""
+        ...
+
+    def reset_stats(self) -> None:
+        """計測の積算を0に戻す"""
+        ...
+
+    compact_storage: bool
+    """
+    形状を単精度の共有頂点＋uint32インデックスで保持するかどうか（デフォルト: False）
+
+    Trueにすると三角形ごとの頂点コピーを作らずにBVHを構築するため、
+    大きなメッシュでメモリ使用量が減ります。release_host_geometry後は変更できません。
+    """
+
+    def release_host_geometry(self) -> None:
+        """
+        BVHを構築した上で vertices / indices（倍精度の入力データ）を解放する
+
+        compact_storage = True のときのみ使用可能。解放後も raycast / check / save は使えますが、
+        add_mesh で追加はできません（ボックス・球の追加・変更は可能）。
+        """
+        ...
+
+    def memory_usage(self) -> int:
+        """形状データとBVHのおおよそのメモリ使用量(バイト)"""
+        ...
     
+    @overload
+    def raycast(self, origins: PointArray, directions: PointArray, context: Optional[QueryContext] = None) -> Dict[str, np.ndarray]: ...
+    @overload
+    def raycast(self, origins: List[List[float]], directions: List[List[float]]) -> List[HitResult]: ...
     def raycast(
         self,
-        origins: List[List[float]],
-        directions: List[List[float]]
-    ) -> List[HitResult]:
+        origins: Union[PointArray, List[List[float]]],
+        directions: Union[PointArray, List[List[float]]],
+        context: Optional[QueryContext] = None
+    ) -> Union[Dict[str, np.ndarray], List[HitResult]]:
         """
         レイキャストを実行
         
         Args:
             origins: レイの原点のリスト。各原点は[x, y, z]の形式
             directions: レイの方向のリスト。各方向は[x, y, z]の形式（正規化推奨）
+            context: NumPy 配列を渡す場合のみ。作業バッファを使い回す QueryContext
             
         Returns:
-            各レイのヒット結果のリスト
+            リストを渡した場合は各レイのヒット結果のリスト。
+            (N, 3) の NumPy 配列を渡した場合は、要素ごとのコピーをせずに処理し、
+            {"hit": bool[N], "position": float64[N, 3], "distance": float64[N]} を返す
+            （np.rec.fromarrays で構造化配列に変換可能）
+        """
+        ...
+
+    def is_occluded(self, origin: List[float], direction: List[float]) -> bool:
+        """1本のレイが何かに遮られるかどうか"""
+        ...
+
+    @overload
+    def occluded(self, origins: PointArray, directions: PointArray) -> npt.NDArray[np.uint64]: ...
+    @overload
+    def occluded(self, origins: List[List[float]], directions: List[List[float]]) -> List[int]: ...
+    def occluded(
+        self,
+        origins: Union[PointArray, List[List[float]]],
+        directions: Union[PointArray, List[List[float]]]
+    ) -> Union[npt.NDArray[np.uint64], List[int]]:
+        """
+        遮蔽判定のみのレイキャストを実行
+
+        最初に当たった三角形で探索を打ち切るため、raycastより高速です。
+
+        Args:
+            origins: レイの原点のリスト
+            directions: レイの方向のリスト
+
+        Returns:
+            64本ずつ詰めたビットマスク。レイ i が遮られていれば
+            mask[i // 64] の bit (i % 64) が立つ。NumPy配列を渡した場合はuint64配列で返し、
+            np.unpackbits(mask.view(np.uint8), bitorder="little")[:N] で bool に展開できる
+        """
+        ...
+
+    def extract_region(self, region_min: List[float], region_max: List[float], options: CullOptions = ...) -> "SceneRaycaster":
+        """
+        領域 [region_min, region_max] 内の測定点から見て影響しうる三角形だけを集めたシーンを作る
+
+        構築オプションは引き継ぎ、BVHは未構築で返します。
+
+        Raises:
+            RuntimeError: シーンが build されていない場合
+        """
+        ...
+
+    def save(self, filepath: str) -> None:
+        """シーンの三角形（ボックス・球のテッセレーションを含む）をバイナリSTLで保存"""
+        ...
+
+    def save_scene(self, filepath: str) -> None:
+        """
+        構築済みのBVHを含むシーン全体をバイナリ形式で保存
+
+        保留中の変更は先にbuildで反映されます。形式はバージョン付きで、
+        書き出した環境と同じエンディアン・同じtinybvhでのみ読み込めます。
         """
         ...
 
+    def load_scene(self, filepath: str) -> None:
+        """
+        save_sceneで保存したシーンを読み込み、現在のシーンを置き換える
+
+        ファイルはメモリマップし、BVH用の頂点・インデックスとノードはコピーせずにそのまま使います（BVHは再構築しません）。
+        読み込み後も add_* / update_* / remove_* は通常どおり使えます。
+
+        Raises:
+            RuntimeError: ファイルが開けない・形式やバージョンが異なる・壊れている場合
+        """
+        ...
+
+    vertices: List[List[float]]
+    """add_meshで追加した頂点リスト（ボックス・球は含まない）。代入すると次のbuildで再構築"""
+
+    indices: List[List[int]]
+    """add_meshで追加した三角形のインデックスリスト。代入すると次のbuildで再構築"""
+
+class HorizonSearch(Enum):
+    """
+    方位角ごとの遮蔽境界（ホライズン）の求め方
+
+    Descend / Bisection / Guided は前のレイの結果で次のレイが決まるので、探索が終わっていない全ての方位角の
+    次のレイを方向表の単精度の方向からまとめて作り、1回の遮蔽判定で飛ばします。
+
+    Attributes:
+        Sweep: 全天頂角にレイを飛ばす
+        Descend: 天頂側から下向きに飛ばし、最初に遮られた所で打ち切る（Sweepと同じ結果）
+        Bisection: 二分探索。遮蔽が地面側から連続している前提の近似で、レイ数は O(log n)
+        Guided: 直前の測定点のホライズンから上下に探索する（Bisectionと同じ前提の近似）。
+            set_grid_checkpoints / set_polyline_checkpoints のように近い測定点が続く場合に速い。
+            64点ごとのブロックの先頭はDescendで求めるので、結果はスレッド数によらない
+        Projection: レイを飛ばさずに三角形・ボックス・球を投影し、方位角ごとの遮蔽の最大仰角を直接求める。
+            方位角は ray_resolution で刻むが仰角は正確で、結果は use_safe_side の有無による Sweep の結果の間に入る。
+            use_safe_side と use_occlusion_query は使わない
+    """
+
+    Sweep = 0
+    Descend = 1
+    Bisection = 2
+    Guided = 3
+    Projection = 4
+
+
+class FarFieldCulling(Enum):
+    """
+    測定点の領域ごとに、結果に影響しない遠くの形状を除いた小さなシーンで計算するかどうか
+
+    Attributes:
+        Off: シーン全体のBVHをそのまま使う
+        Exact: 仰角20度以上のレイが届かない形状だけを除く（結果は変わらない）
+        Prune: さらに見かけの大きさが ray_resolution 未満の形状を除く（近似）
+        Merge: 見かけの大きさが ray_resolution 未満の形状を近くのものごとに箱へまとめる（遮蔽を大きく見積もる近似）
+    """
+
+    Off = 0
+    Exact = 1
+    Prune = 2
+    Merge = 3
+
+
+class HorizonProfiles:
+    """
+    SkyRatioChecker.check_horizons の結果
+
+    測定点ごとに、方位角ごとの遮蔽境界を天空率の計算と同じ仰角の刻みで量子化して持ちます。
+    SkyRatioChecker.integrate_horizons でレイを飛ばさずに天空率を求め直せます。
+    """
+
+    resolution: float
+    """作成時の ray_resolution（度）"""
+
+    theta_steps: int
+    """仰角の最大のインデックス。インデックス t の仰角は 20 + t * resolution 度"""
+
+    phi_steps: int
+    """方位角の刻み数。インデックス p の方位角は x軸から反時計回りに 360 * p / phi_steps 度"""
+
+    @property
+    def horizon(self) -> npt.NDArray[np.int16]:
+        """遮られた最も高い仰角のインデックス（遮蔽がなければ-1）。(測定点, phi_steps) の int16 配列（コピー）"""
+        ...
+
+    @horizon.setter
+    def horizon(self, value: npt.NDArray[np.int16]) -> None:
+        """保存しておいた配列を戻す（phi_steps も配列の列数に変わる）"""
+        ...
+
+    def __len__(self) -> int:
+        """測定点の数"""
+        ...
+
+
 class SkyRatioChecker:
     """
     指定した測定点から天空率を計算するクラス
@@ -125,21 +590,335 @@ class SkyRatioChecker:
         """SkyRatioCheckerインスタンスを初期化"""
         ...
     
-    checkpoints: List[List[float]]
-    """測定点のリスト。各測定点は[x, y, z]の形式"""
+    @property
+    def checkpoints(self) -> List[List[float]]:
+        """測定点のリスト。各測定点は[x, y, z]の形式"""
+        ...
+
+    @checkpoints.setter
+    def checkpoints(self, value: Union[PointArray, List[List[float]]]) -> None:
+        """リストまたは (N, 3) の NumPy 配列（float32 / float64）を代入できる"""
+        ...
     
     ray_resolution: float
     """レイの角度刻み（度）。デフォルトは1.0度。小さいほど精度が高いが計算時間が増加"""
     
     use_safe_side: bool
     """安全側評価（内接近似）を使うかどうか。デフォルトはFalse（外接近似）"""
+
+    use_occlusion_query: bool
+    """遮蔽判定のみのクエリを使うかどうか。デフォルトはTrue。Trueなら1本ずつ、最初に当たった時点で探索を打ち切る（use_packet_occlusion がFalseの場合）。Falseなら最近接ヒットを求める（Standard レイアウトではパケットで走査する。結果は同じ、Sweepのみ有効）"""
+
+    use_packet_occlusion: bool
+    """遮蔽判定を256本のパケットで行うかどうか。デフォルトはFalse（Sweep と check_overlays の共通のシーンのみ有効）
+
+    tiny_bvh にパケットの遮蔽判定はないため、パケットでは最近接ヒットを求める走査（早期打ち切りなし）で当たったレイを遮られたとします。
+    結果は同じですが速くなるかはシーンによるので、skyratio_benchmark の check_packet_occlusion で比べてから使ってください。
+    Standard 以外のレイアウトと compact_storage では1本ずつ遮蔽判定します。
+    """
+
+    horizon_search: HorizonSearch
+    """方位角ごとの遮蔽境界の求め方。デフォルトはSweep"""
+
+    horizon_tolerance: float
+    """Bisectionで探索を打ち切る角度幅（度）。0なら刻み幅まで探索。未確定の範囲はuse_safe_sideに従って遮蔽/天空として扱う"""
+
+    far_field_culling: FarFieldCulling
+    """遠くの形状の除去。デフォルトはOff。Off以外では測定点を culling_region_size 四方の領域に分け、領域ごとに小さなBVHを作って計算する"""
+
+    culling_region_size: float
+    """測定点をまとめる領域（xy平面の正方形）の一辺。デフォルトは50.0"""
+
+    collect_stats: bool
+    """段階ごとの時間とカウンタを集計するかどうか。デフォルトはFalse。結果は stats() で取得する"""
+
+    def stats(self) -> QueryStats:
+        """直前の check / check_array / check_scenes / check_overlays / reduce_occlusion の計測（collect_stats が有効な場合のみ）"""
+        ...
+
+    result_cache_path: str
+    """
+    check / check_array の結果キャッシュのファイル。デフォルトは空（キャッシュしない）
+
+    シーンの content_hash と結果に影響する設定（ray_resolution / use_safe_side / horizon_search /
+    horizon_tolerance / far_field_culling / culling_region_size）が同じなら、キャッシュにある測定点は
+    評価し直さず、ない測定点だけを評価して追記します。同じシーンを update_box / add_mesh などで
+    部分的に変更した場合は、変わった形状が仰角の下限以上に見えうる測定点だけを評価し直します
+    （clear / mark_dirty、analytic_primitives の切り替え、Merge では全て評価し直します）。
+
+    書き出しは一時ファイルからの置き換えなので書きかけのファイルは読まれませんが、ロックはしないため、
+    複数のプロセスが同じファイルに同時に書き出すと最後に書いたものが残ります（他のプロセスが追加した測定点は失われます）。
+    """
+
+    num_threads: int
+    """並列実行するスレッド数。0以下なら論理コア数を使う。結果の順番はスレッド数によらず測定点の順番どおり"""
     
     
+    def set_grid_checkpoints(self, polygon: List[List[float]], spacing: float, height: float) -> int:
+        """
+        多角形の内側に格子状の測定点を置く
+
+        格子点は spacing 間隔のセルの中心で、近い点が続くようにヒルベルト曲線の順に並べます。
+        HorizonSearch.Guided と組み合わせると、隣の測定点の結果を使って探索を減らせます。
+
+        Args:
+            polygon: xy平面の多角形の頂点 [[x, y], ...]（閉じていなくてよい）
+            spacing: 格子の間隔
+            height: 測定点の高さ（z座標）
+
+        Returns:
+            測定点の数（checkpoints を置き換える）
+
+        Raises:
+            ValueError: spacing が正でない、または頂点が3つ未満の場合
+        """
+        ...
+
+    def set_polyline_checkpoints(self, polyline: List[List[float]], spacing: float, height: float) -> int:
+        """
+        折れ線に沿って始点から spacing 間隔で測定点を置く（終点も含む）
+
+        Returns:
+            測定点の数（checkpoints を置き換える）
+
+        Raises:
+            ValueError: spacing が正でない、または頂点が2つ未満の場合
+        """
+        ...
+
     def check(self, scene:SceneRaycaster) -> List[float]:
         """
         各測定点の天空率を計算
+
+        測定点は num_threads 個のスレッドで並列に評価されます。
+        計算中はGILを解放するため、他のPythonスレッドと並行して実行できます。
         
         Returns:
             各測定点の天空率（0.0〜1.0）のリスト
         """
         ...
+
+    def check_array(self, scene: SceneRaycaster) -> npt.NDArray[np.float32]:
+        """各測定点の天空率を計算し、float32 の NumPy 配列で返す"""
+        ...
+
+    def check_stream(
+        self,
+        scene: SceneRaycaster,
+        callback: Callable[[int, npt.NDArray[np.float32]], Optional[bool]],
+        start: int = 0,
+        chunk_size: int = 1024,
+    ) -> int:
+        """
+        測定点をチャンクごとに順番に評価し、結果を少しずつ受け取る
+
+        長時間の計算で途中の結果を返したり、中断・再開したりするために使います。
+        チャンクの境界は64の倍数にそろえられます。計算中はGILを解放し、コールバックを呼ぶ間だけ取り直します。
+
+        Args:
+            scene: 計算対象のシーン
+            callback: チャンクごとに (先頭の測定点の番号, 天空率の配列) を受け取る。Falseを返すと残りを評価せずに終える
+            start: 評価を始める測定点の番号（前回の戻り値を渡すと続きから再開できる）
+            chunk_size: 1チャンクあたりの測定点の数の目安
+
+        Returns:
+            評価の終わった次の測定点の番号（最後まで終われば len(checkpoints)）
+
+        Note:
+            結果は check と同じです。ただし far_field_culling を使う場合と、Guided で start が64の倍数でない場合は、
+            近似の結果がわずかに異なることがあります。
+
+        Example:
+            >>> results = np.empty(len(checker.checkpoints), dtype=np.float32)
+            >>> def on_chunk(first, ratios):
+            ...     results[first:first + len(ratios)] = ratios
+            ...     print(f"{first + len(ratios)} / {len(results)}")
+            ...     return not cancelled
+            >>> next_start = checker.check_stream(scene, on_chunk)
+        """
+        ...
+
+    def check_horizons(self, scene: SceneRaycaster) -> HorizonProfiles:
+        """
+        全測定点のホライズン（方位角ごとに遮られた最も高い仰角のインデックス）を求める
+
+        レイの飛ばし方は check と同じで、horizon_search / far_field_culling などの設定に従います。
+        Projection の仰角は、その仰角より低いレイのうち最も高いもののインデックスに量子化します。
+        Bisection の未確定の範囲は、呼び出した時点の use_safe_side に従います。
+        """
+        ...
+
+    def integrate_horizons(self, profiles: HorizonProfiles, safe_side: bool, azimuth_from: float = 0.0, azimuth_to: float = 360.0) -> npt.NDArray[np.float32]:
+        """
+        ホライズンからレイを飛ばさずに天空率を求め直す
+
+        1回の check_horizons から、安全側評価・外接近似の両方や方位角の範囲ごとの天空率を求められます。
+        全周なら、同じ use_safe_side で check を呼んだ結果と一致します（Projection は量子化の分だけ異なります）。
+
+        Args:
+            profiles: check_horizons の結果
+            safe_side: True なら安全側評価（内接近似）、False なら外接近似
+            azimuth_from: 方位角の範囲の始まり（度、x軸から反時計回り）
+            azimuth_to: 方位角の範囲の終わり（度。360度をまたいでよい）。範囲に中央が入る方位角の区間だけで天空率を求める
+
+        Returns:
+            各測定点の天空率（float32 の NumPy 配列）
+        """
+        ...
+
+    def check_scenes(self, scenes: List[SceneRaycaster]) -> Dict[str, npt.NDArray[np.float32]]:
+        """
+        同じ測定点を複数のシーン（設計案など）でまとめて評価する
+
+        方向表とスレッドの割り振りを共有し、1回の呼び出しで全シーンを評価します。
+        far_field_culling を使う場合はシーンごとに領域のシーンを切り出し、各シーンで check を呼んだのと同じ結果になります。
+        result_cache_path は使いません。
+
+        Returns:
+            "ratios": (V, N) の天空率、"differences": 先頭のシーンとの差 (V, N)
+        """
+        ...
+
+    def check_overlays(self, base: SceneRaycaster, overlays: List[SceneRaycaster]) -> Dict[str, npt.NDArray[np.float32]]:
+        """
+        共通のシーン（周辺の建物など）に各overlay（計画建物・適合建物など）を重ねてまとめて評価する
+
+        base の遮蔽は測定点ごとに一度だけ求め、各overlayは base で遮られなかったレイだけを判定します。
+        どちらかで遮られたレイを遮蔽として扱います。horizon_search によらず全方向のレイを使います。
+        far_field_culling と result_cache_path は使いません（常にシーン全体のBVHで評価します）。
+
+        Returns:
+            "ratios": (V, N) の天空率、"differences": 先頭のoverlayとの差 (V, N)
+        """
+        ...
+
+    def ray_directions(self) -> npt.NDArray[np.float32]:
+        """
+        天空率の計算に使うレイの方向（ray_resolution から決まる）
+
+        Returns:
+            (N, 3) の float32 配列。並びは天頂角ごと（t * phi_steps + p）
+        """
+        ...
+
+    @overload
+    def reduce_occlusion(self, masks: npt.NDArray[np.uint64]) -> List[float]: ...
+    @overload
+    def reduce_occlusion(self, masks: List[List[int]]) -> List[float]: ...
+    def reduce_occlusion(self, masks: Union[npt.NDArray[np.uint64], List[List[int]]]) -> List[float]:
+        """
+        測定点ごとの遮蔽マスクからまとめて天空率を求める
+
+        SceneRaycaster.occluded と同じ形式（64本ずつ詰めたビットマスク）で、
+        ray_directions() の並びのレイが遮られているかを測定点ごとに渡します。
+
+        Args:
+            masks: (M, W) の uint64 配列、またはマスクのリスト
+
+        Returns:
+            各測定点の天空率（0.0〜1.0）のリスト
+
+        Raises:
+            ValueError: マスクが方向の数より短い場合
+        """
+        ...
+
+
+class SunlightChecker:
+    """
+    指定した測定点の日照時間（太陽の直射が当たる時間）を計算するクラス
+
+    緯度・日付の範囲・時刻の刻みから太陽の方向を一度だけ求め、各測定点から太陽方向へ
+    遮蔽判定のレイを飛ばして、遮られなかった時刻の時間を合計します。
+    日付・時刻は真太陽時（南中が12時）で、大気差と均時差は考えません。
+    """
+
+    def __init__(self) -> None:
+        """SunlightCheckerインスタンスを初期化"""
+        ...
+
+    @property
+    def checkpoints(self) -> List[List[float]]:
+        """測定点のリスト。各測定点は[x, y, z]の形式"""
+        ...
+
+    @checkpoints.setter
+    def checkpoints(self, value: Union[PointArray, List[List[float]]]) -> None:
+        """リストまたは (N, 3) の NumPy 配列（float32 / float64）を代入できる"""
+        ...
+
+    latitude_deg: float
+    """緯度（度、北緯が正）。デフォルトは35.0"""
+
+    first_day: int
+    """最初の日（1月1日を1とする通し日）。デフォルトは355（冬至ごろ）"""
+
+    last_day: int
+    """最後の日（first_day 以上、366以下。年はまたげない）。デフォルトは355"""
+
+    start_hour: float
+    """1日の評価時間帯の始め（真太陽時）。デフォルトは8.0"""
+
+    end_hour: float
+    """1日の評価時間帯の終わり（真太陽時）。デフォルトは16.0"""
+
+    time_step_minutes: float
+    """時刻の刻み（分）。デフォルトは10.0。太陽の方向は各区間の中央の時刻で求める"""
+
+    north_azimuth_deg: float
+    """真北の向き（度、x軸から反時計回り）。デフォルトは90.0（+y が北）"""
+
+    num_threads: int
+    """並列実行するスレッド数。0以下なら論理コア数を使う"""
+
+    use_packets: bool
+    """太陽方向を256本のパケットで遮蔽判定するかどうか。デフォルトはTrue。Falseなら1本ずつ遮蔽判定する（結果は同じ）
+
+    パケットは全ての日で地平線より上にある時刻を、4時間分の時刻×日付のタイルにまとめたものです。
+    タイルが64本に満たないと1本ずつ判定するため、日数×min(4時間分の刻み数, そのような時刻の数) が64以上のとき
+    （10分刻みなら3日以上、1日だけなら3.75分以下の刻み）にだけ効きます。デフォルトの設定（1日・10分刻み）では使われません。
+    実際にまとめられたパケットの数は packet_count() で確認できます。
+    """
+
+    collect_stats: bool
+    """段階ごとの時間とカウンタを集計するかどうか。デフォルトはFalse。結果は stats() で取得する"""
+
+    def stats(self) -> QueryStats:
+        """直前の check の計測（collect_stats が有効な場合のみ）"""
+        ...
+
+    def check(self, scene: SceneRaycaster) -> npt.NDArray[np.float32]:
+        """
+        各測定点の日照時間を計算
+
+        シーンのBVHは変更がなければ作り直さないため、SkyRatioChecker と同じ SceneRaycaster を使い回せます。
+        計算中はGILを解放します。
+
+        Returns:
+            各測定点の日照時間（時間。first_day から last_day までの合計）の float32 配列
+
+        Raises:
+            ValueError: 緯度・日付・時刻の設定が範囲外の場合
+        """
+        ...
+
+    def sun_directions(self) -> npt.NDArray[np.float32]:
+        """
+        日照時間の計算に使う太陽の方向（地平線より上のもののみ）
+
+        Returns:
+            (N, 3) の float32 配列
+        """
+        ...
+
+    def sun_hours(self) -> npt.NDArray[np.float32]:
+        """sun_directions() の方向ごとに、その時刻が代表する時間（時間）"""
+        ...
+
+    def possible_hours(self) -> float:
+        """遮蔽がないときの日照時間（評価時間帯のうち太陽が地平線より上にある時間の合計）"""
+        ...
+
+    def packet_count(self) -> int:
+        """太陽方向をまとめた256本のパケットの数。0なら全ての方向を1本ずつ遮蔽判定する（use_packets の説明を参照）"""
+        ...
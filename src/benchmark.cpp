@@ -0,0 +1,247 @@
+// 手続き的に生成した街区シーンでBVH構築・レイキャスト・天空率計算の性能を測り、JSONで出力する
+// 例: ./skyratio_benchmark --blocks 20 --checkpoints 2000 --output result.json
+#include "scene_raycaster.hpp"
+#include "sky_ratio_checker.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+namespace {
+struct BenchmarkConfig {
+  int blocks          = 10;   // 街区の数（blocks x blocks）
+  int lots            = 3;    // 1街区あたりの建物の数（lots x lots）
+  int trees           = 4;    // 1街区あたりの街路樹（球）の数
+  double block_size   = 80.0; // 街区の一辺 [m]
+  double street_width = 20.0; // 道路の幅 [m]
+  size_t rays         = 1000000;
+  size_t checkpoints  = 1000;
+  float resolution    = 1.0f;
+  int threads         = 0;
+  uint32_t seed       = 1;
+  std::string search  = "sweep";
+  std::string output;         // 空なら標準出力
+};
+
+// 標準ライブラリの分布は実装ごとに結果が違うので、乱数から直接 [0, 1) を作る
+class Random {
+  std::mt19937 engine;
+
+public:
+  explicit Random(uint32_t seed) : engine(seed) {}
+  double uniform() { return engine() * (1.0 / 4294967296.0); }
+  double uniform(double lo, double hi) { return lo + (hi - lo) * uniform(); }
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); }
+
+size_t peak_memory_bytes() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return static_cast<size_t>(usage.ru_maxrss); // macOSはバイト単位
+#else
+  return static_cast<size_t>(usage.ru_maxrss) * 1024; // Linuxはキロバイト単位
+#endif
+#endif
+}
+
+// 格子状の道路で区切られた街区に、高さの異なる建物と街路樹を並べる
+size_t generate_city(const BenchmarkConfig& config, SceneRaycaster& scene, Random& random) {
+  const double pitch = config.block_size + config.street_width;
+  const double lot   = config.block_size / config.lots;
+  size_t buildings   = 0;
+  for(int bx = 0; bx < config.blocks; bx++) {
+    for(int by = 0; by < config.blocks; by++) {
+      const double x0 = bx * pitch, y0 = by * pitch;
+      for(int i = 0; i < config.lots; i++) {
+        for(int j = 0; j < config.lots; j++) {
+          // 低層が多く高層が少ない分布
+          const double u      = random.uniform();
+          const double height = 6.0 + 90.0 * u * u * u;
+          const double w      = lot * random.uniform(0.55, 0.9);
+          const double d      = lot * random.uniform(0.55, 0.9);
+          const double yaw    = random.uniform() < 0.2 ? random.uniform(-0.3, 0.3) : 0.0;
+          scene.add_box({x0 + (i + 0.5) * lot, y0 + (j + 0.5) * lot, height / 2}, {w, d, height}, {0.0, 0.0, yaw});
+          buildings++;
+        }
+      }
+      for(int t = 0; t < config.trees; t++) {
+        // 街区の南側の歩道沿い
+        scene.add_sphere({x0 + random.uniform(0.0, config.block_size), y0 - config.street_width * 0.25, random.uniform(4.0, 6.0)}, random.uniform(1.5, 3.0));
+      }
+    }
+  }
+  return buildings;
+}
+
+// 道路上のランダムな点（歩行者の目線の高さ）
+Vec3 street_point(const BenchmarkConfig& config, Random& random) {
+  const double pitch  = config.block_size + config.street_width;
+  const double extent = config.blocks * pitch;
+  const double along  = random.uniform(0.0, extent);
+  const double across = std::floor(random.uniform(0.0, config.blocks)) * pitch - random.uniform(0.0, config.street_width);
+  return random.uniform() < 0.5 ? Vec3{along, across, 1.5} : Vec3{across, along, 1.5};
+}
+
+// 上半球のランダムな方向
+Vec3 sky_direction(Random& random) {
+  const double z   = random.uniform();
+  const double phi = random.uniform(0.0, 2.0 * M_PI);
+  const double r   = std::sqrt(1.0 - z * z);
+  return {r * std::cos(phi), r * std::sin(phi), z};
+}
+
+bool parse_search(const std::string& name, HorizonSearch& search) {
+  const std::pair<const char*, HorizonSearch> names[] = {{"sweep", HorizonSearch::Sweep}, {"descend", HorizonSearch::Descend}, {"bisection", HorizonSearch::Bisection}, {"guided", HorizonSearch::Guided}, {"projection", HorizonSearch::Projection}};
+  for(const auto& entry : names) {
+    if(name == entry.first) {
+      search = entry.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+void print_usage(const char* program) {
+  std::fprintf(stderr,
+               "Usage: %s [options]\n"
+               "  --blocks N         city size in blocks per side (default 10)\n"
+               "  --lots N           buildings per block side (default 3)\n"
+               "  --trees N          trees per block (default 4)\n"
+               "  --rays N           rays for the closest-hit / occlusion benchmarks (default 1000000)\n"
+               "  --checkpoints N    checkpoints for the sky ratio benchmark (default 1000)\n"
+               "  --resolution DEG   ray resolution in degrees (default 1.0)\n"
+               "  --search NAME      sweep | descend | bisection | guided | projection (default sweep)\n"
+               "  --threads N        worker threads, 0 for all cores (default 0)\n"
+               "  --seed N           random seed (default 1)\n"
+               "  --output PATH      write JSON to PATH instead of stdout\n",
+               program);
+}
+
+bool parse_args(int argc, char** argv, BenchmarkConfig& config) {
+  for(int i = 1; i + 1 < argc; i += 2) {
+    const char* key   = argv[i];
+    const char* value = argv[i + 1];
+    bool known        = false;
+    auto is           = [&](const char* name) { return std::strcmp(key, name) == 0 && (known = true); };
+    if(is("--blocks")) config.blocks = std::atoi(value);
+    if(is("--lots")) config.lots = std::atoi(value);
+    if(is("--trees")) config.trees = std::atoi(value);
+    if(is("--rays")) config.rays = std::strtoull(value, nullptr, 10);
+    if(is("--checkpoints")) config.checkpoints = std::strtoull(value, nullptr, 10);
+    if(is("--resolution")) config.resolution = static_cast<float>(std::atof(value));
+    if(is("--search")) config.search = value;
+    if(is("--threads")) config.threads = std::atoi(value);
+    if(is("--seed")) config.seed = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+    if(is("--output")) config.output = value;
+    if(!known) return false;
+  }
+  HorizonSearch search;
+  return argc % 2 == 1 && config.blocks > 0 && config.lots > 0 && config.trees >= 0 && config.rays > 0 && config.resolution > 0.0f && parse_search(config.search, search);
+}
+} // namespace
+
+int main(int argc, char** argv) {
+  BenchmarkConfig config;
+  if(!parse_args(argc, argv, config)) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  Random random(config.seed);
+
+  // シーンの生成とBVHの構築
+  SceneRaycaster scene;
+  const size_t buildings = generate_city(config, scene, random);
+  BuildOptions build_options;
+  build_options.threads = config.threads;
+  scene.set_build_options(build_options);
+  QueryStats build_stats;
+  auto start = std::chrono::steady_clock::now();
+  scene.build(&build_stats);
+  const double build_seconds = seconds_since(start);
+
+  // 最近接ヒットと遮蔽判定のレイ
+  std::vector<Vec3> origins(config.rays), directions(config.rays);
+  for(size_t i = 0; i < config.rays; i++) {
+    origins[i]    = street_point(config, random);
+    directions[i] = sky_direction(random);
+  }
+  start                        = std::chrono::steady_clock::now();
+  const auto hits              = scene.raycast(origins, directions);
+  const double raycast_seconds = seconds_since(start);
+  size_t hit_count             = 0;
+  for(const auto& hit : hits) hit_count += hit.hit ? 1 : 0;
+
+  start                          = std::chrono::steady_clock::now();
+  const auto mask                = scene.occluded(origins, directions);
+  const double occlusion_seconds = seconds_since(start);
+  size_t occluded_count          = 0;
+  for(size_t i = 0; i < config.rays; i++) occluded_count += mask_test(mask, i) ? 1 : 0;
+
+  // 天空率の計算
+  SkyRatioChecker checker;
+  checker.ray_resolution = config.resolution;
+  checker.num_threads    = config.threads;
+  checker.collect_stats  = true;
+  parse_search(config.search, checker.horizon_search);
+  for(size_t i = 0; i < config.checkpoints; i++) checker.checkpoints.push_back(street_point(config, random));
+  start                      = std::chrono::steady_clock::now();
+  const auto ratios          = checker.check(&scene);
+  const double check_seconds = seconds_since(start);
+  double ratio_sum           = 0.0;
+  for(float r : ratios) ratio_sum += r;
+  const QueryStats stats = checker.stats();
+
+  // 同じ測定点で、遮蔽判定をパケット（最近接ヒットの走査）で行った場合（Sweep のみ効く）
+  checker.use_packet_occlusion      = true;
+  start                             = std::chrono::steady_clock::now();
+  const auto packet_ratios          = checker.check(&scene);
+  const double packet_check_seconds = seconds_since(start);
+
+  FILE* out = config.output.empty() ? stdout : std::fopen(config.output.c_str(), "w");
+  if(out == nullptr) {
+    std::fprintf(stderr, "Failed to open file for writing: %s\n", config.output.c_str());
+    return 1;
+  }
+  auto per_second = [](double count, double seconds) { return seconds > 0.0 ? count / seconds : 0.0; };
+  std::fprintf(out, "{\n");
+  std::fprintf(out, "  \"config\": {\"blocks\": %d, \"lots\": %d, \"trees\": %d, \"rays\": %zu, \"checkpoints\": %zu, \"resolution\": %g, \"search\": \"%s\", \"threads\": %d, \"seed\": %u},\n", config.blocks,
+               config.lots, config.trees, config.rays, config.checkpoints, config.resolution, config.search.c_str(), config.threads, config.seed);
+  std::fprintf(out, "  \"scene\": {\"buildings\": %zu, \"triangles\": %zu, \"memory_bytes\": %zu},\n", buildings, scene.triangle_count(), scene.memory_usage());
+  std::fprintf(out, "  \"build\": {\"seconds\": %.6f, \"tessellation_seconds\": %.6f, \"bvh_seconds\": %.6f},\n", build_seconds, build_stats.tessellation_seconds, build_stats.build_seconds);
+  std::fprintf(out, "  \"closest_hit\": {\"rays\": %zu, \"hits\": %zu, \"seconds\": %.6f, \"rays_per_second\": %.1f},\n", config.rays, hit_count, raycast_seconds, per_second(config.rays, raycast_seconds));
+  std::fprintf(out, "  \"occlusion\": {\"rays\": %zu, \"occluded\": %zu, \"seconds\": %.6f, \"rays_per_second\": %.1f},\n", config.rays, occluded_count, occlusion_seconds, per_second(config.rays, occlusion_seconds));
+  std::fprintf(out, "  \"check\": {\"checkpoints\": %zu, \"seconds\": %.6f, \"checkpoints_per_second\": %.1f, \"mean_ratio\": %.6f},\n", ratios.size(), check_seconds, per_second(ratios.size(), check_seconds),
+               ratios.empty() ? 0.0 : ratio_sum / ratios.size());
+  std::fprintf(out, "  \"check_packet_occlusion\": {\"seconds\": %.6f, \"checkpoints_per_second\": %.1f, \"speedup\": %.3f, \"same_result\": %s},\n", packet_check_seconds, per_second(packet_ratios.size(), packet_check_seconds),
+               packet_check_seconds > 0.0 ? check_seconds / packet_check_seconds : 0.0, packet_ratios == ratios ? "true" : "false");
+  std::fprintf(out, "  \"check_stages\": {\"setup_seconds\": %.6f, \"traversal_seconds\": %.6f, \"conversion_seconds\": %.6f, \"integration_seconds\": %.6f, \"rays\": %llu, \"hits\": %llu, \"projected\": %llu},\n", stats.setup_seconds,
+               stats.traversal_seconds, stats.conversion_seconds, stats.integration_seconds, static_cast<unsigned long long>(stats.rays), static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.projected));
+  std::fprintf(out, "  \"peak_memory_bytes\": %zu\n", peak_memory_bytes());
+  std::fprintf(out, "}\n");
+  if(out != stdout) std::fclose(out);
+  return 0;
+}
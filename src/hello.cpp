@@ -1,13 +1,77 @@
 #include <nanobind/nanobind.h>
+#include <nanobind/ndarray.h>
 #include <nanobind/stl/array.h>
+#include <nanobind/stl/function.h>
 #include <nanobind/stl/string.h>
 #include <nanobind/stl/vector.h>
 
+#include "mesh_importer.hpp"
 #include "scene_raycaster.hpp"
 #include "sky_ratio_checker.hpp"
+#include "sunlight_checker.hpp"
+
+#include <algorithm>
+#include <type_traits>
 
 namespace nb = nanobind;
 
+namespace {
+// Nx3 の連続配列（float32 / float64）
+using PointArray = nb::ndarray<nb::shape<-1, 3>, nb::c_contig, nb::device::cpu>;
+
+// dtypeに応じて float / double のポインタで処理する
+template <typename Fn> decltype(auto) visit_points(const PointArray& a, Fn&& fn) {
+  if(a.dtype() == nb::dtype<float>()) return fn(static_cast<const float*>(a.data()));
+  if(a.dtype() == nb::dtype<double>()) return fn(static_cast<const double*>(a.data()));
+  throw nb::type_error("expected a float32 or float64 array of shape (N, 3)");
+}
+
+// origins と directions を同じ型のポインタで処理する
+template <typename Fn> void visit_ray_arrays(const PointArray& origins, const PointArray& directions, Fn&& fn) {
+  if(origins.shape(0) != directions.shape(0)) throw nb::value_error("origins and directions must have the same length");
+  if(origins.dtype() != directions.dtype()) throw nb::type_error("origins and directions must have the same dtype");
+  visit_points(origins, [&](auto* o) {
+    using T = std::remove_const_t<std::remove_pointer_t<decltype(o)>>;
+    fn(o, static_cast<const T*>(directions.data()), origins.shape(0));
+  });
+}
+
+std::vector<Vec3> to_vec3_vector(const PointArray& a) {
+  return visit_points(a, [&](auto* p) {
+    std::vector<Vec3> out(a.shape(0));
+    for(size_t i = 0; i < out.size(); i++) out[i] = {(double)p[i * 3], (double)p[i * 3 + 1], (double)p[i * 3 + 2]};
+    return out;
+  });
+}
+
+// 新しく確保したバッファをNumPy配列として返す（解放はPython側のcapsuleが行う）
+template <typename T> nb::ndarray<nb::numpy, T> new_numpy(std::initializer_list<size_t> shape, T** data) {
+  size_t size = 1;
+  for(size_t n : shape) size *= n;
+  T* buffer = new T[size]();
+  nb::capsule owner(buffer, [](void* p) noexcept { delete[] static_cast<T*>(p); });
+  *data = buffer;
+  return nb::ndarray<nb::numpy, T>(buffer, shape, owner);
+}
+
+// [バリエーション][測定点] の天空率を (V, N) の配列にして、先頭との差と合わせてdictで返す
+nb::dict ratio_matrix(const std::vector<std::vector<float>>& ratios) {
+  const auto differences = SkyRatioChecker::ratio_differences(ratios);
+  const size_t n         = ratios.empty() ? 0 : ratios[0].size();
+  float *r, *d;
+  auto ratio_array      = new_numpy<float>({ratios.size(), n}, &r);
+  auto difference_array = new_numpy<float>({ratios.size(), n}, &d);
+  for(size_t v = 0; v < ratios.size(); v++) {
+    std::copy(ratios[v].begin(), ratios[v].end(), r + v * n);
+    std::copy(differences[v].begin(), differences[v].end(), d + v * n);
+  }
+  nb::dict result;
+  result["ratios"]      = nb::cast(ratio_array);
+  result["differences"] = nb::cast(difference_array);
+  return result;
+}
+} // namespace
+
 // Pythonモジュールの定義
 NB_MODULE(skyratio_calc, m) {
   m.doc() = "天空率計算プロジェクト";
@@ -19,26 +83,385 @@ NB_MODULE(skyratio_calc, m) {
     .def_rw("position", &HitResult::position) //
     .def_rw("distance", &HitResult::distance);
 
+  // BVHの構築方法・レイアウト
+  nb::enum_<BvhBuilder>(m, "BvhBuilder")          //
+    .value("Binned", BvhBuilder::Binned)           //
+    .value("Quick", BvhBuilder::Quick)             //
+    .value("HighQuality", BvhBuilder::HighQuality);
+
+  nb::enum_<BvhLayout>(m, "BvhLayout")   //
+    .value("Standard", BvhLayout::Standard) //
+    .value("SoA", BvhLayout::SoA)           //
+    .value("Wide4", BvhLayout::Wide4)       //
+    .value("Wide8", BvhLayout::Wide8);
+
+  nb::class_<BuildOptions>(m, "BuildOptions")                                                                        //
+    .def(nb::init<>())                                                                                               //
+    .def_rw("builder", &BuildOptions::builder, "BVHの構築方法")                                                      //
+    .def_rw("layout", &BuildOptions::layout, "走査に使うノードレイアウト")                                           //
+    .def_rw("optimize", &BuildOptions::optimize, "構築後に木を最適化するかどうか")                                   //
+    .def_rw("analytic_primitives", &BuildOptions::analytic_primitives, "ボックス・球を解析的に交差判定するかどうか") //
+    .def_rw("threads", &BuildOptions::threads, "三角形分割・変換とBVHの構築に使うスレッド数（0以下なら論理コア数）");
+
+  nb::class_<CullOptions>(m, "CullOptions")                                                                                            //
+    .def(nb::init<>())                                                                                                                 //
+    .def_rw("min_elevation_deg", &CullOptions::min_elevation_deg, "この仰角以上のレイが届かない三角形を除く")                          //
+    .def_rw("min_angular_size_deg", &CullOptions::min_angular_size_deg, "見かけの大きさがこの角度未満の三角形を除く（0なら除かない）") //
+    .def_rw("merge_small", &CullOptions::merge_small, "除く代わりに近くの小さな三角形ごとに箱へまとめる");
+
+  // 段階ごとの時間とカウンタ
+  nb::class_<QueryStats>(m, "QueryStats")                                                                //
+    .def(nb::init<>())                                                                                   //
+    .def_ro("total_seconds", &QueryStats::total_seconds, "呼び出し全体の経過時間(秒)")                   //
+    .def_ro("tessellation_seconds", &QueryStats::tessellation_seconds, "三角形分割と変換の時間(秒)")     //
+    .def_ro("build_seconds", &QueryStats::build_seconds, "BVHの構築・リフィットの時間(秒)")              //
+    .def_ro("setup_seconds", &QueryStats::setup_seconds, "方向表の作成とレイの生成の時間(秒)")           //
+    .def_ro("traversal_seconds", &QueryStats::traversal_seconds, "BVHの走査の時間(秒)")                  //
+    .def_ro("conversion_seconds", &QueryStats::conversion_seconds, "走査結果の変換の時間(秒)")           //
+    .def_ro("integration_seconds", &QueryStats::integration_seconds, "ホライズンの抽出と積分の時間(秒)") //
+    .def_ro("builds", &QueryStats::builds, "BVHを作り直した回数")                                        //
+    .def_ro("refits", &QueryStats::refits, "BVHをリフィットした回数")                                    //
+    .def_ro("rays", &QueryStats::rays, "飛ばしたレイの数")                                               //
+    .def_ro("hits", &QueryStats::hits, "当たった（遮られた）レイの数")                                   //
+    .def_ro("scalar_nodes_visited", &QueryStats::scalar_nodes_visited, "1本ずつの走査で訪れたノード数")  //
+    .def_ro("projected", &QueryStats::projected, "Projectionで投影した三角形・ボックス・球の数")         //
+    .def_ro("checkpoints", &QueryStats::checkpoints, "評価した測定点の数")                               //
+    .def_ro("allocations", &QueryStats::allocations, "問い合わせごとに確保した作業バッファの数");
+
+  // 問い合わせの作業バッファ（繰り返し呼ぶ raycast に渡して確保を省く）
+  nb::class_<QueryContext>(m, "QueryContext") //
+    .def(nb::init<>())                        //
+    .def("memory_usage", &QueryContext::memory_usage, "確保済みの作業バッファの大きさ(バイト)");
+
   // SceneRaycasterクラス
   nb::class_<SceneRaycaster>(m, "SceneRaycaster")           //
     .def(nb::init<>())                                      //
     .def("clear", &SceneRaycaster::clear, "シーンをクリア") //
-    .def("add_box", &SceneRaycaster::add_box, nb::arg("pos"), nb::arg("size"), nb::arg("euler"), "ボックスを追加")
+    .def("add_box", &SceneRaycaster::add_box, nb::arg("pos"), nb::arg("size"), nb::arg("euler"), "ボックスを追加してIDを返す")
     .def("add_sphere", &SceneRaycaster::add_sphere, nb::arg("center"), nb::arg("radius"),
-         "球体を追加") //
-    .def("add_mesh", &SceneRaycaster::add_mesh, nb::arg("vertices"),
+         "球体を追加してIDを返す") //
+    .def(
+      "add_mesh", [](SceneRaycaster& s, const PointArray& vertices) { visit_points(vertices, [&](auto* v) { s.add_mesh(v, vertices.shape(0)); }); }, nb::arg("vertices"), "メッシュを追加（(N, 3)のNumPy配列）")
+    .def("add_mesh", nb::overload_cast<const std::vector<Vec3>&>(&SceneRaycaster::add_mesh), nb::arg("vertices"),
          "メッシュを追加") //
-    .def("build", &SceneRaycaster::build, "BVHを構築")
-    .def("raycast", &SceneRaycaster::raycast, nb::arg("origins"), nb::arg("directions"), "レイキャストを実行")
+    .def("add_indexed_mesh", &SceneRaycaster::add_indexed_mesh, nb::arg("vertices"), nb::arg("indices"), "頂点とインデックスでメッシュを追加")
+    .def(
+      "import_mesh",
+      [](SceneRaycaster& s, const std::string& filepath, bool weld, double weld_tolerance, std::function<void(size_t, size_t)> progress) {
+        MeshImportOptions options;
+        options.weld_vertices  = weld;
+        options.weld_tolerance = weld_tolerance;
+        if(progress) {
+          // 読み込み中はGILを解放しているので、コールバックを呼ぶ間だけ取り直す
+          options.progress = [&progress](size_t processed, size_t total) {
+            nb::gil_scoped_acquire acquire;
+            progress(processed, total);
+          };
+        }
+        nb::gil_scoped_release release;
+        return import_mesh(s, filepath.c_str(), options);
+      },
+      nb::arg("filepath"), nb::arg("weld") = false, nb::arg("weld_tolerance") = 0.0, nb::arg("progress").none() = nb::none(), "STL / OBJ / PLY ファイルを読み込んでメッシュを追加し、追加した三角形数を返す")
+    .def("update_box", &SceneRaycaster::update_box, nb::arg("id"), nb::arg("pos"), nb::arg("size"), nb::arg("euler"), "ボックスの位置・サイズ・回転を変更")
+    .def("update_sphere", &SceneRaycaster::update_sphere, nb::arg("id"), nb::arg("center"), nb::arg("radius"), "球体の位置・半径を変更")
+    .def("remove_box", &SceneRaycaster::remove_box, nb::arg("id"), "ボックスを削除")
+    .def("remove_sphere", &SceneRaycaster::remove_sphere, nb::arg("id"), "球体を削除")
+    .def("needs_build", &SceneRaycaster::needs_build, "次のbuildで再構築・リフィットが必要かどうか")
+    .def("triangle_count", &SceneRaycaster::triangle_count, "build後の三角形数")
+    .def("has_geometry", &SceneRaycaster::has_geometry, "build後に交差判定する形状があるかどうか")
+    .def("content_hash", &SceneRaycaster::content_hash, "build時点の形状の内容のハッシュ")
+    .def("build", [](SceneRaycaster& s) { s.build(); }, nb::call_guard<nb::gil_scoped_release>(), "BVHを構築（三角形分割と変換は build_options.threads で並列に行う）")
+    .def_prop_rw("collect_stats", &SceneRaycaster::collect_stats, &SceneRaycaster::set_collect_stats, "build / raycast / occluded の時間とカウンタを集計するかどうか")
+    .def("stats", &SceneRaycaster::stats, "collect_stats を有効にしてからの計測の積算")
+    .def("reset_stats", &SceneRaycaster::reset_stats, "計測の積算を0に戻す")
+    .def_prop_rw(
+      "build_options", [](const SceneRaycaster& s) { return s.get_build_options(); }, &SceneRaycaster::set_build_options, "BVHの構築方法・レイアウト（コピーを返すので、変更したものを代入する）")
+    .def("traversal_layout", &SceneRaycaster::traversal_layout, "実際に走査に使っているレイアウト")
+    .def_static("layout_supported", &SceneRaycaster::layout_supported, nb::arg("layout"), "このビルドでレイアウトが使えるかどうか")
+    .def_prop_rw("compact_storage", &SceneRaycaster::compact_storage, &SceneRaycaster::set_compact_storage, "単精度の共有頂点＋インデックスで形状を保持するかどうか")
+    .def("release_host_geometry", &SceneRaycaster::release_host_geometry, "BVHを構築した上で vertices / indices を解放する（コンパクトモードのみ）")
+    .def("memory_usage", &SceneRaycaster::memory_usage, "形状データとBVHのおおよそのメモリ使用量(バイト)")
+    .def(
+      "raycast",
+      [](const SceneRaycaster& s, const PointArray& origins, const PointArray& directions, QueryContext* context) {
+        const size_t n = origins.shape(0);
+        bool* hit;
+        double *position, *distance;
+        auto hit_array      = new_numpy<bool>({n}, &hit);
+        auto position_array = new_numpy<double>({n, 3}, &position);
+        auto distance_array = new_numpy<double>({n}, &distance);
+        {
+          nb::gil_scoped_release release;
+          visit_ray_arrays(origins, directions, [&](auto* o, auto* d, size_t count) { s.raycast(o, d, count, hit, position, distance, context); });
+        }
+        nb::dict result;
+        result["hit"]      = nb::cast(hit_array);
+        result["position"] = nb::cast(position_array);
+        result["distance"] = nb::cast(distance_array);
+        return result;
+      },
+      nb::arg("origins"), nb::arg("directions"), nb::arg("context") = nb::none(), "レイキャストを実行（(N, 3)のNumPy配列。hit / position / distance の配列をdictで返す）")
+    .def("raycast", nb::overload_cast<const std::vector<Vec3>&, const std::vector<Vec3>&>(&SceneRaycaster::raycast, nb::const_), nb::arg("origins"), nb::arg("directions"), nb::call_guard<nb::gil_scoped_release>(), "レイキャストを実行")
+    .def("is_occluded", &SceneRaycaster::is_occluded, nb::arg("origin"), nb::arg("direction"), "1本のレイが遮られるかどうか")
+    .def(
+      "occluded",
+      [](const SceneRaycaster& s, const PointArray& origins, const PointArray& directions) {
+        uint64_t* mask;
+        auto mask_array = new_numpy<uint64_t>({(origins.shape(0) + 63) / 64}, &mask);
+        {
+          nb::gil_scoped_release release;
+          visit_ray_arrays(origins, directions, [&](auto* o, auto* d, size_t count) { s.occluded(o, d, count, mask); });
+        }
+        return mask_array;
+      },
+      nb::arg("origins"), nb::arg("directions"), "遮蔽判定のみを行う（(N, 3)のNumPy配列。uint64のビットマスク配列を返す）")
+    .def("occluded", nb::overload_cast<const std::vector<Vec3>&, const std::vector<Vec3>&>(&SceneRaycaster::occluded, nb::const_), nb::arg("origins"), nb::arg("directions"), nb::call_guard<nb::gil_scoped_release>(), "遮蔽判定のみを行い、64本ずつ詰めたビットマスクを返す")
     .def("save", &SceneRaycaster::save, nb::arg("filepath"), "頂点データをSTLファイルに保存")
-    .def_rw("vertices", &SceneRaycaster::vertices, "頂点リスト")
-    .def_rw("indices", &SceneRaycaster::indices, "インデックスリスト");
+    .def("extract_region", &SceneRaycaster::extract_region, nb::arg("region_min"), nb::arg("region_max"), nb::arg("options") = CullOptions(), nb::call_guard<nb::gil_scoped_release>(), "領域内の測定点から見て影響しうる三角形だけを集めたシーンを作る")
+    .def("save_scene", &SceneRaycaster::save_scene, nb::arg("filepath"), "BVHを含むシーン全体をバイナリ形式で保存")
+    .def("load_scene", &SceneRaycaster::load_scene, nb::arg("filepath"), nb::call_guard<nb::gil_scoped_release>(), "save_sceneで保存したシーンを読み込む（BVHは再構築しない）")
+    .def_prop_rw(
+      "vertices", [](const SceneRaycaster& s) { return s.vertices; },
+      [](SceneRaycaster& s, std::vector<Vec3> v) {
+        s.vertices = std::move(v);
+        s.mark_dirty();
+      },
+      "頂点リスト")
+    .def_prop_rw(
+      "indices", [](const SceneRaycaster& s) { return s.indices; },
+      [](SceneRaycaster& s, std::vector<Vec3i> v) {
+        s.indices = std::move(v);
+        s.mark_dirty();
+      },
+      "インデックスリスト");
+
+  // 遠くの形状の除去
+  nb::enum_<FarFieldCulling>(m, "FarFieldCulling") //
+    .value("Off", FarFieldCulling::Off)             //
+    .value("Exact", FarFieldCulling::Exact)         //
+    .value("Prune", FarFieldCulling::Prune)         //
+    .value("Merge", FarFieldCulling::Merge);
+
+  // ホライズン探索方法
+  nb::enum_<HorizonSearch>(m, "HorizonSearch")   //
+    .value("Sweep", HorizonSearch::Sweep)         //
+    .value("Descend", HorizonSearch::Descend)     //
+    .value("Bisection", HorizonSearch::Bisection) //
+    .value("Guided", HorizonSearch::Guided)       //
+    .value("Projection", HorizonSearch::Projection);
+
+  // 測定点ごとのホライズン
+  nb::class_<HorizonProfiles>(m, "HorizonProfiles")
+    .def(nb::init<>())
+    .def_rw("resolution", &HorizonProfiles::resolution, "作成時の ray_resolution(度)")
+    .def_rw("theta_steps", &HorizonProfiles::theta_steps, "仰角の最大のインデックス（仰角は 20 + t * resolution 度）")
+    .def_rw("phi_steps", &HorizonProfiles::phi_steps, "方位角の刻み数（方位角は 360 * p / phi_steps 度）")
+    .def_prop_rw(
+      "horizon",
+      [](const HorizonProfiles& h) {
+        int16_t* data;
+        auto array = new_numpy<int16_t>({h.size(), static_cast<size_t>(h.phi_steps)}, &data);
+        std::copy(h.horizon.begin(), h.horizon.end(), data);
+        return array;
+      },
+      [](HorizonProfiles& h, const nb::ndarray<int16_t, nb::shape<-1, -1>, nb::c_contig, nb::device::cpu>& array) {
+        h.phi_steps = static_cast<int>(array.shape(1));
+        h.horizon.assign(array.data(), array.data() + array.size());
+      },
+      "遮られた最も高い仰角のインデックス（遮蔽がなければ-1）を (測定点, phi_steps) のint16のNumPy配列で返す（代入すると phi_steps も変わる）")
+    .def("__len__", &HorizonProfiles::size);
 
   // SkyRatioCheckerクラス
   nb::class_<SkyRatioChecker>(m, "SkyRatioChecker")
     .def(nb::init<>())
-    .def_rw("checkpoints", &SkyRatioChecker::checkpoints, "測定点のリスト")
+    .def_prop_rw(
+      "checkpoints", [](const SkyRatioChecker& c) { return c.checkpoints; },
+      [](SkyRatioChecker& c, nb::handle value) {
+        // (N, 3)のNumPy配列ならリストを経由せずに読み込む
+        PointArray array;
+        if(nb::try_cast(value, array, false)) {
+          c.checkpoints = to_vec3_vector(array);
+        } else {
+          c.checkpoints = nb::cast<std::vector<Vec3>>(value);
+        }
+      },
+      "測定点のリスト（(N, 3)のNumPy配列も代入可能）")
     .def_rw("ray_resolution", &SkyRatioChecker::ray_resolution, "レイの刻み角度(度)")
     .def_rw("use_safe_side", &SkyRatioChecker::use_safe_side, "安全側評価（内接近似）を使うかどうか")
-    .def("check", &SkyRatioChecker::check, "天空率を計算");
+    .def_rw("num_threads", &SkyRatioChecker::num_threads, "並列実行するスレッド数（0以下なら論理コア数）")
+    .def_rw("use_occlusion_query", &SkyRatioChecker::use_occlusion_query, "遮蔽判定のみのクエリ（1本ずつ、最初に当たった時点で打ち切る）を使うかどうか")
+    .def_rw("use_packet_occlusion", &SkyRatioChecker::use_packet_occlusion, "遮蔽判定を256本のパケット（最近接ヒットの走査）で行うかどうか")
+    .def_rw("horizon_search", &SkyRatioChecker::horizon_search, "方位角ごとの遮蔽境界の求め方")
+    .def_rw("horizon_tolerance", &SkyRatioChecker::horizon_tolerance, "Bisectionで探索を打ち切る角度幅(度)")
+    .def_rw("far_field_culling", &SkyRatioChecker::far_field_culling, "測定点の領域ごとに遠くの形状を除いたシーンで計算するかどうか")
+    .def_rw("culling_region_size", &SkyRatioChecker::culling_region_size, "測定点をまとめる領域の一辺")
+    .def_rw("collect_stats", &SkyRatioChecker::collect_stats, "段階ごとの時間とカウンタを集計するかどうか")
+    .def("stats", &SkyRatioChecker::stats, "直前の check などの計測（collect_stats が有効な場合のみ）")
+    .def_rw("result_cache_path", &SkyRatioChecker::result_cache_path, "check の結果キャッシュのファイル（空ならキャッシュしない）")
+    .def("set_grid_checkpoints", &SkyRatioChecker::set_grid_checkpoints, nb::arg("polygon"), nb::arg("spacing"), nb::arg("height"), "多角形の内側の格子点を測定点にする（ヒルベルト曲線の順）")
+    .def("set_polyline_checkpoints", &SkyRatioChecker::set_polyline_checkpoints, nb::arg("polyline"), nb::arg("spacing"), nb::arg("height"), "折れ線に沿って等間隔の測定点を置く")
+    .def("check", &SkyRatioChecker::check, nb::arg("scene"), nb::call_guard<nb::gil_scoped_release>(), "天空率を計算")
+    .def(
+      "check_array",
+      [](SkyRatioChecker& c, SceneRaycaster* scene) {
+        std::vector<float> ratios;
+        {
+          nb::gil_scoped_release release;
+          ratios = c.check(scene);
+        }
+        float* data;
+        auto array = new_numpy<float>({ratios.size()}, &data);
+        std::copy(ratios.begin(), ratios.end(), data);
+        return array;
+      },
+      nb::arg("scene"), "天空率を計算してfloat32のNumPy配列で返す")
+    .def(
+      "check_stream",
+      [](SkyRatioChecker& c, SceneRaycaster* scene, nb::callable callback, size_t start, size_t chunk_size) {
+        nb::gil_scoped_release release;
+        return c.check_stream(
+          scene,
+          [&callback](const CheckChunk& chunk) {
+            // 評価中はGILを解放しているので、コールバックを呼ぶ間だけ取り直す
+            nb::gil_scoped_acquire acquire;
+            float* data;
+            auto array = new_numpy<float>({chunk.count}, &data);
+            std::copy(chunk.ratios, chunk.ratios + chunk.count, data);
+            nb::object keep_going = callback(chunk.first, array);
+            return keep_going.is_none() || nb::cast<bool>(keep_going);
+          },
+          start, chunk_size);
+      },
+      nb::arg("scene"), nb::arg("callback"), nb::arg("start") = 0, nb::arg("chunk_size") = 1024,
+      "測定点をチャンクごとに評価して callback(first, ratios) を呼ぶ（Falseを返すと中断）。評価の終わった次の測定点の番号を返す")
+    .def("check_horizons", &SkyRatioChecker::check_horizons, nb::arg("scene"), nb::call_guard<nb::gil_scoped_release>(), "全測定点のホライズンを求める（integrate_horizons で天空率を求め直せる）")
+    .def(
+      "integrate_horizons",
+      [](const SkyRatioChecker& c, const HorizonProfiles& profiles, bool safe_side, double azimuth_from, double azimuth_to) {
+        std::vector<float> ratios;
+        {
+          nb::gil_scoped_release release;
+          ratios = c.integrate_horizons(profiles, safe_side, azimuth_from, azimuth_to);
+        }
+        float* data;
+        auto array = new_numpy<float>({ratios.size()}, &data);
+        std::copy(ratios.begin(), ratios.end(), data);
+        return array;
+      },
+      nb::arg("profiles"), nb::arg("safe_side"), nb::arg("azimuth_from") = 0.0, nb::arg("azimuth_to") = 360.0, "ホライズンからレイを飛ばさずに天空率を求める（方位角の範囲(度)を指定するとその範囲の天空率）")
+    .def(
+      "check_scenes",
+      [](SkyRatioChecker& c, const std::vector<SceneRaycaster*>& scenes) {
+        std::vector<std::vector<float>> ratios;
+        {
+          nb::gil_scoped_release release;
+          ratios = c.check_scenes(scenes);
+        }
+        return ratio_matrix(ratios);
+      },
+      nb::arg("scenes"), "同じ測定点を複数のシーンでまとめて評価する（ratios / differences を (V, N) の配列で返す）")
+    .def(
+      "check_overlays",
+      [](SkyRatioChecker& c, SceneRaycaster* base, const std::vector<SceneRaycaster*>& overlays) {
+        std::vector<std::vector<float>> ratios;
+        {
+          nb::gil_scoped_release release;
+          ratios = c.check_overlays(base, overlays);
+        }
+        return ratio_matrix(ratios);
+      },
+      nb::arg("base"), nb::arg("overlays"), "共通のシーンに各overlayを重ねてまとめて評価する（ratios / differences を (V, N) の配列で返す）")
+    .def(
+      "ray_directions",
+      [](SkyRatioChecker& c) {
+        const DirectionSet& dirs = c.ray_directions();
+        float* data;
+        auto array = new_numpy<float>({dirs.size(), 3}, &data);
+        for(size_t i = 0; i < dirs.size(); i++) {
+          data[i * 3]     = dirs.x[i];
+          data[i * 3 + 1] = dirs.y[i];
+          data[i * 3 + 2] = dirs.z[i];
+        }
+        return array;
+      },
+      "天空率の計算に使うレイの方向（(N, 3)のfloat32のNumPy配列）")
+    .def(
+      "reduce_occlusion",
+      [](SkyRatioChecker& c, const nb::ndarray<uint64_t, nb::shape<-1, -1>, nb::c_contig, nb::device::cpu>& masks) {
+        // 測定点ごとの行をマスクに詰め替える
+        std::vector<OcclusionMask> rows(masks.shape(0));
+        const uint64_t* p = masks.data();
+        for(size_t i = 0; i < rows.size(); i++) rows[i].assign(p + i * masks.shape(1), p + (i + 1) * masks.shape(1));
+        nb::gil_scoped_release release;
+        return c.reduce_occlusion(rows);
+      },
+      nb::arg("masks"), "測定点ごとの遮蔽マスク（(M, W)のuint64のNumPy配列）からまとめて天空率を求める")
+    .def("reduce_occlusion", &SkyRatioChecker::reduce_occlusion, nb::arg("masks"), nb::call_guard<nb::gil_scoped_release>(), "ray_directions() の並びの遮蔽マスクのリストからまとめて天空率を求める");
+
+  // SunlightCheckerクラス
+  nb::class_<SunlightChecker>(m, "SunlightChecker")
+    .def(nb::init<>())
+    .def_prop_rw(
+      "checkpoints", [](const SunlightChecker& c) { return c.checkpoints; },
+      [](SunlightChecker& c, nb::handle value) {
+        // (N, 3)のNumPy配列ならリストを経由せずに読み込む
+        PointArray array;
+        if(nb::try_cast(value, array, false)) {
+          c.checkpoints = to_vec3_vector(array);
+        } else {
+          c.checkpoints = nb::cast<std::vector<Vec3>>(value);
+        }
+      },
+      "測定点のリスト（(N, 3)のNumPy配列も代入可能）")
+    .def_rw("latitude_deg", &SunlightChecker::latitude_deg, "緯度(度、北緯が正)")
+    .def_rw("first_day", &SunlightChecker::first_day, "最初の日（1月1日を1とする通し日）")
+    .def_rw("last_day", &SunlightChecker::last_day, "最後の日（first_day 以上、366以下）")
+    .def_rw("start_hour", &SunlightChecker::start_hour, "1日の評価時間帯の始め（真太陽時）")
+    .def_rw("end_hour", &SunlightChecker::end_hour, "1日の評価時間帯の終わり（真太陽時）")
+    .def_rw("time_step_minutes", &SunlightChecker::time_step_minutes, "時刻の刻み(分)")
+    .def_rw("north_azimuth_deg", &SunlightChecker::north_azimuth_deg, "真北の向き（度、x軸から反時計回り）")
+    .def_rw("num_threads", &SunlightChecker::num_threads, "並列実行するスレッド数（0以下なら論理コア数）")
+    .def_rw("use_packets", &SunlightChecker::use_packets, "太陽方向をパケットで走査するかどうか（Falseなら1本ずつ遮蔽判定する。日数と刻みが少ない設定ではTrueでもパケットにならない）")
+    .def_rw("collect_stats", &SunlightChecker::collect_stats, "段階ごとの時間とカウンタを集計するかどうか")
+    .def("stats", &SunlightChecker::stats, "直前の check の計測（collect_stats が有効な場合のみ）")
+    .def(
+      "check",
+      [](SunlightChecker& c, SceneRaycaster* scene) {
+        std::vector<float> hours;
+        {
+          nb::gil_scoped_release release;
+          hours = c.check(scene);
+        }
+        float* data;
+        auto array = new_numpy<float>({hours.size()}, &data);
+        std::copy(hours.begin(), hours.end(), data);
+        return array;
+      },
+      nb::arg("scene"), "各測定点の日照時間（first_day から last_day までの合計、時間）をfloat32のNumPy配列で返す")
+    .def(
+      "sun_directions",
+      [](SunlightChecker& c) {
+        const DirectionSet& dirs = c.sun_directions();
+        float* data;
+        auto array = new_numpy<float>({dirs.size(), 3}, &data);
+        for(size_t i = 0; i < dirs.size(); i++) {
+          data[i * 3]     = dirs.x[i];
+          data[i * 3 + 1] = dirs.y[i];
+          data[i * 3 + 2] = dirs.z[i];
+        }
+        return array;
+      },
+      "日照時間の計算に使う太陽の方向（(N, 3)のfloat32のNumPy配列）")
+    .def(
+      "sun_hours",
+      [](SunlightChecker& c) {
+        const std::vector<float>& hours = c.sun_hours();
+        float* data;
+        auto array = new_numpy<float>({hours.size()}, &data);
+        std::copy(hours.begin(), hours.end(), data);
+        return array;
+      },
+      "sun_directions() の方向ごとの時間（float32のNumPy配列）")
+    .def("possible_hours", &SunlightChecker::possible_hours, "遮蔽がないときの日照時間（時間）")
+    .def("packet_count", &SunlightChecker::packet_count, "太陽方向をまとめたパケットの数（0なら全て1本ずつ遮蔽判定する）");
 }
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <process.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// メモリマップトファイル（コピーせずにファイル内容を参照する）
+// copy_on_write なら書き込み可能にマップする。書き込んだページだけがこのプロセス内でコピーされ、ファイルは変わらない
+class MappedFile {
+private:
+  uint8_t* ptr  = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  HANDLE file    = INVALID_HANDLE_VALUE;
+  HANDLE mapping = nullptr;
+#endif
+
+  void close() {
+#ifdef _WIN32
+    if(ptr) UnmapViewOfFile(ptr);
+    if(mapping) CloseHandle(mapping);
+    if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    mapping = nullptr;
+    file    = INVALID_HANDLE_VALUE;
+#else
+    if(ptr) munmap(ptr, length);
+#endif
+    ptr    = nullptr;
+    length = 0;
+  }
+
+public:
+  explicit MappedFile(const char* filepath, bool copy_on_write = false) {
+#ifdef _WIN32
+    file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE) throw std::runtime_error(std::string("Failed to open file for reading: ") + filepath);
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    length = static_cast<size_t>(file_size.QuadPart);
+    if(length == 0) return;
+    mapping = CreateFileMappingA(file, nullptr, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+    if(mapping) ptr = static_cast<uint8_t*>(MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0));
+    if(!ptr) {
+      close();
+      throw std::runtime_error(std::string("Failed to map file: ") + filepath);
+    }
+#else
+    const int fd = ::open(filepath, O_RDONLY);
+    if(fd < 0) throw std::runtime_error(std::string("Failed to open file for reading: ") + filepath);
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error(std::string("Failed to stat file: ") + filepath);
+    }
+    length = static_cast<size_t>(st.st_size);
+    if(length > 0) {
+      void* p = mmap(nullptr, length, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error(std::string("Failed to map file: ") + filepath);
+      }
+      ptr = static_cast<uint8_t*>(p);
+    }
+    // マップ後はファイルディスクリプタが不要
+    ::close(fd);
+#endif
+  }
+  ~MappedFile() { close(); }
+
+  MappedFile(const MappedFile&)            = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data() const { return ptr; }
+  // copy_on_write でマップした場合のみ書き込める
+  uint8_t* mutable_data() const { return ptr; }
+  size_t size() const { return length; }
+};
+
+// path の隣に作る一時ファイルの名前（同時に書き出す他のプロセス・スレッドと重ならない）
+inline std::string unique_temp_path(const std::string& path) {
+  static std::atomic<uint64_t> serial{0};
+#ifdef _WIN32
+  const long pid = static_cast<long>(_getpid());
+#else
+  const long pid = static_cast<long>(getpid());
+#endif
+  return path + "." + std::to_string(pid) + "." + std::to_string(serial++) + ".tmp";
+}
+
+// 書き終えた temp で path を置き換える。失敗したら temp を消して false を返す
+// POSIX では path を開いている・マップしている他の読み手は古い内容のまま使い続けられる（Windows ではマップ中の path は置き換えられない）
+inline bool replace_file(const std::string& temp, const std::string& path) {
+#ifdef _WIN32
+  // std::rename は既存のファイルを置き換えないので、消さずに置き換える MoveFileEx を使う
+  const bool replaced = MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  const bool replaced = std::rename(temp.c_str(), path.c_str()) == 0;
+#endif
+  if(!replaced) std::remove(temp.c_str());
+  return replaced;
+}
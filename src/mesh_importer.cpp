@@ -0,0 +1,571 @@
+#include "mesh_importer.hpp"
+#include "mapped_file.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace {
+// 進捗を通知する間隔（バイト）
+constexpr size_t PROGRESS_INTERVAL = size_t{16} << 20;
+
+// 倍精度で厳密に表せる10の累乗
+constexpr double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// バイナリSTLのヘッダ（80バイト＋三角形数）と三角形1つ分のバイト数
+constexpr size_t STL_HEADER_BYTES = 84;
+constexpr size_t STL_FACET_BYTES  = 50;
+
+// 一定量読み進めるごとに options.progress を呼ぶ
+class Progress {
+private:
+  const std::function<void(size_t, size_t)>& fn;
+  const char* base;
+  size_t total;
+  size_t next = PROGRESS_INTERVAL;
+
+public:
+  Progress(const std::function<void(size_t, size_t)>& fn, const char* base, size_t total) : fn(fn), base(base), total(total) {}
+
+  void update(const char* p) {
+    if(!fn) return;
+    const size_t done = static_cast<size_t>(p - base);
+    if(done < next) return;
+    fn(done, total);
+    next = done + PROGRESS_INTERVAL;
+  }
+  void finish() {
+    if(fn) fn(total, total);
+  }
+};
+
+// 頂点とインデックスを組み立てる（溶接が有効なら同じ位置の頂点をまとめる）
+class MeshBuilder {
+private:
+  struct Key {
+    int64_t x, y, z;
+    bool operator==(const Key& o) const { return x == o.x && y == o.y && z == o.z; }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      uint64_t h = static_cast<uint64_t>(k.x) * 0x9E3779B97F4A7C15ull;
+      h ^= static_cast<uint64_t>(k.y) + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+      h ^= static_cast<uint64_t>(k.z) + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+      return static_cast<size_t>(h);
+    }
+  };
+
+  MeshData mesh;
+  bool weld;
+  double inv_tolerance;
+  std::unordered_map<Key, int, KeyHash> lookup;
+
+  int64_t cell(double v) const {
+    const double c = std::floor(v * inv_tolerance);
+    return static_cast<int64_t>(std::max(-9.0e18, std::min(9.0e18, c)));
+  }
+  Key key(const Vec3& v) const {
+    if(inv_tolerance > 0.0) return {cell(v[0]), cell(v[1]), cell(v[2])};
+    // 完全一致はビット列で比較する（-0.0 は 0.0 にそろえる）
+    Key k;
+    const double x = v[0] + 0.0, y = v[1] + 0.0, z = v[2] + 0.0;
+    std::memcpy(&k.x, &x, sizeof(double));
+    std::memcpy(&k.y, &y, sizeof(double));
+    std::memcpy(&k.z, &z, sizeof(double));
+    return k;
+  }
+
+public:
+  explicit MeshBuilder(const MeshImportOptions& options) : weld(options.weld_vertices), inv_tolerance(options.weld_vertices && options.weld_tolerance > 0.0 ? 1.0 / options.weld_tolerance : 0.0) {}
+
+  void reserve(size_t vertex_count, size_t triangle_count) {
+    mesh.vertices.reserve(vertex_count);
+    mesh.indices.reserve(triangle_count);
+    if(weld) lookup.reserve(vertex_count);
+  }
+
+  int add_vertex(const Vec3& v) {
+    if(mesh.vertices.size() >= static_cast<size_t>(std::numeric_limits<int>::max())) throw std::length_error("Too many vertices in mesh");
+    const int next = static_cast<int>(mesh.vertices.size());
+    if(weld) {
+      auto it = lookup.try_emplace(key(v), next).first;
+      if(it->second != next) return it->second;
+    }
+    mesh.vertices.push_back(v);
+    return next;
+  }
+
+  void add_triangle(int a, int b, int c) {
+    // 溶接で潰れた三角形は何にも当たらないので捨てる
+    if(weld && (a == b || b == c || a == c)) return;
+    mesh.indices.push_back(Vec3i{a, b, c});
+  }
+
+  // 多角形は扇形に三角形分割する
+  void add_polygon(const std::vector<int>& polygon) {
+    for(size_t i = 2; i < polygon.size(); i++) add_triangle(polygon[0], polygon[i - 1], polygon[i]);
+  }
+
+  MeshData take() { return std::move(mesh); }
+};
+
+// 数値を読む。成功したら p を数値の直後に進める
+// 有効数字19桁までを整数で受けてから10の累乗を掛ける（単精度でBVHに渡すので精度は十分）
+bool parse_number(const char*& p, const char* end, double& out) {
+  const char* s = p;
+  bool negative = false;
+  if(s < end && (*s == '+' || *s == '-')) negative = *s++ == '-';
+
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool any = false;
+  for(; s < end && *s >= '0' && *s <= '9'; s++, any = true) {
+    if(digits < 19) {
+      mantissa = mantissa * 10 + (*s - '0');
+      if(mantissa != 0) digits++;
+    } else {
+      exponent++;
+    }
+  }
+  if(s < end && *s == '.') {
+    for(s++; s < end && *s >= '0' && *s <= '9'; s++, any = true) {
+      if(digits < 19) {
+        mantissa = mantissa * 10 + (*s - '0');
+        if(mantissa != 0) digits++;
+        exponent--;
+      }
+    }
+  }
+  if(!any) return false;
+
+  if(s < end && (*s == 'e' || *s == 'E')) {
+    const char* e = s + 1;
+    bool exp_negative = false;
+    if(e < end && (*e == '+' || *e == '-')) exp_negative = *e++ == '-';
+    if(e < end && *e >= '0' && *e <= '9') {
+      int value = 0;
+      for(; e < end && *e >= '0' && *e <= '9'; e++) value = std::min(value * 10 + (*e - '0'), 10000);
+      exponent += exp_negative ? -value : value;
+      s = e;
+    }
+  }
+
+  double v = static_cast<double>(mantissa);
+  if(exponent < 0) {
+    v = -exponent <= 22 ? v / POW10[-exponent] : v * std::pow(10.0, exponent);
+  } else if(exponent > 0) {
+    v = exponent <= 22 ? v * POW10[exponent] : v * std::pow(10.0, exponent);
+  }
+  out = negative ? -v : v;
+  p   = s;
+  return true;
+}
+
+bool parse_integer(const char*& p, const char* end, long long& out) {
+  const char* s = p;
+  bool negative = false;
+  if(s < end && (*s == '+' || *s == '-')) negative = *s++ == '-';
+  if(s >= end || *s < '0' || *s > '9') return false;
+  long long value = 0;
+  for(; s < end && *s >= '0' && *s <= '9'; s++) value = std::min(value * 10 + (*s - '0'), static_cast<long long>(std::numeric_limits<int>::max()) * 4);
+  out = negative ? -value : value;
+  p   = s;
+  return true;
+}
+
+// テキスト形式用のカーソル（行番号をエラーメッセージに使う）
+class TextCursor {
+private:
+  const char* p;
+  const char* end;
+  const char* filepath;
+  Progress& progress;
+  size_t line = 1;
+
+  static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+public:
+  TextCursor(const char* begin, const char* end, const char* filepath, Progress& progress) : p(begin), end(end), filepath(filepath), progress(progress) {}
+
+  const char* position() const { return p; }
+  bool at_end() const { return p >= end; }
+
+  [[noreturn]] void fail(const std::string& what) const { throw std::runtime_error(std::string(filepath) + ":" + std::to_string(line) + ": " + what); }
+
+  // 改行を越えずに空白を飛ばす
+  void skip_spaces() {
+    while(p < end && is_space(*p)) p++;
+  }
+  // 改行も含めて空白を飛ばす
+  void skip_whitespace() {
+    for(; p < end && (is_space(*p) || *p == '\n'); p++) {
+      if(*p == '\n') line++;
+    }
+    progress.update(p);
+  }
+  bool at_line_end() {
+    skip_spaces();
+    return p >= end || *p == '\n';
+  }
+  // 次の行の先頭へ進める
+  void next_line() {
+    while(p < end && *p != '\n') p++;
+    if(p < end) {
+      p++;
+      line++;
+    }
+    progress.update(p);
+  }
+
+  // 空白区切りの語
+  std::string_view token() {
+    skip_spaces();
+    const char* s = p;
+    while(p < end && !is_space(*p) && *p != '\n') p++;
+    return std::string_view(s, static_cast<size_t>(p - s));
+  }
+  // 語の残り（OBJの "1/2/3" の "/2/3" など）を飛ばす
+  void skip_token() {
+    while(p < end && !is_space(*p) && *p != '\n') p++;
+  }
+
+  double number() {
+    skip_spaces();
+    double v;
+    if(!parse_number(p, end, v)) fail("Expected a number");
+    return v;
+  }
+  long long integer() {
+    skip_spaces();
+    long long v;
+    if(!parse_integer(p, end, v)) fail("Expected an integer");
+    return v;
+  }
+};
+
+void parse_ascii_stl(TextCursor& c, MeshBuilder& builder) {
+  std::vector<int> polygon;
+  for(c.skip_whitespace(); !c.at_end(); c.skip_whitespace()) {
+    const auto key = c.token();
+    if(key == "vertex") {
+      Vec3 v;
+      for(int k = 0; k < 3; k++) {
+        c.skip_whitespace();
+        v[k] = c.number();
+      }
+      polygon.push_back(builder.add_vertex(v));
+    } else if(key == "endloop") {
+      if(polygon.size() < 3) c.fail("Facet has fewer than 3 vertices");
+      builder.add_polygon(polygon);
+      polygon.clear();
+    } else {
+      // solid / facet normal / outer loop / endfacet / endsolid などは読み飛ばす（法線は使わない）
+      if(key == "facet" || key == "solid" || key == "endsolid") c.next_line();
+    }
+  }
+}
+
+void parse_binary_stl(const char* begin, const char* end, const char* filepath, Progress& progress, MeshBuilder& builder) {
+  uint32_t count;
+  std::memcpy(&count, begin + 80, sizeof(count));
+  if(static_cast<size_t>(end - begin) < STL_HEADER_BYTES + size_t{count} * STL_FACET_BYTES) throw std::runtime_error(std::string("Truncated binary STL: ") + filepath);
+
+  builder.reserve(size_t{count} * 3, count);
+  const char* facet = begin + STL_HEADER_BYTES;
+  for(uint32_t i = 0; i < count; i++, facet += STL_FACET_BYTES) {
+    // 法線(3)＋頂点(9)の単精度
+    float values[12];
+    std::memcpy(values, facet, sizeof(values));
+    int idx[3];
+    for(int k = 0; k < 3; k++) idx[k] = builder.add_vertex(Vec3{values[3 + k * 3], values[4 + k * 3], values[5 + k * 3]});
+    builder.add_triangle(idx[0], idx[1], idx[2]);
+    progress.update(facet);
+  }
+}
+
+void parse_stl(const char* begin, const char* end, const char* filepath, Progress& progress, MeshBuilder& builder) {
+  const size_t size = static_cast<size_t>(end - begin);
+  // "solid" で始まるバイナリSTLもあるので、サイズが三角形数と一致すればバイナリとみなす
+  if(size >= STL_HEADER_BYTES) {
+    uint32_t count;
+    std::memcpy(&count, begin + 80, sizeof(count));
+    if(size == STL_HEADER_BYTES + size_t{count} * STL_FACET_BYTES) {
+      parse_binary_stl(begin, end, filepath, progress, builder);
+      return;
+    }
+  }
+  if(size >= 5 && std::memcmp(begin, "solid", 5) == 0) {
+    TextCursor cursor(begin, end, filepath, progress);
+    parse_ascii_stl(cursor, builder);
+    return;
+  }
+  if(size < STL_HEADER_BYTES) throw std::runtime_error(std::string("Not an STL file: ") + filepath);
+  parse_binary_stl(begin, end, filepath, progress, builder);
+}
+
+void parse_obj(TextCursor& c, MeshBuilder& builder) {
+  // OBJの頂点番号から溶接後の頂点番号への対応
+  std::vector<int> remap;
+  std::vector<int> polygon;
+  for(; !c.at_end(); c.next_line()) {
+    const auto key = c.token();
+    if(key == "v") {
+      const double x = c.number();
+      const double y = c.number();
+      const double z = c.number();
+      remap.push_back(builder.add_vertex(Vec3{x, y, z}));
+    } else if(key == "f") {
+      polygon.clear();
+      while(!c.at_line_end()) {
+        // "v", "v/vt", "v//vn", "v/vt/vn" の v だけを使う。負の番号は末尾からの相対指定
+        long long i = c.integer();
+        c.skip_token();
+        i = i > 0 ? i - 1 : static_cast<long long>(remap.size()) + i;
+        if(i < 0 || i >= static_cast<long long>(remap.size())) c.fail("Vertex index out of range");
+        polygon.push_back(remap[static_cast<size_t>(i)]);
+      }
+      if(polygon.size() < 3) c.fail("Face has fewer than 3 vertices");
+      builder.add_polygon(polygon);
+    }
+    // vt / vn / g / o / usemtl / mtllib / s / コメントなどは読み飛ばす
+  }
+}
+
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+PlyType parse_ply_type(std::string_view name, const TextCursor& c) {
+  if(name == "char" || name == "int8") return PlyType::Int8;
+  if(name == "uchar" || name == "uint8") return PlyType::UInt8;
+  if(name == "short" || name == "int16") return PlyType::Int16;
+  if(name == "ushort" || name == "uint16") return PlyType::UInt16;
+  if(name == "int" || name == "int32") return PlyType::Int32;
+  if(name == "uint" || name == "uint32") return PlyType::UInt32;
+  if(name == "float" || name == "float32") return PlyType::Float32;
+  if(name == "double" || name == "float64") return PlyType::Float64;
+  c.fail("Unknown PLY property type: " + std::string(name));
+}
+
+struct PlyProperty {
+  std::string name;
+  PlyType type;
+  bool is_list        = false;
+  PlyType count_type  = PlyType::UInt8;
+};
+
+struct PlyElement {
+  std::string name;
+  size_t count = 0;
+  std::vector<PlyProperty> properties;
+};
+
+// PLYの本体を ASCII / バイナリ共通のインターフェースで読む
+class PlyValueReader {
+private:
+  TextCursor& cursor;
+  const char* p = nullptr;
+  const char* end;
+  bool binary;
+  bool swap;
+  const char* filepath;
+
+  template <typename T> double load() {
+    if(static_cast<size_t>(end - p) < sizeof(T)) throw std::runtime_error(std::string("Truncated PLY file: ") + filepath);
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, p, sizeof(T));
+    if(swap) std::reverse(bytes, bytes + sizeof(T));
+    T v;
+    std::memcpy(&v, bytes, sizeof(T));
+    p += sizeof(T);
+    return static_cast<double>(v);
+  }
+
+public:
+  PlyValueReader(TextCursor& cursor, const char* end, bool binary, bool swap, const char* filepath) : cursor(cursor), end(end), binary(binary), swap(swap), filepath(filepath) {
+    if(binary) p = cursor.position();
+  }
+
+  const char* position() const { return binary ? p : cursor.position(); }
+
+  double value(PlyType type) {
+    if(!binary) {
+      cursor.skip_whitespace();
+      return cursor.number();
+    }
+    switch(type) {
+      case PlyType::Int8: return load<int8_t>();
+      case PlyType::UInt8: return load<uint8_t>();
+      case PlyType::Int16: return load<int16_t>();
+      case PlyType::UInt16: return load<uint16_t>();
+      case PlyType::Int32: return load<int32_t>();
+      case PlyType::UInt32: return load<uint32_t>();
+      case PlyType::Float32: return load<float>();
+      case PlyType::Float64: return load<double>();
+    }
+    return 0.0;
+  }
+
+  size_t list_count(PlyType type) {
+    const double n = value(type);
+    if(n < 0.0 || n > static_cast<double>(std::numeric_limits<int>::max())) throw std::runtime_error(std::string("Invalid list length in PLY file: ") + filepath);
+    return static_cast<size_t>(n);
+  }
+};
+
+void parse_ply(const char* begin, const char* end, const char* filepath, Progress& progress, MeshBuilder& builder) {
+  TextCursor c(begin, end, filepath, progress);
+  if(c.token() != "ply") c.fail("Not a PLY file");
+  c.next_line();
+
+  // ヘッダ
+  std::vector<PlyElement> elements;
+  bool binary = false, little_endian = true;
+  for(;; c.next_line()) {
+    if(c.at_end()) c.fail("Missing end_header");
+    const auto key = c.token();
+    if(key == "format") {
+      const auto format = c.token();
+      if(format == "ascii") {
+        binary = false;
+      } else if(format == "binary_little_endian") {
+        binary        = true;
+        little_endian = true;
+      } else if(format == "binary_big_endian") {
+        binary        = true;
+        little_endian = false;
+      } else {
+        c.fail("Unknown PLY format: " + std::string(format));
+      }
+    } else if(key == "element") {
+      PlyElement element;
+      element.name        = std::string(c.token());
+      const long long num = c.integer();
+      if(num < 0) c.fail("Invalid element count");
+      element.count = static_cast<size_t>(num);
+      elements.push_back(std::move(element));
+    } else if(key == "property") {
+      if(elements.empty()) c.fail("Property before element");
+      PlyProperty property;
+      auto type = c.token();
+      if(type == "list") {
+        property.is_list    = true;
+        property.count_type = parse_ply_type(c.token(), c);
+        type                = c.token();
+      }
+      property.type = parse_ply_type(type, c);
+      property.name = std::string(c.token());
+      elements.back().properties.push_back(std::move(property));
+    } else if(key == "end_header") {
+      c.next_line();
+      break;
+    }
+    // comment / obj_info は読み飛ばす
+  }
+
+  const uint16_t one      = 1;
+  const bool host_little  = *reinterpret_cast<const uint8_t*>(&one) == 1;
+  PlyValueReader reader(c, end, binary, binary && little_endian != host_little, filepath);
+
+  // PLYの頂点番号から溶接後の頂点番号への対応
+  std::vector<int> remap;
+  std::vector<int> polygon;
+  for(const auto& element : elements) {
+    const auto& props = element.properties;
+    if(element.name == "vertex") {
+      int axis[3] = {-1, -1, -1};
+      for(size_t i = 0; i < props.size(); i++) {
+        if(props[i].is_list) continue;
+        if(props[i].name == "x") axis[0] = static_cast<int>(i);
+        if(props[i].name == "y") axis[1] = static_cast<int>(i);
+        if(props[i].name == "z") axis[2] = static_cast<int>(i);
+      }
+      if(axis[0] < 0 || axis[1] < 0 || axis[2] < 0) c.fail("PLY vertex element needs x, y and z properties");
+      builder.reserve(element.count, element.count * 2);
+      remap.reserve(element.count);
+      for(size_t n = 0; n < element.count; n++) {
+        Vec3 v = {0.0, 0.0, 0.0};
+        for(size_t i = 0; i < props.size(); i++) {
+          if(props[i].is_list) {
+            for(size_t k = reader.list_count(props[i].count_type); k > 0; k--) reader.value(props[i].type);
+            continue;
+          }
+          const double x = reader.value(props[i].type);
+          for(int a = 0; a < 3; a++) {
+            if(axis[a] == static_cast<int>(i)) v[a] = x;
+          }
+        }
+        remap.push_back(builder.add_vertex(v));
+        progress.update(reader.position());
+      }
+    } else {
+      const bool is_face = element.name == "face";
+      for(size_t n = 0; n < element.count; n++) {
+        for(const auto& prop : props) {
+          if(!prop.is_list) {
+            reader.value(prop.type);
+            continue;
+          }
+          const size_t count  = reader.list_count(prop.count_type);
+          const bool indices  = is_face && (prop.name == "vertex_indices" || prop.name == "vertex_index");
+          polygon.clear();
+          for(size_t k = 0; k < count; k++) {
+            const double i = reader.value(prop.type);
+            if(!indices) continue;
+            if(i < 0.0 || i >= static_cast<double>(remap.size())) throw std::runtime_error(std::string("Vertex index out of range in PLY file: ") + filepath);
+            polygon.push_back(remap[static_cast<size_t>(i)]);
+          }
+          if(indices) {
+            if(polygon.size() < 3) throw std::runtime_error(std::string("Face has fewer than 3 vertices in PLY file: ") + filepath);
+            builder.add_polygon(polygon);
+          }
+        }
+        progress.update(reader.position());
+      }
+    }
+  }
+}
+
+std::string lowercase_extension(const std::string& path) {
+  const size_t dot = path.find_last_of('.');
+  if(dot == std::string::npos || path.find_first_of("/\\", dot) != std::string::npos) return "";
+  std::string ext = path.substr(dot);
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char ch) { return static_cast<char>(std::tolower(ch)); });
+  return ext;
+}
+} // namespace
+
+MeshData read_mesh(const char* filepath, const MeshImportOptions& options) {
+  const std::string ext = lowercase_extension(filepath);
+  if(ext != ".stl" && ext != ".obj" && ext != ".ply") {
+    throw std::invalid_argument(std::string("Unsupported mesh format (expected .stl, .obj or .ply): ") + filepath);
+  }
+
+  MappedFile file(filepath);
+  const char* begin = reinterpret_cast<const char*>(file.data());
+  const char* end   = begin + file.size();
+  Progress progress(options.progress, begin, file.size());
+  MeshBuilder builder(options);
+
+  if(ext == ".stl") {
+    parse_stl(begin, end, filepath, progress, builder);
+  } else if(ext == ".obj") {
+    TextCursor cursor(begin, end, filepath, progress);
+    parse_obj(cursor, builder);
+  } else {
+    parse_ply(begin, end, filepath, progress, builder);
+  }
+
+  progress.finish();
+  return builder.take();
+}
+
+size_t import_mesh(SceneRaycaster& scene, const char* filepath, const MeshImportOptions& options) {
+  MeshData mesh              = read_mesh(filepath, options);
+  const size_t num_triangles = mesh.indices.size();
+  scene.add_indexed_mesh(std::move(mesh.vertices), std::move(mesh.indices));
+  return num_triangles;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "scene_raycaster.hpp"
+#include <functional>
+#include <vector>
+
+struct MeshImportOptions {
+  bool weld_vertices    = false; // 同じ位置の頂点を1つにまとめる（STLは三角形ごとに頂点を持つので大きく減る）
+  double weld_tolerance = 0.0;   // 0なら座標が完全に一致する頂点のみ。正の値ならこの幅のグリッドで同じセルに入る頂点をまとめる
+  // 読み込んだバイト数と全体のバイト数を受け取る（一定量ごとと最後に呼ばれる）
+  std::function<void(size_t processed, size_t total)> progress;
+};
+
+struct MeshData {
+  std::vector<Vec3> vertices;
+  std::vector<Vec3i> indices;
+};
+
+// STL（バイナリ/ASCII）, OBJ, PLY（ASCII/バイナリ）を拡張子で判別して読み込む
+// ファイルはメモリマップして直接パースする。多角形は扇形に三角形分割する
+MeshData read_mesh(const char* filepath, const MeshImportOptions& options = {});
+
+// 読み込んだメッシュをシーンに追加し、追加した三角形数を返す
+size_t import_mesh(SceneRaycaster& scene, const char* filepath, const MeshImportOptions& options = {});
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 0以下なら論理コア数を使う
+inline int resolve_thread_count(int num_threads) {
+  if(num_threads > 0) return num_threads;
+  const unsigned hw = std::thread::hardware_concurrency();
+  return hw > 0 ? static_cast<int>(hw) : 1;
+}
+
+// [0, count) を grain 個ずつのチャンクに分けて並列実行する
+// 各ワーカーは自分の担当範囲を先に処理し、終わったら他のワーカーの範囲からチャンクを盗む。
+// fn(begin, end, thread_id) の thread_id は 0..num_threads-1 で、スレッドごとの作業領域の添字に使える。
+template <class Fn> void parallel_for(size_t count, int num_threads, size_t grain, Fn&& fn) {
+  if(count == 0) return;
+  if(grain == 0) grain = 1;
+
+  const size_t num_chunks = (count + grain - 1) / grain;
+  const int n             = static_cast<int>(std::min<size_t>(resolve_thread_count(num_threads), num_chunks));
+  if(n <= 1) {
+    fn(size_t{0}, count, 0);
+    return;
+  }
+
+  struct alignas(64) Range {
+    std::atomic<size_t> next{0};
+    size_t end = 0;
+  };
+  std::unique_ptr<Range[]> ranges(new Range[n]);
+  for(int i = 0; i < n; i++) {
+    ranges[i].next = count * i / n;
+    ranges[i].end  = count * (i + 1) / n;
+  }
+
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  std::atomic<bool> failed{false};
+
+  auto worker = [&](int tid) {
+    try {
+      for(int k = 0; k < n && !failed; k++) {
+        Range& r = ranges[(tid + k) % n];
+        while(!failed) {
+          const size_t begin = r.next.fetch_add(grain);
+          if(begin >= r.end) break;
+          fn(begin, std::min(begin + grain, r.end), tid);
+        }
+      }
+    } catch(...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if(!error) error = std::current_exception();
+      failed = true;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(n - 1);
+  for(int i = 1; i < n; i++) threads.emplace_back(worker, i);
+  worker(0);
+  for(auto& t : threads) t.join();
+
+  if(error) std::rethrow_exception(error);
+}
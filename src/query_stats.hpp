@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// 処理段階ごとの時間とカウンタ（計測を有効にしたときだけ集計する）
+// 段階ごとの時間はスレッドごとの値の合計なので、並列実行時は total_seconds より大きくなることがある
+struct QueryStats {
+  double total_seconds          = 0.0; // 呼び出し全体の経過時間
+  double tessellation_seconds   = 0.0; // ボックス・球の三角形分割と、BVHに渡す単精度バッファへの変換
+  double build_seconds          = 0.0; // BVHの構築・リフィット（領域ごとのシーンの作成を含む）
+  double setup_seconds          = 0.0; // 方向表の作成とレイの生成
+  double traversal_seconds      = 0.0; // BVHの走査
+  double conversion_seconds     = 0.0; // 走査結果の HitResult / 遮蔽マスクへの変換
+  double integration_seconds    = 0.0; // ホライズンの抽出と天空率の積分
+  uint64_t builds               = 0;   // BVHを作り直した回数
+  uint64_t refits               = 0;   // BVHをリフィットした回数
+  uint64_t rays                 = 0;   // 飛ばしたレイの数
+  uint64_t hits                 = 0;   // 当たった（遮られた）レイの数
+  uint64_t scalar_nodes_visited = 0;   // 最近接ヒットの1本ずつの走査と project_horizon で訪れたノード数（パケット走査と遮蔽判定は tiny_bvh が返さないため数えない。0でも訪れなかったとは限らない）
+  uint64_t projected            = 0;   // project_horizon で投影した三角形・ボックス・球の数
+  uint64_t checkpoints          = 0;   // 評価した測定点の数
+  uint64_t allocations          = 0;   // 問い合わせごとに確保した作業バッファの数
+
+  QueryStats& operator+=(const QueryStats& other) {
+    total_seconds += other.total_seconds;
+    tessellation_seconds += other.tessellation_seconds;
+    build_seconds += other.build_seconds;
+    setup_seconds += other.setup_seconds;
+    traversal_seconds += other.traversal_seconds;
+    conversion_seconds += other.conversion_seconds;
+    integration_seconds += other.integration_seconds;
+    builds += other.builds;
+    refits += other.refits;
+    rays += other.rays;
+    hits += other.hits;
+    scalar_nodes_visited += other.scalar_nodes_visited;
+    projected += other.projected;
+    checkpoints += other.checkpoints;
+    allocations += other.allocations;
+    return *this;
+  }
+};
+
+// 区間の経過時間を QueryStats の段階に足していく。stats が nullptr なら時刻を取らない
+class StageTimer {
+private:
+  QueryStats* stats;
+  std::chrono::steady_clock::time_point last;
+
+public:
+  explicit StageTimer(QueryStats* stats) : stats(stats) {
+    if(stats) last = std::chrono::steady_clock::now();
+  }
+
+  // 前回からの経過時間を stage に足す（stage が nullptr なら区切るだけ）
+  void lap(double QueryStats::*stage) {
+    if(!stats) return;
+    const auto now = std::chrono::steady_clock::now();
+    if(stage) stats->*stage += std::chrono::duration<double>(now - last).count();
+    last = now;
+  }
+};
@@ -1,5 +1,6 @@
 #include "scene_raycaster.hpp"
 #include "sky_ratio_checker.hpp"
+#include <filesystem>
 #include <iomanip>
 #include <iostream>
 
@@ -90,7 +91,9 @@ void test_uniform_ring_blocks_lower_hemisphere() {
     const auto& cp = checker.checkpoints[i];
     std::cout << "測定点 " << i + 1 << " (" << std::fixed << std::setprecision(1) << cp[0] << ", " << cp[1] << ", " << cp[2] << "): " << std::setprecision(2) << (sky_ratios[i] * 100.0f) << "%" << std::endl;
   }
-  scene.save("test.stl");
+  // 作業ディレクトリを汚さないように一時ディレクトリへ書き出す
+  const std::string stl = (std::filesystem::temp_directory_path() / "skyratio_sample.stl").string();
+  scene.save(stl.c_str());
 }
 
 void test_totally_enclosed() {
@@ -1,9 +1,18 @@
 #include "scene_raycaster.hpp"
 #include <algorithm> // dont delete
+#include <bitset>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <stdexcept>
+#include <type_traits>
+
+#include "mapped_file.hpp"
+#include "parallel.hpp"
 
 #define TINYBVH_IMPLEMENTATION
 #include "ext/tinybvh/tiny_bvh.h"
@@ -13,6 +22,30 @@
 #endif
 
 namespace {
+// ボックス1つあたりの頂点数・三角形数
+constexpr size_t BOX_VERTICES  = 8;
+constexpr size_t BOX_TRIANGLES = 12;
+constexpr int BOX_FACES[BOX_TRIANGLES][3] = {{0, 1, 2}, {2, 1, 3}, {4, 6, 5}, {5, 6, 7}, {0, 2, 4}, {4, 2, 6}, {1, 5, 3}, {3, 5, 7}, {0, 4, 1}, {1, 4, 5}, {2, 3, 6}, {6, 3, 7}};
+
+// UV球の分割数と、球1つあたりの頂点数・三角形数
+constexpr int SPHERE_SEGMENTS     = 16;
+constexpr int SPHERE_RINGS        = 8;
+constexpr size_t SPHERE_VERTICES  = (SPHERE_RINGS + 1) * (SPHERE_SEGMENTS + 1);
+constexpr size_t SPHERE_TRIANGLES = SPHERE_RINGS * SPHERE_SEGMENTS * 2;
+
+// 構築時に並列で三角形分割・変換する単位（形状の数・三角形の数）
+constexpr size_t TESSELLATION_GRAIN = 4096;
+constexpr size_t CONVERSION_GRAIN   = 65536;
+
+// 三角形の多いシーンは上の数段を重心の中央値で分け、部分木ごとに並列で構築する（部分木1つあたりの最小の三角形数）
+constexpr size_t SPLIT_BUILD_MIN_TRIANGLES = 1 << 16;
+
+// これ以上リフィットを重ねたらBVHを作り直す（木の品質が落ちるため）
+constexpr int MAX_REFITS_BEFORE_REBUILD = 32;
+
+// 形状の内容の変化を遡れる build の回数
+constexpr size_t MAX_CHANGE_LOG = 64;
+
 // 回転行列を生成(オイラー角から)
 std::array<std::array<double, 3>, 3> euler_to_rotation_matrix(const Vec3& euler) {
   double cx = std::cos(euler[0]), sx = std::sin(euler[0]);
@@ -25,18 +58,27 @@ std::array<std::array<double, 3>, 3> euler_to_rotation_matrix(const Vec3& euler)
 // ベクトルと行列の積
 Vec3 matrix_vector_multiply(const std::array<std::array<double, 3>, 3>& mat, const Vec3& vec) { return {mat[0][0] * vec[0] + mat[0][1] * vec[1] + mat[0][2] * vec[2], mat[1][0] * vec[0] + mat[1][1] * vec[1] + mat[1][2] * vec[2], mat[2][0] * vec[0] + mat[2][1] * vec[1] + mat[2][2] * vec[2]}; }
 
-// UV球メッシュを生成
-void generate_uv_sphere(const Vec3& center, double radius, int segments, int rings, std::vector<Vec3>& vertices, std::vector<Vec3i>& indices) {
-  size_t base_idx = vertices.size();
+// ボックスの8頂点を生成
+void generate_box_corners(const Box& box, Vec3* corners) {
+  auto rot_mat   = euler_to_rotation_matrix(box.euler);
+  Vec3 half_size = {box.size[0] / 2, box.size[1] / 2, box.size[2] / 2};
 
-  // 頂点を生成
-  for(int ring = 0; ring <= rings; ring++) {
-    double phi     = M_PI * ring / rings;
+  for(size_t i = 0; i < BOX_VERTICES; i++) {
+    Vec3 local   = {(i & 1) ? half_size[0] : -half_size[0], (i & 2) ? half_size[1] : -half_size[1], (i & 4) ? half_size[2] : -half_size[2]};
+    Vec3 rotated = matrix_vector_multiply(rot_mat, local);
+    corners[i]   = {rotated[0] + box.center[0], rotated[1] + box.center[1], rotated[2] + box.center[2]};
+  }
+}
+
+// UV球の頂点を生成
+void generate_uv_sphere(const Vec3& center, double radius, Vec3* vertices) {
+  for(int ring = 0; ring <= SPHERE_RINGS; ring++) {
+    double phi     = M_PI * ring / SPHERE_RINGS;
     double sin_phi = std::sin(phi);
     double cos_phi = std::cos(phi);
 
-    for(int seg = 0; seg <= segments; seg++) {
-      double theta     = 2.0 * M_PI * seg / segments;
+    for(int seg = 0; seg <= SPHERE_SEGMENTS; seg++) {
+      double theta     = 2.0 * M_PI * seg / SPHERE_SEGMENTS;
       double sin_theta = std::sin(theta);
       double cos_theta = std::cos(theta);
 
@@ -44,163 +86,1513 @@ void generate_uv_sphere(const Vec3& center, double radius, int segments, int rin
       double y = radius * cos_phi;
       double z = radius * sin_phi * sin_theta;
 
-      vertices.push_back({center[0] + x, center[1] + y, center[2] + z});
+      *vertices++ = {center[0] + x, center[1] + y, center[2] + z};
     }
   }
+}
 
-  // インデックスを生成
-  for(int ring = 0; ring < rings; ring++) {
-    for(int seg = 0; seg < segments; seg++) {
-      int current = static_cast<unsigned int>(base_idx + ring * (segments + 1) + seg);
-      int next    = current + segments + 1;
-      indices.push_back(Vec3i{current, next, current + 1});
-      indices.push_back(Vec3i{current + 1, next, next + 1});
+// UV球のインデックスを生成
+void generate_uv_sphere_indices(int base_idx, Vec3i* indices) {
+  for(int ring = 0; ring < SPHERE_RINGS; ring++) {
+    for(int seg = 0; seg < SPHERE_SEGMENTS; seg++) {
+      int current = base_idx + ring * (SPHERE_SEGMENTS + 1) + seg;
+      int next    = current + SPHERE_SEGMENTS + 1;
+      *indices++  = Vec3i{current, next, current + 1};
+      *indices++  = Vec3i{current + 1, next, next + 1};
     }
   }
 }
+
+// 解析的に交差判定するボックス・球（BuildOptions::analytic_primitives）
+struct AnalyticShape {
+  tinybvh::bvhvec3 center;
+  tinybvh::bvhvec3 axis[3]; // ボックスの局所座標軸（回転行列の列）
+  tinybvh::bvhvec3 half;    // ボックスの各軸の半分の大きさ（球は x に半径）
+  tinybvh::bvhvec3 lo, hi;  // 外接するAABB
+  bool sphere  = false;
+  bool removed = false;
+};
+
+AnalyticShape make_box_shape(const Box& box) {
+  AnalyticShape shape;
+  const auto rot = euler_to_rotation_matrix(box.euler);
+  shape.center   = tinybvh::bvhvec3((float)box.center[0], (float)box.center[1], (float)box.center[2]);
+  shape.half     = tinybvh::bvhvec3((float)(box.size[0] / 2), (float)(box.size[1] / 2), (float)(box.size[2] / 2));
+  shape.removed  = box.removed;
+  Vec3 extent    = {0.0, 0.0, 0.0};
+  for(int k = 0; k < 3; k++) {
+    shape.axis[k] = tinybvh::bvhvec3((float)rot[0][k], (float)rot[1][k], (float)rot[2][k]);
+    for(int j = 0; j < 3; j++) extent[j] += std::abs(rot[j][k]) * box.size[k] / 2;
+  }
+  for(int j = 0; j < 3; j++) {
+    shape.lo[j] = (float)(box.center[j] - extent[j]);
+    shape.hi[j] = (float)(box.center[j] + extent[j]);
+  }
+  if(box.removed) shape.lo = shape.hi = shape.center; // 削除したボックスは中心の1点に潰す
+  return shape;
+}
+
+AnalyticShape make_sphere_shape(const Sphere& sphere) {
+  AnalyticShape shape;
+  shape.center  = tinybvh::bvhvec3((float)sphere.center[0], (float)sphere.center[1], (float)sphere.center[2]);
+  shape.half    = tinybvh::bvhvec3((float)sphere.radius, 0.0f, 0.0f);
+  shape.sphere  = true;
+  shape.removed = sphere.removed;
+  for(int j = 0; j < 3; j++) {
+    shape.lo[j] = (float)(sphere.center[j] - sphere.radius);
+    shape.hi[j] = (float)(sphere.center[j] + sphere.radius);
+  }
+  if(sphere.removed) shape.lo = shape.hi = shape.center;
+  return shape;
+}
+
+// 形状が遮りうる範囲（削除した形状は何も遮らないので空の箱）
+std::pair<Vec3, Vec3> shape_bounds(const AnalyticShape& shape) {
+  if(shape.removed) return {{HUGE_VAL, HUGE_VAL, HUGE_VAL}, {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL}};
+  return {{shape.lo.x, shape.lo.y, shape.lo.z}, {shape.hi.x, shape.hi.y, shape.hi.z}};
+}
+
+// 形状の内容のハッシュ（結果キャッシュのキーにするだけなので暗号学的な強さは要らない）
+uint64_t hash_mix(uint64_t h, uint64_t value) {
+  value *= 0xff51afd7ed558ccdull;
+  value ^= value >> 33;
+  return (h ^ value) * 0xc4ceb9fe1a85ec53ull + 0x9e3779b97f4a7c15ull;
+}
+
+// 浮動小数点数はビット列をそのまま混ぜる
+template <typename T> uint64_t hash_values(uint64_t h, const T* values, size_t count) {
+  for(size_t i = 0; i < count; i++) {
+    std::conditional_t<sizeof(T) == 8, uint64_t, uint32_t> bits;
+    std::memcpy(&bits, &values[i], sizeof(T));
+    h = hash_mix(h, bits);
+  }
+  return h;
+}
+
+// tinybvh のベクトル演算はバージョンで名前が変わるので自前で持つ
+float dot3(const tinybvh::bvhvec3& a, const tinybvh::bvhvec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+// レイと形状の最も近い交点の距離（原点が内側にあれば出ていく点）
+bool analytic_hit(const tinybvh::Ray& ray, const AnalyticShape& shape, float& t) {
+  if(shape.removed) return false;
+  const tinybvh::bvhvec3 oc(ray.O.x - shape.center.x, ray.O.y - shape.center.y, ray.O.z - shape.center.z);
+  if(shape.sphere) {
+    // 中心に最も近づく点からの弦の半分で求める（遠くの球でも桁落ちしにくい）
+    const float a       = dot3(ray.D, ray.D);
+    const float closest = -dot3(oc, ray.D) / a;
+    const tinybvh::bvhvec3 p(oc.x + ray.D.x * closest, oc.y + ray.D.y * closest, oc.z + ray.D.z * closest);
+    const float r  = shape.half.x;
+    const float d2 = dot3(p, p);
+    if(d2 > r * r) return false;
+    const float half_chord = std::sqrt((r * r - d2) / a);
+    t                      = closest - half_chord > 0.0f ? closest - half_chord : closest + half_chord;
+    return t > 0.0f;
+  }
+  // 局所座標系でのスラブ法
+  float t0 = -BVH_FAR, t1 = BVH_FAR;
+  for(int k = 0; k < 3; k++) {
+    const float o   = dot3(shape.axis[k], oc);
+    const float inv = 1.0f / dot3(shape.axis[k], ray.D);
+    if(std::isinf(inv)) {
+      // 面に平行なレイは原点がスラブの内側（面上を含む）なら常に内側。面上の原点で 0 * inf が NaN になり外れるのを避ける
+      if(o < -shape.half[k] || o > shape.half[k]) return false;
+      continue;
+    }
+    const float ta = (-shape.half[k] - o) * inv;
+    const float tb = (shape.half[k] - o) * inv;
+    t0             = std::max(t0, std::min(ta, tb));
+    t1             = std::min(t1, std::max(ta, tb));
+  }
+  if(t1 < t0 || t1 <= 0.0f) return false;
+  t = t0 > 0.0f ? t0 : t1;
+  return true;
+}
+
+// tinybvh のカスタム形状のコールバックは呼び出し元の情報を受け取れないので、走査中の形状の配列をスレッドごとに渡す
+thread_local const AnalyticShape* active_shapes = nullptr;
+
+void analytic_aabb(const unsigned i, tinybvh::bvhvec3& bmin, tinybvh::bvhvec3& bmax) {
+  bmin = active_shapes[i].lo;
+  bmax = active_shapes[i].hi;
+}
+
+bool analytic_intersect(tinybvh::Ray& ray, const unsigned i) {
+  float t;
+  if(!analytic_hit(ray, active_shapes[i], t) || t >= ray.hit.t) return false;
+  ray.hit.t    = t;
+  ray.hit.prim = i;
+  return true;
+}
+
+bool analytic_occluded(const tinybvh::Ray& ray, const unsigned i) {
+  float t;
+  return analytic_hit(ray, active_shapes[i], t) && t < ray.hit.t;
+}
+
+// project_horizon の投影。原点から見た方位角ごとの最大仰角の正接を、形状を1つずつ投影して引き上げていく
+// 線分上の点の仰角は端点の間で単調に変わるので、鉛直な半平面と三角形の交わり（線分）の最大仰角は端点か、原点の真上を横切る点で決まる
+class HorizonProjector {
+  const double ox, oy, oz;
+  const int steps;
+  const double step;     // 方位角の刻み [rad]
+  const double* azimuth; // 方位角ごとの (cos, sin)
+  double* tan_h;
+
+  static double normalize_angle(double a) {
+    while(a > M_PI) a -= 2.0 * M_PI;
+    while(a <= -M_PI) a += 2.0 * M_PI;
+    return a;
+  }
+
+  // 方位角の範囲 [lo, hi] に含まれる刻みを順に f(p) に渡し、f が true を返したらそこで止めて true を返す
+  template <typename F> bool visit_bins(double lo, double hi, bool full, F&& f) const {
+    int first = 0, last = steps - 1;
+    if(!full) {
+      // 端の刻みちょうどに接する形状を落とさないよう、わずかに広げる
+      first = static_cast<int>(std::ceil((lo - 1e-9) / step));
+      last  = static_cast<int>(std::floor((hi + 1e-9) / step));
+      if(last - first + 1 >= steps) first = 0, last = steps - 1;
+    }
+    for(int k = first; k <= last; k++) {
+      if(f(((k % steps) + steps) % steps)) return true;
+    }
+    return false;
+  }
+
+  // 原点からの相対座標の点の方位角の範囲（原点の真上・真下を含まない凸な形状の点であること。幅は180度未満になる）
+  static void azimuth_range(const double* x, const double* y, int n, double& lo, double& hi) {
+    const double a0 = std::atan2(y[0], x[0]);
+    double dmin     = 0.0, dmax = 0.0;
+    for(int k = 1; k < n; k++) {
+      const double d = normalize_angle(std::atan2(y[k], x[k]) - a0);
+      dmin           = std::min(dmin, d);
+      dmax           = std::max(dmax, d);
+    }
+    lo = a0 + dmin;
+    hi = a0 + dmax;
+  }
+
+public:
+  uint64_t nodes = 0, projected = 0;
+
+  HorizonProjector(const Vec3& origin, int steps, const double* azimuth, double* tan_h) : ox(origin[0]), oy(origin[1]), oz(origin[2]), steps(steps), step(2.0 * M_PI / steps), azimuth(azimuth), tan_h(tan_h) {}
+
+  // 相対座標のAABB [lo, hi] の中で、まだ求めた仰角より高くなりうる方位角があるか
+  bool box_visible(const double* lo, const double* hi) const {
+    if(hi[2] <= 0.0) return false; // 原点より低い形状は仰角が正にならない
+    const double gx    = std::max({lo[0], -hi[0], 0.0});
+    const double gy    = std::max({lo[1], -hi[1], 0.0});
+    const double d     = std::hypot(gx, gy);
+    const bool full    = d == 0.0; // 足元の範囲が原点の真下を含む
+    const double bound = full ? std::numeric_limits<double>::infinity() : hi[2] / d;
+
+    double lo_a = 0.0, hi_a = 0.0;
+    if(!full) {
+      const double x[4] = {lo[0], hi[0], lo[0], hi[0]};
+      const double y[4] = {lo[1], lo[1], hi[1], hi[1]};
+      azimuth_range(x, y, 4, lo_a, hi_a);
+    }
+    return visit_bins(lo_a, hi_a, full, [&](int p) { return tan_h[p] < bound; });
+  }
+
+  bool node_visible(const tinybvh::BVH::BVHNode& node) const {
+    const double lo[3] = {node.aabbMin.x - ox, node.aabbMin.y - oy, node.aabbMin.z - oz};
+    const double hi[3] = {node.aabbMax.x - ox, node.aabbMax.y - oy, node.aabbMax.z - oz};
+    return box_visible(lo, hi);
+  }
+
+  // 見えうるノードだけを手前から辿り、葉の形状の番号を leaf に渡す
+  template <typename Leaf> void traverse(const tinybvh::BVH& tree, Leaf&& leaf) {
+    auto distance = [&](uint32_t n) {
+      const auto& b = tree.bvhNode[n];
+      return std::hypot(std::max({b.aabbMin.x - ox, ox - b.aabbMax.x, 0.0}), std::max({b.aabbMin.y - oy, oy - b.aabbMax.y, 0.0}));
+    };
+    uint32_t stack[64];
+    int sp      = 0;
+    stack[sp++] = 0;
+    while(sp > 0) {
+      const auto& node = tree.bvhNode[stack[--sp]];
+      // 積んだ後に他のノードで仰角が上がっていることがあるので、取り出した時に判定する
+      if(!node_visible(node)) continue;
+      nodes++;
+      if(node.isLeaf()) {
+        for(uint32_t k = 0; k < node.triCount; k++) leaf(tree.primIdx[node.leftFirst + k]);
+        continue;
+      }
+      // 近い子を先に投影する（手前の高い遮蔽で奥のノードを除きやすくする）
+      uint32_t near_child = node.leftFirst, far_child = node.leftFirst + 1;
+      if(distance(far_child) < distance(near_child)) std::swap(near_child, far_child);
+      stack[sp++] = far_child;
+      stack[sp++] = near_child;
+    }
+  }
+
+  void project_triangle(const tinybvh::bvhvec3& a, const tinybvh::bvhvec3& b, const tinybvh::bvhvec3& c) {
+    const double x[3]  = {a.x - ox, b.x - ox, c.x - ox};
+    const double y[3]  = {a.y - oy, b.y - oy, c.y - oy};
+    const double z[3]  = {a.z - oz, b.z - oz, c.z - oz};
+    const double lo[3] = {std::min({x[0], x[1], x[2]}), std::min({y[0], y[1], y[2]}), std::min({z[0], z[1], z[2]})};
+    const double hi[3] = {std::max({x[0], x[1], x[2]}), std::max({y[0], y[1], y[2]}), std::max({z[0], z[1], z[2]})};
+    if(!box_visible(lo, hi)) return;
+    projected++;
+
+    // 足元の範囲が原点の真下を含む場合は全方位角を調べる
+    const bool full = lo[0] <= 0.0 && hi[0] >= 0.0 && lo[1] <= 0.0 && hi[1] >= 0.0;
+    double lo_a     = 0.0, hi_a = 0.0;
+    if(!full) azimuth_range(x, y, 3, lo_a, hi_a);
+    visit_bins(lo_a, hi_a, full, [&](int p) {
+      const double cp = azimuth[p * 2], sp = azimuth[p * 2 + 1];
+      // 鉛直面からの符号付き距離 d と、方位角方向の水平距離 u
+      double d[3], u[3];
+      for(int k = 0; k < 3; k++) {
+        d[k] = cp * y[k] - sp * x[k];
+        u[k] = cp * x[k] + sp * y[k];
+      }
+      // 鉛直面との交わりの線分の端点 (u, z)
+      double pu[2], pz[2];
+      int n = 0;
+      for(int k = 0; k < 3 && n < 2; k++) {
+        const int j = (k + 1) % 3;
+        if((d[k] >= 0.0) == (d[j] >= 0.0)) continue;
+        const double t = d[k] / (d[k] - d[j]);
+        pu[n]          = u[k] + t * (u[j] - u[k]);
+        pz[n]          = z[k] + t * (z[j] - z[k]);
+        n++;
+      }
+      if(n < 2) return false;
+
+      double best = -std::numeric_limits<double>::infinity();
+      for(int k = 0; k < 2; k++) {
+        if(pu[k] > 0.0) best = std::max(best, pz[k] / pu[k]);
+      }
+      // 線分が原点の真上を横切れば真上まで覆う
+      if((pu[0] > 0.0) != (pu[1] > 0.0)) {
+        const double zc = pz[0] + (pz[1] - pz[0]) * (-pu[0]) / (pu[1] - pu[0]);
+        if(zc > 0.0) best = std::numeric_limits<double>::infinity();
+      }
+      tan_h[p] = std::max(tan_h[p], best);
+      return false;
+    });
+  }
+
+  void project_sphere(const AnalyticShape& shape) {
+    const double r     = shape.half.x;
+    const double x     = shape.center.x - ox, y = shape.center.y - oy, z = shape.center.z - oz;
+    const double lo[3] = {x - r, y - r, z - r};
+    const double hi[3] = {x + r, y + r, z + r};
+    if(!box_visible(lo, hi)) return;
+    projected++;
+
+    const double horizontal = std::hypot(x, y);
+    const bool full         = horizontal <= r;
+    const double center_a   = std::atan2(y, x);
+    const double spread     = full ? 0.0 : std::asin(r / horizontal);
+    visit_bins(center_a - spread, center_a + spread, full, [&](int p) {
+      const double cp = azimuth[p * 2], sp = azimuth[p * 2 + 1];
+      // 鉛直面で切った円（中心 (uc, z)、半径 rho）
+      const double d = cp * y - sp * x;
+      if(std::abs(d) > r) return false;
+      const double rho = std::sqrt(r * r - d * d);
+      const double uc  = cp * x + sp * y;
+      if(uc + rho <= 0.0) return false;
+      const double l = std::hypot(uc, z);
+      double best    = std::numeric_limits<double>::infinity(); // 原点が球の中
+      if(l > rho) {
+        // 原点から見た円の仰角の範囲 [center - spread, center + spread]。上端が90度未満ならその正接、
+        // 90度以上なら下端も90度未満の（真上を横切る）場合だけ真上を覆う（原点の真上で接するだけなら半平面側と交わらない）
+        const double center = std::atan2(z, uc), spread = std::asin(rho / l);
+        if(center + spread <= -M_PI / 2.0) return false;
+        if(center + spread < M_PI / 2.0) {
+          best = std::tan(center + spread);
+        } else if(center - spread >= M_PI / 2.0 - 1e-9) {
+          return false;
+        }
+      }
+      tan_h[p] = std::max(tan_h[p], best);
+      return false;
+    });
+  }
+
+  void project_box(const AnalyticShape& shape) {
+    tinybvh::bvhvec3 corners[BOX_VERTICES];
+    for(size_t i = 0; i < BOX_VERTICES; i++) {
+      const float sx = (i & 1) ? shape.half.x : -shape.half.x;
+      const float sy = (i & 2) ? shape.half.y : -shape.half.y;
+      const float sz = (i & 4) ? shape.half.z : -shape.half.z;
+      for(int k = 0; k < 3; k++) corners[i][k] = shape.center[k] + shape.axis[0][k] * sx + shape.axis[1][k] * sy + shape.axis[2][k] * sz;
+    }
+    for(const auto& f : BOX_FACES) project_triangle(corners[f[0]], corners[f[1]], corners[f[2]]);
+  }
+};
+
+// STLバイナリの三角形1つ分のバイト数（法線＋3頂点＋属性）
+constexpr size_t STL_FACET_BYTES = 12 * sizeof(float) + sizeof(uint16_t);
+
+// 三角形1つをSTLバイナリ形式で out に書き込み、次の書き込み位置を返す
+char* encode_stl_triangle(char* out, const Vec3& v0, const Vec3& v1, const Vec3& v2) {
+  // Calculate normal vector (cross product)
+  Vec3 edge1  = {v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2]};
+  Vec3 edge2  = {v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2]};
+  Vec3 normal = {edge1[1] * edge2[2] - edge1[2] * edge2[1], edge1[2] * edge2[0] - edge1[0] * edge2[2], edge1[0] * edge2[1] - edge1[1] * edge2[0]};
+
+  // Normalize
+  double len = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+  if(len > 0.0) {
+    normal[0] /= len;
+    normal[1] /= len;
+    normal[2] /= len;
+  } else {
+    // Degenerate triangle: use default normal
+    normal = {0.0, 0.0, 1.0};
+  }
+
+  // Normal, then vertices
+  float facet[12];
+  int k = 0;
+  for(const Vec3* v : {static_cast<const Vec3*>(&normal), &v0, &v1, &v2}) {
+    for(int c = 0; c < 3; c++) facet[k++] = static_cast<float>((*v)[c]);
+  }
+  std::memcpy(out, facet, sizeof(facet));
+
+  // Attribute byte count (2 bytes, typically 0)
+  const uint16_t attribute_count = 0;
+  std::memcpy(out + sizeof(facet), &attribute_count, sizeof(uint16_t));
+  return out + STL_FACET_BYTES;
+}
+
+// シーンキャッシュ（save_scene / load_scene）のファイル形式
+// [ヘッダ][vertices][indices][boxes][spheres][BVH用頂点][BVH用インデックス][BVHノード][primIdx]
+// 各セクションは SCENE_ALIGNMENT バイト境界から始まる。エンディアンは書き出した環境のネイティブ
+constexpr char SCENE_MAGIC[8]    = {'S', 'K', 'Y', 'S', 'C', 'E', 'N', 'E'};
+constexpr uint32_t SCENE_VERSION = 1;
+constexpr size_t SCENE_ALIGNMENT = 64;
+constexpr uint32_t SCENE_COMPACT       = 1u << 0;
+constexpr uint32_t SCENE_HOST_RELEASED = 1u << 1;
+
+// ボックス・球は構造体のパディングを避けて double の並びで保存する
+constexpr size_t BOX_RECORD    = 10; // center, size, euler, removed
+constexpr size_t SPHERE_RECORD = 5;  // center, radius, removed
+
+struct SceneHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t node_size;     // sizeof(BVHNode)。tinybvhのバージョン違いを検出する
+  uint32_t build_options; // builder | layout << 8 | optimize << 16 | analytic_primitives << 24
+  uint64_t user_vertex_count;
+  uint64_t user_triangle_count;
+  uint64_t vertex_count; // ホスト側の vertices / indices（解放済みなら0）
+  uint64_t index_count;
+  uint64_t box_count;
+  uint64_t sphere_count;
+  uint64_t bvh_vertex_count; // BVH用の単精度バッファ
+  uint64_t bvh_index_count;
+  uint64_t node_count;
+  uint64_t prim_index_count;
+  uint64_t refits_since_build;
+};
+
+size_t align_up(size_t offset) { return (offset + SCENE_ALIGNMENT - 1) / SCENE_ALIGNMENT * SCENE_ALIGNMENT; }
+
+// セクションを書き出し、次のセクションの境界までゼロで埋める
+void write_section(std::ofstream& file, size_t& offset, const void* data, size_t bytes) {
+  static const char padding[SCENE_ALIGNMENT] = {};
+  if(bytes > 0) file.write(static_cast<const char*>(data), bytes);
+  const size_t next = align_up(offset + bytes);
+  file.write(padding, next - offset - bytes);
+  offset = next;
+}
+
+// シーンキャッシュのマップ領域を先頭から順にセクションへ切り分ける（コピーせずにマップ領域内の位置を返す）
+class SectionCursor {
+private:
+  uint8_t* base;
+  uint64_t length;
+  uint64_t offset = 0;
+
+public:
+  SectionCursor(uint8_t* base, uint64_t length) : base(base), length(length) {}
+
+  uint64_t size() const { return length; }
+
+  // 現在のセクションの先頭 T[count] を返し、次のセクションへ進む（セクションは SCENE_ALIGNMENT 境界から始まるので T の境界に揃っている）
+  template <typename T> T* next(uint64_t count) {
+    if(count > (length - offset) / sizeof(T)) throw std::runtime_error("Scene file is truncated");
+    T* section = reinterpret_cast<T*>(base + offset);
+    offset     = std::min<uint64_t>(align_up(offset + count * sizeof(T)), length);
+    return section;
+  }
+};
+
+// マップ領域を指すBVHのノード・primIdx はシーンの scene_file が解放するので、BVHからは解放しない
+void keep_mapped(void*, void*) {}
+
+// Intersect256Rays のパケット。角の4本から視錐台を作り、視錐台と交わらないノードをまとめて飛ばす
+constexpr size_t PACKET_RAYS         = 256;
+constexpr size_t PACKET_CORNERS[4]   = {0, 51, 204, 255}; // 左上, 右上, 左下, 右下
+constexpr size_t PACKET_MIN_RAYS     = 64;                // これより少ないタイルは1本ずつの方が速い
+constexpr double PACKET_MAX_SPAN     = 170.0 * M_PI / 180.0;
+constexpr double PACKET_MAX_ELEVATION = 89.9 * M_PI / 180.0;
+constexpr double PACKET_GUARD_EPS    = 1e-4;
+
+bool is_packet_corner(size_t slot) { return slot == 0 || slot == 51 || slot == 204 || slot == 255; }
+
+// 方位角 [a0, a1]・仰角 [e0, e1] の範囲を囲む視錐台の角の方向（左上, 右上, 左下, 右下）を求める
+// 同じ仰角の2点を結ぶ大円は中央で仰角が変わるので、上下の辺はその分だけ外側に広げる
+bool packet_guards(double a0, double a1, double e0, double e1, float* guards) {
+  a0 -= PACKET_GUARD_EPS;
+  a1 += PACKET_GUARD_EPS;
+  e0 -= PACKET_GUARD_EPS;
+  e1 += PACKET_GUARD_EPS;
+  if(a1 - a0 >= PACKET_MAX_SPAN || e1 >= PACKET_MAX_ELEVATION || e0 <= -PACKET_MAX_ELEVATION) return false;
+
+  const double cos_half = std::cos((a1 - a0) * 0.5);
+  const double top      = e1 >= 0.0 ? e1 : std::atan(std::tan(e1) * cos_half);
+  const double bottom   = e0 >= 0.0 ? std::atan(std::tan(e0) * cos_half) : e0;
+  const double corners[4][2] = {{top, a0}, {top, a1}, {bottom, a0}, {bottom, a1}};
+  for(int c = 0; c < 4; c++) {
+    const double e = corners[c][0], a = corners[c][1];
+    guards[c * 3]     = static_cast<float>(std::cos(e) * std::cos(a));
+    guards[c * 3 + 1] = static_cast<float>(std::cos(e) * std::sin(a));
+    guards[c * 3 + 2] = static_cast<float>(std::sin(e));
+  }
+  return true;
+}
+
+// Intersect256Rays が視錐台の面をどちら向きに作るかは角のレイの並びで決まる
+// 小さな平面に既知のパケットを飛ばし、1本ずつの結果と一致する並び（0: そのまま, 1: 左右を入れ替え）を一度だけ調べる
+// どちらも一致しなければ -1（パケット走査を使わない）
+int packet_orientation() {
+  static const int orientation = [] {
+    tinybvh::bvhvec4 quad[6] = {{10, -0.5f, -0.5f, 0}, {10, 0.5f, -0.5f, 0}, {10, 0.5f, 0.5f, 0}, {10, -0.5f, -0.5f, 0}, {10, 0.5f, 0.5f, 0}, {10, -0.5f, 0.5f, 0}};
+    tinybvh::BVH probe;
+    probe.Build(quad, 2);
+
+    // 方位角・仰角とも -10度から10度の 16x16 の格子
+    const double range = 10.0 * M_PI / 180.0;
+    std::vector<tinybvh::Ray> expected;
+    for(int r = 0; r < 16; r++) {
+      for(int c = 0; c < 16; c++) {
+        const double e = -range + 2.0 * range * r / 15.0, a = -range + 2.0 * range * c / 15.0;
+        expected.emplace_back(tinybvh::bvhvec3(0, 0, 0), tinybvh::bvhvec3(static_cast<float>(std::cos(e) * std::cos(a)), static_cast<float>(std::cos(e) * std::sin(a)), static_cast<float>(std::sin(e))));
+      }
+    }
+    for(auto& ray : expected) probe.Intersect(ray);
+
+    float guards[12];
+    packet_guards(-range, range, -range, range, guards);
+    for(int o = 0; o < 2; o++) {
+      std::vector<tinybvh::Ray> packet(PACKET_RAYS);
+      size_t next = 0;
+      for(size_t i = 0; i < PACKET_RAYS; i++) {
+        if(is_packet_corner(i)) continue;
+        const auto& ray = expected[next++ % expected.size()];
+        packet[i]       = tinybvh::Ray(ray.O, ray.D);
+      }
+      for(int c = 0; c < 4; c++) {
+        const int g                = o == 0 ? c : (c ^ 1);
+        packet[PACKET_CORNERS[c]] = tinybvh::Ray(tinybvh::bvhvec3(0, 0, 0), tinybvh::bvhvec3(guards[g * 3], guards[g * 3 + 1], guards[g * 3 + 2]));
+      }
+      probe.Intersect256Rays(packet.data());
+
+      bool match = true;
+      next       = 0;
+      for(size_t i = 0; i < PACKET_RAYS && match; i++) {
+        if(is_packet_corner(i)) continue;
+        const auto& ray = expected[next++ % expected.size()];
+        match           = (packet[i].hit.t < BVH_FAR) == (ray.hit.t < BVH_FAR);
+      }
+      if(match) return o;
+    }
+    return -1;
+  }();
+  return orientation;
+}
+// パケットの角の4枠に視錐台を作るガードのレイを入れる（orientation が1なら左右を入れ替える。tinybvhの視錐台の面の向きに合わせる）
+void set_packet_guards(tinybvh::Ray* packet, const tinybvh::bvhvec3& origin, const float* guards, int orientation) {
+  for(int c = 0; c < 4; c++) {
+    const int g               = orientation == 0 ? c : (c ^ 1);
+    packet[PACKET_CORNERS[c]] = tinybvh::Ray(origin, tinybvh::bvhvec3(guards[g * 3], guards[g * 3 + 1], guards[g * 3 + 2]));
+  }
+}
+
+// 作業バッファを count 要素以上に広げて先頭を返す（確保し直した場合は stats の allocations に数える）
+tinybvh::Ray* reserve_rays(std::vector<tinybvh::Ray>& buffer, size_t count, QueryStats* stats) {
+  if(buffer.capacity() < count && stats) stats->allocations++;
+  if(buffer.size() < count) buffer.resize(count);
+  return buffer.data();
+}
 } // namespace
 
-SceneRaycaster::~SceneRaycaster() { delete bvh; }
+void DirectionSet::plan_packets(int rows, int cols, int tile_cols) {
+  packets = {};
+  if(rows <= 0 || cols <= 0) return;
+  if(static_cast<size_t>(rows) * cols != size()) throw std::invalid_argument("Direction grid does not match the direction count");
+
+  // 列が全周の方位角なら最大150度・18列、パケットの角以外の252枠に収まるだけ行を重ねたタイルに分ける
+  const double step       = 2.0 * M_PI / cols;
+  const int cols_per_tile = tile_cols > 0 ? std::min({tile_cols, cols, static_cast<int>(PACKET_RAYS - 4)}) : std::clamp(static_cast<int>(150.0 * M_PI / 180.0 / step), 1, 18);
+  const int rows_per_tile = std::min(rows, static_cast<int>(PACKET_RAYS - 4) / cols_per_tile);
+
+  std::vector<uint32_t> tile;
+  for(int r0 = 0; r0 < rows; r0 += rows_per_tile) {
+    for(int c0 = 0; c0 < cols; c0 += cols_per_tile) {
+      tile.clear();
+      for(int r = r0; r < std::min(r0 + rows_per_tile, rows); r++) {
+        for(int c = c0; c < std::min(c0 + cols_per_tile, cols); c++) tile.push_back(static_cast<uint32_t>(static_cast<size_t>(r) * cols + c));
+      }
 
-SceneRaycaster::SceneRaycaster(SceneRaycaster&& other) noexcept : build_dirty(other.build_dirty), boxes(std::move(other.boxes)), spheres(std::move(other.spheres)), bvh(other.bvh), vertices(std::move(other.vertices)), indices(std::move(other.indices)) { other.bvh = nullptr; }
+      // 方位角は先頭の方向からの差で測る（0度をまたぐタイルでも範囲が連続するように）
+      const double ref = std::atan2(y[tile[0]], x[tile[0]]);
+      double a0 = 0.0, a1 = 0.0, e0 = M_PI, e1 = -M_PI;
+      for(uint32_t i : tile) {
+        double d = std::atan2(y[i], x[i]) - ref;
+        if(d > M_PI) d -= 2.0 * M_PI;
+        if(d < -M_PI) d += 2.0 * M_PI;
+        a0             = std::min(a0, d);
+        a1             = std::max(a1, d);
+        const double e = std::asin(std::clamp(static_cast<double>(z[i]), -1.0, 1.0));
+        e0             = std::min(e0, e);
+        e1             = std::max(e1, e);
+      }
 
-SceneRaycaster& SceneRaycaster::operator=(SceneRaycaster&& other) noexcept {
-  if(this != &other) {
-    delete bvh;
+      float guards[12];
+      if(tile.size() < PACKET_MIN_RAYS || !packet_guards(ref + a0, ref + a1, e0, e1, guards)) {
+        packets.scalar.insert(packets.scalar.end(), tile.begin(), tile.end());
+        continue;
+      }
 
-    build_dirty = other.build_dirty;
-    boxes       = std::move(other.boxes);
-    spheres     = std::move(other.spheres);
-    vertices    = std::move(other.vertices);
-    indices     = std::move(other.indices);
-    bvh         = other.bvh;
-    other.bvh   = nullptr;
+      // 余った枠は先頭の方向で埋める（同じ結果が書き戻されるだけ）
+      size_t next = 0;
+      for(size_t i = 0; i < PACKET_RAYS; i++) {
+        const bool used = !is_packet_corner(i) && next < tile.size();
+        packets.slots.push_back(used ? tile[next++] : tile[0]);
+      }
+      packets.guards.insert(packets.guards.end(), guards, guards + 12);
+    }
   }
-  return *this;
 }
 
+// Vec3の配列をdoubleの連続配列として扱うため
+static_assert(sizeof(Vec3) == 3 * sizeof(double), "Vec3 must be tightly packed");
+static_assert(sizeof(Vec3i) == 3 * sizeof(int32_t), "Vec3i must be tightly packed");
+
+// tinybvh がこの環境でCPU向けに実装しているレイアウト（コンパイラのSIMD指定で決まる）
+#if defined(BVH_USEAVX) || defined(BVH_USENEON)
+#define SKYRATIO_HAS_BVH_SOA
+#endif
+#if defined(BVH_USESSE) || defined(BVH_USENEON)
+#define SKYRATIO_HAS_BVH4_CPU
+#endif
+#if defined(BVH_USEAVX2)
+#define SKYRATIO_HAS_BVH8_CPU
+#endif
+
+struct SceneRaycaster::ConvertedBvh {
+#ifdef SKYRATIO_HAS_BVH_SOA
+  tinybvh::BVH_SoA soa;
+#endif
+#ifdef SKYRATIO_HAS_BVH4_CPU
+  tinybvh::MBVH<4> mbvh4;
+  tinybvh::BVH4_CPU wide4;
+#endif
+#ifdef SKYRATIO_HAS_BVH8_CPU
+  tinybvh::MBVH<8> mbvh8;
+  tinybvh::BVH8_CPU wide8;
+#endif
+};
+
+struct SceneRaycaster::AnalyticBvh {
+  std::vector<AnalyticShape> shapes; // [ボックス][球]
+  tinybvh::BVH bvh;                  // shapes のAABBで作った木（葉の形状はコールバックで判定する）
+};
+
+struct SceneRaycaster::StatsSink {
+  std::mutex mutex; // 読み取り専用の問い合わせは複数スレッドから呼ばれうる
+  QueryStats stats;
+};
+
+SceneRaycaster::SceneRaycaster()                                    = default;
+SceneRaycaster::~SceneRaycaster()                                   = default;
+SceneRaycaster::SceneRaycaster(SceneRaycaster&& other) noexcept            = default;
+SceneRaycaster& SceneRaycaster::operator=(SceneRaycaster&& other) noexcept = default;
+
 void SceneRaycaster::clear() {
   boxes.clear();
   spheres.clear();
   vertices.clear();
   indices.clear();
-  delete bvh;
-  bvh         = nullptr;
-  build_dirty = true;
+  primitive_vertices.clear();
+  primitive_indices.clear();
+  triangles.clear();
+  triangle_indices.clear();
+  dirty_boxes.clear();
+  dirty_spheres.clear();
+  node_parent.clear();
+  prim_leaf.clear();
+  bvh.reset();
+  analytic_bvh.reset();
+  scene_file.reset();
+  build_dirty         = true;
+  pending_change.full = true;
+  refits_since_build  = 0;
+  host_released       = false;
+  user_vertex_count   = 0;
+  user_triangle_count = 0;
 }
 
-void SceneRaycaster::add_box(const Vec3& pos, const Vec3& size, const Vec3& euler) {
+size_t SceneRaycaster::add_box(const Vec3& pos, const Vec3& size, const Vec3& euler) {
   boxes.push_back({pos, size, euler});
+  const auto bounds = shape_bounds(make_box_shape(boxes.back()));
+  note_change(bounds.first, bounds.second);
   build_dirty = true;
+  return boxes.size() - 1;
 }
 
-void SceneRaycaster::add_sphere(const Vec3& center, double radius) {
+size_t SceneRaycaster::add_sphere(const Vec3& center, double radius) {
   spheres.push_back({center, radius});
+  const auto bounds = shape_bounds(make_sphere_shape(spheres.back()));
+  note_change(bounds.first, bounds.second);
   build_dirty = true;
+  return spheres.size() - 1;
 }
 
-void SceneRaycaster::add_mesh(const std::vector<Vec3>& mesh_vertices) {
-  if(mesh_vertices.size() % 3 != 0) {
-    return;
+void SceneRaycaster::add_mesh(const std::vector<Vec3>& mesh_vertices) { add_mesh(mesh_vertices.empty() ? nullptr : mesh_vertices[0].data(), mesh_vertices.size()); }
+
+template <typename T> void SceneRaycaster::add_mesh(const T* mesh_vertices, size_t vertex_count) {
+  if(vertex_count % 3 != 0) {
+    throw std::invalid_argument("Mesh vertex count must be a multiple of 3");
   }
+  if(host_released) throw std::logic_error("Cannot add meshes after release_host_geometry.");
 
-  size_t base_idx = vertices.size() / 3;
+  size_t base_idx = vertices.size();
 
-  for(const auto& v : mesh_vertices) vertices.push_back(v);
+  vertices.reserve(base_idx + vertex_count);
+  Vec3 lo = {HUGE_VAL, HUGE_VAL, HUGE_VAL}, hi = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+  for(size_t i = 0; i < vertex_count; i++) {
+    vertices.push_back(Vec3{(double)mesh_vertices[i * 3], (double)mesh_vertices[i * 3 + 1], (double)mesh_vertices[i * 3 + 2]});
+    for(int k = 0; k < 3; k++) {
+      lo[k] = std::min(lo[k], vertices.back()[k]);
+      hi[k] = std::max(hi[k], vertices.back()[k]);
+    }
+  }
+  note_change(lo, hi);
 
-  for(size_t i = 0; i < mesh_vertices.size() / 3; i++) //
+  indices.reserve(indices.size() + vertex_count / 3);
+  for(size_t i = 0; i < vertex_count / 3; i++) //
     indices.push_back(Vec3i{(int)(base_idx + i * 3), (int)(base_idx + i * 3 + 1), (int)(base_idx + i * 3 + 2)});
   build_dirty = true;
 }
 
-void SceneRaycaster::build() {
-  // ボックスをメッシュに変換
-  for(const auto& box : boxes) {
-    auto rot_mat   = euler_to_rotation_matrix(box.euler);
-    Vec3 half_size = {box.size[0] / 2, box.size[1] / 2, box.size[2] / 2};
+void SceneRaycaster::add_indexed_mesh(std::vector<Vec3> mesh_vertices, std::vector<Vec3i> mesh_indices) {
+  if(host_released) throw std::logic_error("Cannot add meshes after release_host_geometry.");
+  if(vertices.size() + mesh_vertices.size() > static_cast<size_t>(std::numeric_limits<int>::max())) throw std::length_error("Too many vertices in scene");
+  for(const auto& tri : mesh_indices) {
+    for(int k = 0; k < 3; k++) {
+      if(tri[k] < 0 || tri[k] >= static_cast<int>(mesh_vertices.size())) throw std::out_of_range("Invalid vertex index in triangle");
+    }
+  }
+  Vec3 lo = {HUGE_VAL, HUGE_VAL, HUGE_VAL}, hi = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+  for(const auto& v : mesh_vertices) {
+    for(int k = 0; k < 3; k++) {
+      lo[k] = std::min(lo[k], v[k]);
+      hi[k] = std::max(hi[k], v[k]);
+    }
+  }
+  note_change(lo, hi);
+
+  if(vertices.empty() && indices.empty()) {
+    // 最初のメッシュはコピーせずにそのまま使う
+    vertices = std::move(mesh_vertices);
+    indices  = std::move(mesh_indices);
+  } else {
+    const int base = static_cast<int>(vertices.size());
+    vertices.insert(vertices.end(), mesh_vertices.begin(), mesh_vertices.end());
+    indices.reserve(indices.size() + mesh_indices.size());
+    for(const auto& tri : mesh_indices) indices.push_back(Vec3i{tri[0] + base, tri[1] + base, tri[2] + base});
+  }
+  build_dirty = true;
+}
+
+void SceneRaycaster::update_box(size_t id, const Vec3& pos, const Vec3& size, const Vec3& euler) {
+  if(id >= boxes.size()) throw std::out_of_range("Invalid box id");
+  // 変更前後の範囲を記録する
+  const auto before = shape_bounds(make_box_shape(boxes[id]));
+  boxes[id]         = {pos, size, euler};
+  const auto after  = shape_bounds(make_box_shape(boxes[id]));
+  note_change(before.first, before.second);
+  note_change(after.first, after.second);
+  dirty_boxes.push_back(id);
+}
+
+void SceneRaycaster::update_sphere(size_t id, const Vec3& center, double radius) {
+  if(id >= spheres.size()) throw std::out_of_range("Invalid sphere id");
+  const auto before = shape_bounds(make_sphere_shape(spheres[id]));
+  spheres[id]       = {center, radius};
+  const auto after  = shape_bounds(make_sphere_shape(spheres[id]));
+  note_change(before.first, before.second);
+  note_change(after.first, after.second);
+  dirty_spheres.push_back(id);
+}
+
+void SceneRaycaster::remove_box(size_t id) {
+  if(id >= boxes.size()) throw std::out_of_range("Invalid box id");
+  // 三角形の数を変えないよう、削除したボックスは1点に潰した三角形として残す
+  const auto bounds = shape_bounds(make_box_shape(boxes[id]));
+  note_change(bounds.first, bounds.second);
+  boxes[id].removed = true;
+  dirty_boxes.push_back(id);
+}
+
+void SceneRaycaster::remove_sphere(size_t id) {
+  if(id >= spheres.size()) throw std::out_of_range("Invalid sphere id");
+  const auto bounds = shape_bounds(make_sphere_shape(spheres[id]));
+  note_change(bounds.first, bounds.second);
+  spheres[id].removed = true;
+  dirty_spheres.push_back(id);
+}
+
+void SceneRaycaster::tessellate_box(size_t id) {
+  const Box& box = boxes[id];
+  Vec3* corners  = &primitive_vertices[id * BOX_VERTICES];
+  if(box.removed) {
+    std::fill(corners, corners + BOX_VERTICES, box.center);
+  } else {
+    generate_box_corners(box, corners);
+  }
+}
+
+void SceneRaycaster::tessellate_sphere(size_t id) {
+  const Sphere& sphere = spheres[id];
+  Vec3* verts          = &primitive_vertices[boxes.size() * BOX_VERTICES + id * SPHERE_VERTICES];
+  if(sphere.removed) {
+    std::fill(verts, verts + SPHERE_VERTICES, sphere.center);
+  } else {
+    generate_uv_sphere(sphere.center, sphere.radius, verts);
+  }
+}
+
+void SceneRaycaster::tessellate_primitives() {
+  if(build_options.analytic_primitives) {
+    // 解析的に扱う場合は三角形にしない
+    primitive_vertices.clear();
+    primitive_indices.clear();
+    return;
+  }
+  // 形状ごとの書き込み先は固定なので、確保した配列に形状の範囲ごとに並列で書き込む
+  primitive_vertices.resize(boxes.size() * BOX_VERTICES + spheres.size() * SPHERE_VERTICES);
+  primitive_indices.resize(boxes.size() * BOX_TRIANGLES + spheres.size() * SPHERE_TRIANGLES);
+  parallel_for(boxes.size() + spheres.size(), build_options.threads, TESSELLATION_GRAIN, [&](size_t begin, size_t end, int) {
+    for(size_t k = begin; k < end; k++) {
+      if(k < boxes.size()) {
+        tessellate_box(k);
+        for(size_t f = 0; f < BOX_TRIANGLES; f++) {
+          const int base                           = (int)(k * BOX_VERTICES);
+          primitive_indices[k * BOX_TRIANGLES + f] = Vec3i{base + BOX_FACES[f][0], base + BOX_FACES[f][1], base + BOX_FACES[f][2]};
+        }
+      } else {
+        const size_t i = k - boxes.size();
+        tessellate_sphere(i);
+        generate_uv_sphere_indices((int)(boxes.size() * BOX_VERTICES + i * SPHERE_VERTICES), &primitive_indices[boxes.size() * BOX_TRIANGLES + i * SPHERE_TRIANGLES]);
+      }
+    }
+  });
+}
+
+void SceneRaycaster::write_triangles(size_t first_index, size_t last_index, size_t tri_offset, size_t vertex_offset, const std::vector<Vec3>& src_vertices, const std::vector<Vec3i>& src_indices) {
+  for(size_t i = first_index; i < last_index; i++) {
+    for(int k = 0; k < 3; k++) {
+      if(src_indices[i][k] < 0 || src_indices[i][k] >= static_cast<int>(src_vertices.size())) {
+        throw std::runtime_error("Invalid vertex index in triangle");
+      }
+      const size_t dst = (tri_offset + i - first_index) * 3 + k;
+      if(compact) {
+        // コンパクトモードではインデックスだけを書き、頂点は upload_vertices で書く
+        triangle_indices[dst] = static_cast<uint32_t>(vertex_offset + src_indices[i][k]);
+      } else {
+        const auto& v  = src_vertices[src_indices[i][k]];
+        triangles[dst] = tinybvh::bvhvec4((float)v[0], (float)v[1], (float)v[2], 0.0f);
+      }
+    }
+  }
+}
+
+void SceneRaycaster::upload_vertices(size_t first, size_t last, size_t vertex_offset, const std::vector<Vec3>& src_vertices) {
+  for(size_t i = first; i < last; i++) {
+    const auto& v                          = src_vertices[i];
+    triangles[vertex_offset + i - first] = tinybvh::bvhvec4((float)v[0], (float)v[1], (float)v[2], 0.0f);
+  }
+}
 
-    std::vector<Vec3> corners(8);
-    for(int i = 0; i < 8; i++) {
-      Vec3 local   = {(i & 1) ? half_size[0] : -half_size[0], (i & 2) ? half_size[1] : -half_size[1], (i & 4) ? half_size[2] : -half_size[2]};
-        Vec3 rotated = matrix_vector_multiply(rot_mat, local);
-      corners[i]   = {rotated[0] + box.center[0], rotated[1] + box.center[1], rotated[2] + box.center[2]};
+void SceneRaycaster::rebuild_bvh() {
+  bvh.reset();
+  // 作り直すBVHはマップ領域を使わないので、頂点・インデックスも参照していなければ読み込んだシーンキャッシュを閉じる
+  if(!triangles.mapped() && !triangle_indices.mapped()) scene_file.reset();
+  node_parent.clear();
+  prim_leaf.clear();
+  refits_since_build = 0;
+  if(triangle_count() == 0) return;
+
+  bvh                       = std::make_unique<tinybvh::BVH>();
+  const BvhBuilder builder  = build_options.builder;
+  if(build_split_bvh()) {
+    // 部分木を並列に構築してつないだ
+  } else if(compact) {
+    // インデックス付きでビルドし、非インデックスのコピーを作らない（中央分割のインデックス版はないのでビン分割を使う）
+    const tinybvh::bvhvec4slice slice(triangles.data(), (uint32_t)triangles.size(), sizeof(tinybvh::bvhvec4));
+    if(builder == BvhBuilder::HighQuality) {
+      bvh->BuildHQ(slice, triangle_indices.data(), (uint32_t)triangle_count());
+    } else {
+      bvh->Build(slice, triangle_indices.data(), (uint32_t)triangle_count());
     }
+  } else {
+    switch(builder) {
+      case BvhBuilder::Binned: bvh->Build(triangles.data(), triangles.size() / 3); break;
+      case BvhBuilder::Quick: bvh->BuildQuick(triangles.data(), triangles.size() / 3); break;
+      case BvhBuilder::HighQuality: bvh->BuildHQ(triangles.data(), triangles.size() / 3); break;
+    }
+  }
+  if(build_options.optimize && builder != BvhBuilder::HighQuality) bvh->Optimize();
+
+  update_converted_bvh();
+}
 
-    std::vector<std::array<int, 3>> faces = {{0, 1, 2}, {2, 1, 3}, {4, 6, 5}, {5, 6, 7}, {0, 2, 4}, {4, 2, 6}, {1, 5, 3}, {3, 5, 7}, {0, 4, 1}, {1, 4, 5}, {2, 3, 6}, {6, 3, 7}};
+bool SceneRaycaster::build_split_bvh() {
+  // 中央分割の構築はもともと速く、インデックス版もないので分けない
+  if(build_options.builder == BvhBuilder::Quick) return false;
+  const size_t num_triangles = triangle_count();
+  const int threads          = resolve_thread_count(build_options.threads);
+  size_t groups              = 1;
+  while(groups * 2 <= static_cast<size_t>(threads) && num_triangles / (groups * 2) >= SPLIT_BUILD_MIN_TRIANGLES) groups *= 2;
+  if(groups < 2) return false;
 
-    size_t base_idx = vertices.size();
-    for(const auto& c : corners) vertices.push_back(c);
-    for(const auto& f : faces) {
-      indices.push_back(Vec3i{(int)(base_idx + f[0]), (int)(base_idx + f[1]), (int)(base_idx + f[2])});
+  // 三角形の並びを、重心の最も長い軸の中央値で半分ずつに分けていく（部分木 g は [num_triangles * g / groups, num_triangles * (g + 1) / groups) を受け持つ）
+  std::vector<std::array<float, 3>> centroids(num_triangles);
+  parallel_for(num_triangles, threads, CONVERSION_GRAIN, [&](size_t begin, size_t end, int) {
+    for(size_t i = begin; i < end; i++) {
+      const auto& a = triangle_vertex(i, 0);
+      const auto& b = triangle_vertex(i, 1);
+      const auto& c = triangle_vertex(i, 2);
+      centroids[i]  = {(a.x + b.x + c.x) / 3.0f, (a.y + b.y + c.y) / 3.0f, (a.z + b.z + c.z) / 3.0f};
     }
+  });
+  std::vector<uint32_t> order(num_triangles);
+  std::iota(order.begin(), order.end(), 0u);
+  for(size_t ranges = 1; ranges < groups; ranges *= 2) {
+    parallel_for(ranges, threads, 1, [&](size_t begin, size_t end, int) {
+      for(size_t r = begin; r < end; r++) {
+        const size_t first = num_triangles * r / ranges;
+        const size_t last  = num_triangles * (r + 1) / ranges;
+        const size_t mid   = num_triangles * (2 * r + 1) / (2 * ranges);
+        std::array<float, 3> mn{1e30f, 1e30f, 1e30f}, mx{-1e30f, -1e30f, -1e30f};
+        for(size_t i = first; i < last; i++) {
+          for(int k = 0; k < 3; k++) {
+            mn[k] = std::min(mn[k], centroids[order[i]][k]);
+            mx[k] = std::max(mx[k], centroids[order[i]][k]);
+          }
+        }
+        int axis = 0;
+        for(int k = 1; k < 3; k++) {
+          if(mx[k] - mn[k] > mx[axis] - mn[axis]) axis = k;
+        }
+        std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + last, [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+      }
+    });
   }
+  centroids = {};
 
-  // 球をUV球メッシュに変換
-  for(const auto& sphere : spheres) {
-    generate_uv_sphere(sphere.center, sphere.radius, 16, 8, vertices, indices);
+  // 部分木ごとにインデックスを作って構築する（部分木の primIdx は order の範囲内の番号になる）
+  const tinybvh::bvhvec4slice slice(triangles.data(), (uint32_t)triangles.size(), sizeof(tinybvh::bvhvec4));
+  std::unique_ptr<tinybvh::BVH[]> parts(new tinybvh::BVH[groups]);
+  std::vector<std::vector<uint32_t>> part_indices(groups);
+  parallel_for(groups, threads, 1, [&](size_t begin, size_t end, int) {
+    for(size_t g = begin; g < end; g++) {
+      const size_t first = num_triangles * g / groups;
+      const size_t count = num_triangles * (g + 1) / groups - first;
+      auto& idx          = part_indices[g];
+      idx.resize(count * 3);
+      for(size_t i = 0; i < count; i++) {
+        for(size_t k = 0; k < 3; k++) idx[i * 3 + k] = compact ? triangle_indices[order[first + i] * 3 + k] : static_cast<uint32_t>(order[first + i] * 3 + k);
+      }
+      if(build_options.builder == BvhBuilder::HighQuality) {
+        parts[g].BuildHQ(slice, idx.data(), (uint32_t)count);
+      } else {
+        parts[g].Build(slice, idx.data(), (uint32_t)count);
+      }
+    }
+  });
+
+  // 上の段のノードは根を0、それ以外をヒープ順の番号 [2, 2 * groups) に置く（1は tiny_bvh と同じく使わない）
+  // 部分木の根は上の段の葉 groups + g に、残りのノード [2, usedNodes) はその後ろにまとめて並べるので、子は常に親より後ろにある
+  std::vector<uint32_t> node_base(groups), prim_base(groups);
+  uint32_t node_count = static_cast<uint32_t>(2 * groups);
+  uint32_t prim_count = 0;
+  for(size_t g = 0; g < groups; g++) {
+    node_base[g] = node_count;
+    prim_base[g] = prim_count;
+    node_count += parts[g].usedNodes - 2;
+    prim_count += parts[g].idxCount;
+  }
+  using Node   = tinybvh::BVH::BVHNode;
+  auto* nodes  = static_cast<Node*>(bvh->context.malloc(node_count * sizeof(Node), bvh->context.userdata));
+  auto* prims  = static_cast<uint32_t*>(bvh->context.malloc(prim_count * sizeof(uint32_t), bvh->context.userdata));
+  parallel_for(groups, threads, 1, [&](size_t begin, size_t end, int) {
+    for(size_t g = begin; g < end; g++) {
+      const tinybvh::BVH& part = parts[g];
+      auto relocate            = [&](Node node) {
+        node.leftFirst = node.isLeaf() ? node.leftFirst + prim_base[g] : node_base[g] + node.leftFirst - 2;
+        return node;
+      };
+      nodes[groups + g] = relocate(part.bvhNode[0]);
+      for(uint32_t n = 2; n < part.usedNodes; n++) nodes[node_base[g] + n - 2] = relocate(part.bvhNode[n]);
+      const size_t first = num_triangles * g / groups;
+      for(uint32_t i = 0; i < part.idxCount; i++) prims[prim_base[g] + i] = order[first + part.primIdx[i]];
+    }
+  });
+  for(size_t h = groups - 1; h >= 1; h--) {
+    const Node& left  = nodes[2 * h];
+    const Node& right = nodes[2 * h + 1];
+    Node& node        = nodes[h == 1 ? 0 : h];
+    node.aabbMin      = tinybvh::bvhvec3(std::min(left.aabbMin.x, right.aabbMin.x), std::min(left.aabbMin.y, right.aabbMin.y), std::min(left.aabbMin.z, right.aabbMin.z));
+    node.aabbMax      = tinybvh::bvhvec3(std::max(left.aabbMax.x, right.aabbMax.x), std::max(left.aabbMax.y, right.aabbMax.y), std::max(left.aabbMax.z, right.aabbMax.z));
+    node.leftFirst    = static_cast<uint32_t>(2 * h);
+    node.triCount     = 0;
   }
+  std::memset(&nodes[1], 0, sizeof(Node));
 
-  // BVHを構築
-  if(!vertices.empty() && !indices.empty()) {
-    triangles.clear();
-    triangles.reserve(indices.size());
-    for(size_t i = 0; i < indices.size(); i++) {
-      for(int k = 0; k < 3; k++) {
-        const auto& v = vertices[indices[i][k]];
-        triangles.push_back(tinybvh::bvhvec4(v[0], v[1], v[2], 0.0f));
+  bvh->bvhNode        = nodes;
+  bvh->primIdx        = prims;
+  bvh->allocatedNodes = bvh->usedNodes = node_count;
+  bvh->triCount   = static_cast<uint32_t>(num_triangles);
+  bvh->idxCount   = prim_count;
+  bvh->refittable = parts[0].refittable;
+  bvh->verts      = slice;
+  if(compact) {
+    bvh->vertIdx          = triangle_indices.data();
+    bvh->bvh_over_indices = true;
+  }
+  return true;
+}
+
+void SceneRaycaster::rebuild_analytic_bvh() {
+  if(!build_options.analytic_primitives || boxes.size() + spheres.size() == 0) {
+    analytic_bvh.reset();
+    return;
+  }
+
+  // 形状の数は三角形よりずっと少ないので、変更があれば毎回作り直す
+  if(!analytic_bvh) analytic_bvh = std::make_unique<AnalyticBvh>();
+  auto& shapes = analytic_bvh->shapes;
+  shapes.clear();
+  shapes.reserve(boxes.size() + spheres.size());
+  for(const auto& box : boxes) shapes.push_back(make_box_shape(box));
+  for(const auto& sphere : spheres) shapes.push_back(make_sphere_shape(sphere));
+  active_shapes = shapes.data();
+  analytic_bvh->bvh.Build(analytic_aabb, static_cast<unsigned>(shapes.size()));
+  analytic_bvh->bvh.customIntersect  = analytic_intersect;
+  analytic_bvh->bvh.customIsOccluded = analytic_occluded;
+}
+
+bool SceneRaycaster::has_geometry() const { return triangle_count() > 0 || (analytic_bvh && !analytic_bvh->shapes.empty()); }
+
+bool SceneRaycaster::layout_supported(BvhLayout layout) {
+  switch(layout) {
+    case BvhLayout::Standard: return true;
+#ifdef SKYRATIO_HAS_BVH_SOA
+    case BvhLayout::SoA: return true;
+#endif
+#ifdef SKYRATIO_HAS_BVH4_CPU
+    case BvhLayout::Wide4: return true;
+#endif
+#ifdef SKYRATIO_HAS_BVH8_CPU
+    case BvhLayout::Wide8: return true;
+#endif
+    default: return false;
+  }
+}
+
+void SceneRaycaster::update_converted_bvh() {
+  active_layout = layout_supported(build_options.layout) ? build_options.layout : BvhLayout::Standard;
+  if(!bvh || active_layout == BvhLayout::Standard) {
+    converted_bvh.reset();
+    return;
+  }
+
+  // 変換は構築に比べて十分軽いので、リフィットの後も毎回作り直す
+  if(!converted_bvh) converted_bvh = std::make_unique<ConvertedBvh>();
+  switch(active_layout) {
+#ifdef SKYRATIO_HAS_BVH_SOA
+    case BvhLayout::SoA: converted_bvh->soa.ConvertFrom(*bvh); break;
+#endif
+#ifdef SKYRATIO_HAS_BVH4_CPU
+    case BvhLayout::Wide4:
+      converted_bvh->mbvh4.ConvertFrom(*bvh);
+      converted_bvh->wide4.ConvertFrom(converted_bvh->mbvh4);
+      break;
+#endif
+#ifdef SKYRATIO_HAS_BVH8_CPU
+    case BvhLayout::Wide8:
+      converted_bvh->mbvh8.ConvertFrom(*bvh);
+      converted_bvh->wide8.ConvertFrom(converted_bvh->mbvh8);
+      break;
+#endif
+    default: break;
+  }
+}
+
+void SceneRaycaster::set_build_options(const BuildOptions& options) {
+  const bool rebuild = options.builder != build_options.builder || options.optimize != build_options.optimize || options.analytic_primitives != build_options.analytic_primitives;
+  if(options.analytic_primitives != build_options.analytic_primitives) pending_change.full = true; // 交差判定の結果が形状全体で変わる
+  build_options = options;
+  if(rebuild) {
+    build_dirty = true;
+  } else {
+    // レイアウトだけの変更なら作り直さずに変換する
+    update_converted_bvh();
+  }
+}
+
+int32_t SceneRaycaster::intersect(tinybvh::Ray& ray) const {
+  // 三角形で縮めた hit.t より手前の形状だけを解析的に判定する
+  int32_t steps = bvh ? intersect_triangles(ray) : 0;
+  if(analytic_bvh) steps += intersect_analytic(ray);
+  return steps;
+}
+
+int32_t SceneRaycaster::intersect_analytic(tinybvh::Ray& ray) const {
+  active_shapes = analytic_bvh->shapes.data();
+  return analytic_bvh->bvh.Intersect(ray);
+}
+
+bool SceneRaycaster::test_occlusion(const tinybvh::Ray& ray) const {
+  if(bvh && test_triangle_occlusion(ray)) return true;
+  return analytic_bvh && test_analytic_occlusion(ray);
+}
+
+bool SceneRaycaster::test_analytic_occlusion(const tinybvh::Ray& ray) const {
+  active_shapes = analytic_bvh->shapes.data();
+  return analytic_bvh->bvh.IsOccluded(ray);
+}
+
+int32_t SceneRaycaster::intersect_triangles(tinybvh::Ray& ray) const {
+  switch(active_layout) {
+#ifdef SKYRATIO_HAS_BVH_SOA
+    case BvhLayout::SoA: return converted_bvh->soa.Intersect(ray);
+#endif
+#ifdef SKYRATIO_HAS_BVH4_CPU
+    case BvhLayout::Wide4: return converted_bvh->wide4.Intersect(ray);
+#endif
+#ifdef SKYRATIO_HAS_BVH8_CPU
+    case BvhLayout::Wide8: return converted_bvh->wide8.Intersect(ray);
+#endif
+    default: return bvh->Intersect(ray);
+  }
+}
+
+bool SceneRaycaster::test_triangle_occlusion(const tinybvh::Ray& ray) const {
+  switch(active_layout) {
+#ifdef SKYRATIO_HAS_BVH_SOA
+    case BvhLayout::SoA: return converted_bvh->soa.IsOccluded(ray);
+#endif
+#ifdef SKYRATIO_HAS_BVH4_CPU
+    case BvhLayout::Wide4: return converted_bvh->wide4.IsOccluded(ray);
+#endif
+#ifdef SKYRATIO_HAS_BVH8_CPU
+    case BvhLayout::Wide8: return converted_bvh->wide8.IsOccluded(ray);
+#endif
+    default: return bvh->IsOccluded(ray);
+  }
+}
+
+void SceneRaycaster::refit_triangles(const std::vector<uint32_t>& tri_ids) {
+  // 変更が多い場合は木全体をリフィットする
+  if(tri_ids.size() * 4 > triangle_count()) {
+    bvh->Refit();
+    return;
+  }
+
+  const auto* nodes = bvh->bvhNode;
+  if(node_parent.empty()) {
+    node_parent.assign(bvh->usedNodes, 0);
+    prim_leaf.assign(triangle_count(), 0);
+    std::vector<uint32_t> stack = {0};
+    while(!stack.empty()) {
+      uint32_t n = stack.back();
+      stack.pop_back();
+      if(nodes[n].isLeaf()) {
+        for(uint32_t k = 0; k < nodes[n].triCount; k++) prim_leaf[bvh->primIdx[nodes[n].leftFirst + k]] = n;
+      } else {
+        for(uint32_t c = nodes[n].leftFirst; c <= nodes[n].leftFirst + 1; c++) {
+          node_parent[c] = n;
+          stack.push_back(c);
+        }
+      }
+    }
+  }
+
+  std::vector<uint32_t> leaves;
+  leaves.reserve(tri_ids.size());
+  for(uint32_t t : tri_ids) leaves.push_back(prim_leaf[t]);
+  std::sort(leaves.begin(), leaves.end());
+  leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+
+  auto& node_array = bvh->bvhNode;
+  for(uint32_t leaf : leaves) {
+    // 葉のAABBを三角形から計算し直す
+    auto& node = node_array[leaf];
+    tinybvh::bvhvec3 mn(1e30f), mx(-1e30f);
+    for(uint32_t k = 0; k < node.triCount; k++) {
+      const uint32_t prim = bvh->primIdx[node.leftFirst + k];
+      for(int v = 0; v < 3; v++) {
+        const auto& p = triangle_vertex(prim, v);
+        mn            = tinybvh::bvhvec3(std::min(mn.x, p.x), std::min(mn.y, p.y), std::min(mn.z, p.z));
+        mx            = tinybvh::bvhvec3(std::max(mx.x, p.x), std::max(mx.y, p.y), std::max(mx.z, p.z));
       }
     }
+    node.aabbMin = mn;
+    node.aabbMax = mx;
 
-    delete bvh;
-    bvh = new tinybvh::BVH();
-    bvh->Build(triangles.data(), triangles.size() / 3);
+    // 根まで親のAABBを更新する
+    for(uint32_t n = leaf; n != 0;) {
+      n            = node_parent[n];
+      auto& parent = node_array[n];
+      const auto& l = node_array[parent.leftFirst];
+      const auto& r = node_array[parent.leftFirst + 1];
+      parent.aabbMin = tinybvh::bvhvec3(std::min(l.aabbMin.x, r.aabbMin.x), std::min(l.aabbMin.y, r.aabbMin.y), std::min(l.aabbMin.z, r.aabbMin.z));
+      parent.aabbMax = tinybvh::bvhvec3(std::max(l.aabbMax.x, r.aabbMax.x), std::max(l.aabbMax.y, r.aabbMax.y), std::max(l.aabbMax.z, r.aabbMax.z));
+    }
   }
+}
+
+void SceneRaycaster::set_collect_stats(bool enable) {
+  if(enable && !stats_sink) stats_sink = std::make_unique<StatsSink>();
+  if(!enable) stats_sink.reset();
+}
+
+QueryStats SceneRaycaster::stats() const {
+  if(!stats_sink) return {};
+  std::lock_guard<std::mutex> lock(stats_sink->mutex);
+  return stats_sink->stats;
+}
+
+void SceneRaycaster::reset_stats() {
+  if(!stats_sink) return;
+  std::lock_guard<std::mutex> lock(stats_sink->mutex);
+  stats_sink->stats = {};
+}
+
+void SceneRaycaster::record_stats(const QueryStats& local, QueryStats* stats) const {
+  if(stats) {
+    *stats += local;
+  } else if(stats_sink) {
+    std::lock_guard<std::mutex> lock(stats_sink->mutex);
+    stats_sink->stats += local;
+  }
+}
+
+void SceneRaycaster::build(QueryStats* stats) {
+  if(!needs_build()) return;
+
+  QueryStats local;
+  StageTimer timer(stats || stats_sink ? &local : nullptr);
+  if(build_dirty) {
+    // ホスト側の頂点を解放した後はユーザーメッシュ部分をそのまま残す
+    if(!host_released) {
+      user_vertex_count   = vertices.size();
+      user_triangle_count = indices.size();
+    }
+
+    // ボックス・球をメッシュに変換（ユーザーメッシュとは別の配列に入れる）
+    tessellate_primitives();
+
+    // BVH用の単精度バッファを作成（書き込み先が重ならない範囲ごとに並列で変換する）
+    auto convert = [&](size_t count, auto&& fn) { parallel_for(count, build_options.threads, CONVERSION_GRAIN, [&](size_t begin, size_t end, int) { fn(begin, end); }); };
+    const size_t total_triangles = user_triangle_count + primitive_indices.size();
+    if(compact) {
+      triangles.resize(user_vertex_count + primitive_vertices.size());
+      triangle_indices.resize(total_triangles * 3);
+      if(!host_released) {
+        convert(vertices.size(), [&](size_t begin, size_t end) { upload_vertices(begin, end, begin, vertices); });
+        convert(indices.size(), [&](size_t begin, size_t end) { write_triangles(begin, end, begin, 0, vertices, indices); });
+      }
+      convert(primitive_vertices.size(), [&](size_t begin, size_t end) { upload_vertices(begin, end, user_vertex_count + begin, primitive_vertices); });
+    } else {
+      triangles.resize(total_triangles * 3);
+      triangle_indices.clear();
+      convert(indices.size(), [&](size_t begin, size_t end) { write_triangles(begin, end, begin, 0, vertices, indices); });
+    }
+    convert(primitive_indices.size(), [&](size_t begin, size_t end) { write_triangles(begin, end, user_triangle_count + begin, user_vertex_count, primitive_vertices, primitive_indices); });
+    mesh_hash = hash_user_mesh();
+    timer.lap(&QueryStats::tessellation_seconds);
+
+    // BVHを構築。三角形のBVHとボックス・球のBVHは独立しているので並行して作る（三角形が多ければ三角形のBVHも部分木ごとに並列で作る）
+    if(build_options.analytic_primitives) {
+      parallel_for(2, build_options.threads, 1, [&](size_t begin, size_t end, int) {
+        for(size_t k = begin; k < end; k++) {
+          if(k == 0) {
+            rebuild_bvh();
+          } else {
+            rebuild_analytic_bvh();
+          }
+        }
+      });
+    } else {
+      rebuild_bvh();
+      rebuild_analytic_bvh();
+    }
+    local.builds++;
+  } else if(build_options.analytic_primitives) {
+    // 三角形は変わらないので、ボックス・球のBVHだけを作り直す
+    rebuild_analytic_bvh();
+    local.builds++;
+  } else {
+    // 形状が変わったオブジェクトだけ三角形を書き換えてリフィット
+    std::sort(dirty_boxes.begin(), dirty_boxes.end());
+    dirty_boxes.erase(std::unique(dirty_boxes.begin(), dirty_boxes.end()), dirty_boxes.end());
+    std::sort(dirty_spheres.begin(), dirty_spheres.end());
+    dirty_spheres.erase(std::unique(dirty_spheres.begin(), dirty_spheres.end()), dirty_spheres.end());
+
+    const size_t box_tri_base    = user_triangle_count;
+    const size_t sphere_tri_base = box_tri_base + boxes.size() * BOX_TRIANGLES;
+    const size_t sphere_vtx_base = boxes.size() * BOX_VERTICES;
+
+    // 三角形 [first_tri, first_tri + tri_count) と頂点 [first_vtx, first_vtx + vtx_count) を書き直す
+    std::vector<uint32_t> changed;
+    auto rewrite = [&](size_t first_tri, size_t tri_count, size_t first_vtx, size_t vtx_count) {
+      if(compact) {
+        upload_vertices(first_vtx, first_vtx + vtx_count, user_vertex_count + first_vtx, primitive_vertices);
+      } else {
+        write_triangles(first_tri, first_tri + tri_count, user_triangle_count + first_tri, user_vertex_count, primitive_vertices, primitive_indices);
+      }
+      for(size_t f = 0; f < tri_count; f++) changed.push_back((uint32_t)(user_triangle_count + first_tri + f));
+    };
+    for(size_t id : dirty_boxes) {
+      tessellate_box(id);
+      rewrite(id * BOX_TRIANGLES, BOX_TRIANGLES, id * BOX_VERTICES, BOX_VERTICES);
+    }
+    for(size_t id : dirty_spheres) {
+      tessellate_sphere(id);
+      rewrite(sphere_tri_base - box_tri_base + id * SPHERE_TRIANGLES, SPHERE_TRIANGLES, sphere_vtx_base + id * SPHERE_VERTICES, SPHERE_VERTICES);
+    }
+    timer.lap(&QueryStats::tessellation_seconds);
+
+    if(bvh && !changed.empty()) {
+      // 空間分割で作った木は三角形が複数の葉に入るのでリフィットできない
+      if(build_options.builder == BvhBuilder::HighQuality || ++refits_since_build > MAX_REFITS_BEFORE_REBUILD) {
+        rebuild_bvh();
+        local.builds++;
+      } else {
+        refit_triangles(changed);
+        update_converted_bvh();
+        local.refits++;
+      }
+    }
+  }
+
+  dirty_boxes.clear();
+  dirty_spheres.clear();
   build_dirty = false;
+
+  // 内容が変わっていれば、変わった範囲を記録する
+  const uint64_t previous = scene_hash;
+  scene_hash              = hash_content();
+  if(scene_hash != previous) {
+    pending_change.from_hash = previous;
+    pending_change.to_hash   = scene_hash;
+    change_log.push_back(pending_change);
+    if(change_log.size() > MAX_CHANGE_LOG) change_log.erase(change_log.begin());
+  }
+  pending_change = {};
+
+  timer.lap(&QueryStats::build_seconds);
+  local.total_seconds = local.tessellation_seconds + local.build_seconds;
+  record_stats(local, stats);
+}
+
+void SceneRaycaster::note_change(const Vec3& lo, const Vec3& hi) {
+  for(int k = 0; k < 3; k++) {
+    pending_change.lo[k] = std::min(pending_change.lo[k], lo[k]);
+    pending_change.hi[k] = std::max(pending_change.hi[k], hi[k]);
+  }
+}
+
+uint64_t SceneRaycaster::hash_user_mesh() const {
+  // 通常モードとコンパクトモードで同じ値になるよう、三角形ごとに単精度の頂点を混ぜる
+  uint64_t h = hash_mix(0, user_triangle_count);
+  for(size_t i = 0; i < user_triangle_count; i++) {
+    for(int k = 0; k < 3; k++) {
+      const auto& v      = triangle_vertex(i, k);
+      const float xyz[3] = {v.x, v.y, v.z};
+      h                  = hash_values(h, xyz, 3);
+    }
+  }
+  return h;
+}
+
+uint64_t SceneRaycaster::hash_content() const {
+  // ボックス・球を解析的に扱うかどうかで交差判定の結果が変わる
+  uint64_t h = hash_mix(mesh_hash, build_options.analytic_primitives ? 1 : 0);
+  h          = hash_mix(h, boxes.size());
+  for(const auto& b : boxes) {
+    h = hash_values(h, b.center.data(), 3);
+    h = hash_values(h, b.size.data(), 3);
+    h = hash_values(h, b.euler.data(), 3);
+    h = hash_mix(h, b.removed ? 1 : 0);
+  }
+  h = hash_mix(h, spheres.size());
+  for(const auto& sp : spheres) {
+    h = hash_values(h, sp.center.data(), 3);
+    h = hash_values(h, &sp.radius, 1);
+    h = hash_mix(h, sp.removed ? 1 : 0);
+  }
+  return h;
+}
+
+bool SceneRaycaster::changed_bounds(uint64_t from, Vec3& lo, Vec3& hi) const {
+  lo = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+  hi = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+  // 新しい変更から from まで遡り、変わった範囲を合わせる
+  uint64_t hash = scene_hash;
+  for(auto it = change_log.rbegin(); hash != from; ++it) {
+    if(it == change_log.rend() || it->to_hash != hash || it->full) return false;
+    for(int k = 0; k < 3; k++) {
+      lo[k] = std::min(lo[k], it->lo[k]);
+      hi[k] = std::max(hi[k], it->hi[k]);
+    }
+    hash = it->from_hash;
+  }
+  return true;
+}
+
+void SceneRaycaster::set_compact_storage(bool enable) {
+  if(compact == enable) return;
+  if(host_released) throw std::logic_error("Host geometry has been released; storage mode cannot be changed.");
+  compact     = enable;
+  build_dirty = true;
+}
+
+void SceneRaycaster::release_host_geometry() {
+  if(!compact) throw std::logic_error("release_host_geometry requires compact storage.");
+  build();
+  vertices.clear();
+  vertices.shrink_to_fit();
+  indices.clear();
+  indices.shrink_to_fit();
+  host_released = true;
+}
+
+size_t SceneRaycaster::memory_usage() const {
+  size_t bytes = vertices.capacity() * sizeof(Vec3) + indices.capacity() * sizeof(Vec3i);
+  bytes += primitive_vertices.capacity() * sizeof(Vec3) + primitive_indices.capacity() * sizeof(Vec3i);
+  bytes += triangles.capacity() * sizeof(tinybvh::bvhvec4) + triangle_indices.capacity() * sizeof(uint32_t);
+  if(bvh) bytes += bvh->allocatedNodes * sizeof(tinybvh::BVH::BVHNode) + bvh->idxCount * sizeof(uint32_t);
+  if(analytic_bvh) bytes += analytic_bvh->shapes.capacity() * sizeof(AnalyticShape) + analytic_bvh->bvh.allocatedNodes * sizeof(tinybvh::BVH::BVHNode) + analytic_bvh->bvh.idxCount * sizeof(uint32_t);
+  return bytes;
+}
+
+uint64_t SceneRaycaster::trace(tinybvh::Ray* rays, size_t count) const {
+  // 向きがばらばらのレイはパケットの視錐台に収まらないので1本ずつ走査する
+  uint64_t nodes = 0;
+  for(size_t i = 0; i < count; i++) nodes += intersect(rays[i]);
+  return nodes;
+}
+
+int SceneRaycaster::usable_packet_orientation(const DirectionSet& directions) const {
+  // tiny_bvh の Intersect256Rays は2分木（インデックスなし）にしかないので、他のレイアウトとコンパクトモードでは1本ずつ走査する
+  if(directions.packets.empty() || !bvh || active_layout != BvhLayout::Standard || compact) return -1;
+  return packet_orientation();
+}
+
+uint64_t SceneRaycaster::trace_packets(const DirectionSet& directions, tinybvh::Ray* rays, QueryContext& context, QueryStats* stats) const {
+  const int orientation = usable_packet_orientation(directions);
+  if(orientation < 0) return trace(rays, directions.size());
+
+  const auto& plan = directions.packets;
+  const tinybvh::bvhvec3 origin = rays[0].O;
+  tinybvh::Ray* packet          = reserve_rays(context.packet, PACKET_RAYS, stats);
+  for(size_t k = 0; k < plan.size(); k++) {
+    const uint32_t* slots = &plan.slots[k * PACKET_RAYS];
+    const float* guards   = &plan.guards[k * 12];
+    for(size_t i = 0; i < PACKET_RAYS; i++) packet[i] = rays[slots[i]];
+    set_packet_guards(packet, origin, guards, orientation);
+    bvh->Intersect256Rays(packet);
+    for(size_t i = 0; i < PACKET_RAYS; i++) {
+      if(!is_packet_corner(i)) rays[slots[i]].hit = packet[i].hit;
+    }
+  }
+  // Intersect256Rays は訪れたノード数を返さないので、1本ずつ走査した分だけ数える
+  uint64_t nodes = 0;
+  for(uint32_t i : plan.scalar) nodes += intersect_triangles(rays[i]);
+  if(analytic_bvh) {
+    // パケットは三角形のBVHだけを走査するので、ボックス・球は全てのレイで1本ずつ判定する
+    for(size_t i = 0; i < directions.size(); i++) nodes += intersect_analytic(rays[i]);
+  }
+  return nodes;
+}
+
+void SceneRaycaster::occlude_packets(const tinybvh::bvhvec3& origin, const DirectionSet& directions, int orientation, uint64_t* mask, QueryContext& context, QueryStats* stats) const {
+  const auto& plan     = directions.packets;
+  tinybvh::Ray* packet = reserve_rays(context.packet, PACKET_RAYS, stats);
+  auto ray             = [&](size_t i) { return tinybvh::Ray(origin, tinybvh::bvhvec3(directions.x[i], directions.y[i], directions.z[i])); };
+  for(size_t k = 0; k < plan.size(); k++) {
+    const uint32_t* slots = &plan.slots[k * PACKET_RAYS];
+    for(size_t i = 0; i < PACKET_RAYS; i++) {
+      if(!is_packet_corner(i)) packet[i] = ray(slots[i]);
+    }
+    set_packet_guards(packet, origin, &plan.guards[k * 12], orientation);
+    // tiny_bvh にはパケットの遮蔽判定がないので、最近接ヒットが見つかったレイを遮られたとする
+    bvh->Intersect256Rays(packet);
+    for(size_t i = 0; i < PACKET_RAYS; i++) {
+      if(!is_packet_corner(i) && packet[i].hit.t < BVH_FAR) mask[slots[i] >> 6] |= uint64_t{1} << (slots[i] & 63);
+    }
+  }
+  for(uint32_t i : plan.scalar) {
+    if(test_triangle_occlusion(ray(i))) mask[i >> 6] |= uint64_t{1} << (i & 63);
+  }
+  if(!analytic_bvh) return;
+  // ボックス・球は三角形で遮られなかったレイだけを1本ずつ判定する
+  for(size_t i = 0; i < directions.size(); i++) {
+    if(!((mask[i >> 6] >> (i & 63)) & 1u) && test_analytic_occlusion(ray(i))) mask[i >> 6] |= uint64_t{1} << (i & 63);
+  }
 }
 
 std::vector<HitResult> SceneRaycaster::raycast(const std::vector<Vec3>& origins, const std::vector<Vec3>& directions) const {
   std::vector<HitResult> results(origins.size());
+  QueryContext context;
+  raycast(origins, directions, results.data(), context);
+  if(stats_sink) {
+    QueryStats local;
+    local.allocations = 1; // results
+    record_stats(local, nullptr);
+  }
+  return results;
+}
 
-  if(!bvh || origins.empty()) {
-    printf("BVH = %p, num rays = %zu\n", (void*)bvh, origins.size());
+void SceneRaycaster::raycast(const std::vector<Vec3>& origins, const std::vector<Vec3>& directions, HitResult* results, QueryContext& context) const {
+  if(origins.size() != directions.size()) {
+    throw std::invalid_argument("origins and directions must have the same length");
+  }
+  if(!has_bvh() || origins.empty()) {
     throw std::runtime_error("BVH is not built or no rays to cast.");
-    return results;
   }
 
-  std::vector<tinybvh::Ray> rays(origins.size());
+  QueryStats local;
+  StageTimer timer(stats_sink ? &local : nullptr);
+  tinybvh::Ray* rays = reserve_rays(context.rays, origins.size(), stats_sink ? &local : nullptr);
   for(size_t i = 0; i < origins.size(); i++) {
     rays[i] = tinybvh::Ray(                                                                       //
       tinybvh::bvhvec3((float)origins[i][0], (float)origins[i][1], (float)origins[i][2]),         //
       tinybvh::bvhvec3((float)directions[i][0], (float)directions[i][1], (float)directions[i][2]) //
     );
-    // rays[i].hit.inst = std::numeric_limits<uint32_t>::max();
-    // rays[i].hit.prim = std::numeric_limits<uint32_t>::max();
-    // rays[i].hit.t    = 1e30f; // 初期化
-  }
-#if 1
-  // 256レイずつバッチ処理
-  const size_t batch_size  = 256;
-  const size_t num_batches = (rays.size() + batch_size - 1) / batch_size;
-
-  for(size_t batch = 0; batch < num_batches; batch++) {
-    size_t start = batch * batch_size;
-    size_t end   = std::min(start + batch_size, rays.size());
-    size_t count = end - start;
-
-    if(count == batch_size) {
-      // フルバッチの場合は最適化版を使用
-      bvh->Intersect256Rays(&rays[start]);
-    } else {
-      // 部分バッチの場合は個別に処理
-      for(size_t i = start; i < end; i++) {
-        bvh->Intersect(rays[i]);
-      }
-    }
   }
+  timer.lap(&QueryStats::setup_seconds);
+  local.scalar_nodes_visited = trace(rays, origins.size());
+  timer.lap(&QueryStats::traversal_seconds);
 
   // 結果を変換
-  for(size_t i = 0; i < rays.size(); i++) {
+  for(size_t i = 0; i < origins.size(); i++) {
     if(rays[i].hit.t < 1e30f) {
+      local.hits++;
       results[i].hit         = true;
       results[i].distance    = rays[i].hit.t;
       results[i].position[0] = origins[i][0] + directions[i][0] * rays[i].hit.t;
@@ -209,16 +1601,382 @@ std::vector<HitResult> SceneRaycaster::raycast(const std::vector<Vec3>& origins,
     } else {
       results[i].hit      = false;
       results[i].distance = std::numeric_limits<double>::infinity();
+      results[i].position = {0.0, 0.0, 0.0};
     }
   }
-#else
-  for(size_t i = 0; i < rays.size(); i++) results[i].hit = bvh->IsOccluded(rays[i]);
-#endif
+  timer.lap(&QueryStats::conversion_seconds);
 
-  return results;
+  local.rays          = origins.size();
+  local.total_seconds = local.setup_seconds + local.traversal_seconds + local.conversion_seconds;
+  record_stats(local, nullptr);
+}
+
+void SceneRaycaster::raycast(const Vec3& origin, const DirectionSet& directions, std::vector<HitResult>& results, QueryStats* stats) const {
+  const size_t capacity = results.capacity();
+  results.resize(directions.size());
+  QueryContext context;
+  raycast(origin, directions, results.data(), context, stats);
+  if(stats || stats_sink) {
+    QueryStats local;
+    local.allocations = results.capacity() != capacity ? 1 : 0; // results の拡張
+    record_stats(local, stats);
+  }
+}
+
+void SceneRaycaster::raycast(const Vec3& origin, const DirectionSet& directions, HitResult* results, QueryContext& context, QueryStats* stats) const {
+  if(!has_bvh() || directions.size() == 0) {
+    throw std::runtime_error("BVH is not built or no rays to cast.");
+  }
+
+  QueryStats local;
+  const bool measure = stats || stats_sink;
+  StageTimer timer(measure ? &local : nullptr);
+
+  // 原点は全レイで共通なので一度だけ変換する
+  const tinybvh::bvhvec3 o((float)origin[0], (float)origin[1], (float)origin[2]);
+  tinybvh::Ray* rays = reserve_rays(context.rays, directions.size(), &local);
+  for(size_t i = 0; i < directions.size(); i++) rays[i] = tinybvh::Ray(o, tinybvh::bvhvec3(directions.x[i], directions.y[i], directions.z[i]));
+  timer.lap(&QueryStats::setup_seconds);
+
+  local.scalar_nodes_visited = trace_packets(directions, rays, context, &local);
+  timer.lap(&QueryStats::traversal_seconds);
+
+  for(size_t i = 0; i < directions.size(); i++) {
+    const float t = rays[i].hit.t;
+    if(t < 1e30f) {
+      local.hits++;
+      results[i].hit      = true;
+      results[i].distance = t;
+      results[i].position = {origin[0] + directions.x[i] * t, origin[1] + directions.y[i] * t, origin[2] + directions.z[i] * t};
+    } else {
+      results[i].hit      = false;
+      results[i].distance = std::numeric_limits<double>::infinity();
+      results[i].position = {0.0, 0.0, 0.0};
+    }
+  }
+  timer.lap(&QueryStats::conversion_seconds);
+
+  if(!measure) return;
+  local.rays          = directions.size();
+  local.total_seconds = local.setup_seconds + local.traversal_seconds + local.conversion_seconds;
+  record_stats(local, stats);
+}
+
+bool SceneRaycaster::is_occluded(const Vec3& origin, const Vec3& direction) const {
+  if(!has_bvh()) throw std::runtime_error("BVH is not built.");
+  const tinybvh::Ray ray(tinybvh::bvhvec3((float)origin[0], (float)origin[1], (float)origin[2]), tinybvh::bvhvec3((float)direction[0], (float)direction[1], (float)direction[2]));
+  return test_occlusion(ray);
+}
+
+OcclusionMask SceneRaycaster::occluded(const std::vector<Vec3>& origins, const std::vector<Vec3>& directions) const {
+  if(origins.size() != directions.size()) {
+    throw std::invalid_argument("origins and directions must have the same length");
+  }
+
+  OcclusionMask mask((origins.size() + 63) / 64, 0);
+  occluded(origins.empty() ? nullptr : origins[0].data(), directions.empty() ? nullptr : directions[0].data(), origins.size(), mask.data());
+  if(stats_sink) {
+    QueryStats local;
+    local.allocations = 1; // mask
+    record_stats(local, nullptr);
+  }
+  return mask;
+}
+
+template <typename T> void SceneRaycaster::occluded(const T* origins, const T* directions, size_t count, uint64_t* mask) const {
+  if(!has_bvh() || count == 0) {
+    throw std::runtime_error("BVH is not built or no rays to cast.");
+  }
+
+  QueryStats local;
+  StageTimer timer(stats_sink ? &local : nullptr);
+  std::fill(mask, mask + (count + 63) / 64, uint64_t{0});
+  for(size_t i = 0; i < count; i++) {
+    const T* o = origins + i * 3;
+    const T* d = directions + i * 3;
+    const tinybvh::Ray ray(tinybvh::bvhvec3((float)o[0], (float)o[1], (float)o[2]), tinybvh::bvhvec3((float)d[0], (float)d[1], (float)d[2]));
+    if(test_occlusion(ray)) mask[i >> 6] |= uint64_t{1} << (i & 63);
+  }
+  if(!stats_sink) return;
+  // レイの生成と走査は1本ずつ交互に行うので、まとめて走査の時間とする
+  timer.lap(&QueryStats::traversal_seconds);
+  local.rays = count;
+  for(size_t w = 0; w < (count + 63) / 64; w++) local.hits += std::bitset<64>(mask[w]).count();
+  local.total_seconds = local.traversal_seconds;
+  record_stats(local, nullptr);
+}
+
+template <typename T> void SceneRaycaster::raycast(const T* origins, const T* directions, size_t count, bool* hit, double* position, double* distance, QueryContext* context) const {
+  if(!has_bvh() || count == 0) {
+    throw std::runtime_error("BVH is not built or no rays to cast.");
+  }
+
+  QueryStats local;
+  StageTimer timer(stats_sink ? &local : nullptr);
+  QueryContext local_context; // context が渡されなければこの呼び出しだけで使う
+  tinybvh::Ray* rays = reserve_rays((context ? *context : local_context).rays, count, stats_sink ? &local : nullptr);
+  for(size_t i = 0; i < count; i++) {
+    const T* o = origins + i * 3;
+    const T* d = directions + i * 3;
+    rays[i]    = tinybvh::Ray(tinybvh::bvhvec3((float)o[0], (float)o[1], (float)o[2]), tinybvh::bvhvec3((float)d[0], (float)d[1], (float)d[2]));
+  }
+  timer.lap(&QueryStats::setup_seconds);
+  local.scalar_nodes_visited = trace(rays, count);
+  timer.lap(&QueryStats::traversal_seconds);
+
+  for(size_t i = 0; i < count; i++) {
+    const float t = rays[i].hit.t;
+    hit[i]        = t < 1e30f;
+    distance[i]   = hit[i] ? t : std::numeric_limits<double>::infinity();
+    for(int k = 0; k < 3; k++) position[i * 3 + k] = hit[i] ? (double)origins[i * 3 + k] + (double)directions[i * 3 + k] * t : 0.0;
+  }
+  if(!stats_sink) return;
+  timer.lap(&QueryStats::conversion_seconds);
+  local.rays = count;
+  for(size_t i = 0; i < count; i++) local.hits += hit[i] ? 1 : 0;
+  local.total_seconds = local.setup_seconds + local.traversal_seconds + local.conversion_seconds;
+  record_stats(local, nullptr);
+}
+
+// NumPy配列（float32 / float64）用の明示的インスタンス化
+template void SceneRaycaster::add_mesh<float>(const float*, size_t);
+template void SceneRaycaster::add_mesh<double>(const double*, size_t);
+template void SceneRaycaster::raycast<float>(const float*, const float*, size_t, bool*, double*, double*, QueryContext*) const;
+template void SceneRaycaster::raycast<double>(const double*, const double*, size_t, bool*, double*, double*, QueryContext*) const;
+template void SceneRaycaster::occluded<float>(const float*, const float*, size_t, uint64_t*) const;
+template void SceneRaycaster::occluded<double>(const double*, const double*, size_t, uint64_t*) const;
+
+void SceneRaycaster::occluded(const Vec3& origin, const DirectionSet& directions, OcclusionMask& mask, QueryStats* stats) const { occlusion_query(origin, directions, mask, nullptr, stats); }
+
+void SceneRaycaster::occluded_packets(const Vec3& origin, const DirectionSet& directions, OcclusionMask& mask, QueryContext& context, QueryStats* stats) const { occlusion_query(origin, directions, mask, &context, stats); }
+
+void SceneRaycaster::occlusion_query(const Vec3& origin, const DirectionSet& directions, OcclusionMask& mask, QueryContext* context, QueryStats* stats) const {
+  if(!has_bvh() || directions.size() == 0) {
+    throw std::runtime_error("BVH is not built or no rays to cast.");
+  }
+
+  QueryStats local;
+  const bool measure = stats || stats_sink;
+  StageTimer timer(measure ? &local : nullptr);
+  const tinybvh::bvhvec3 o((float)origin[0], (float)origin[1], (float)origin[2]);
+  const size_t capacity = mask.capacity();
+  mask.assign((directions.size() + 63) / 64, 0);
+  const int orientation = context ? usable_packet_orientation(directions) : -1;
+  if(orientation >= 0) {
+    occlude_packets(o, directions, orientation, mask.data(), *context, &local);
+  } else {
+    for(size_t w = 0; w < mask.size(); w++) {
+      // 64本分をまとめてからワードに書き込む
+      uint64_t bits    = 0;
+      const size_t end = std::min(directions.size(), (w + 1) * 64);
+      for(size_t i = w * 64; i < end; i++) {
+        const tinybvh::Ray ray(o, tinybvh::bvhvec3(directions.x[i], directions.y[i], directions.z[i]));
+        if(test_occlusion(ray)) bits |= uint64_t{1} << (i & 63);
+      }
+      mask[w] = bits;
+    }
+  }
+
+  if(!measure) return;
+  timer.lap(&QueryStats::traversal_seconds);
+  local.rays = directions.size();
+  for(uint64_t bits : mask) local.hits += std::bitset<64>(bits).count();
+  local.allocations  += mask.capacity() != capacity ? 1 : 0;
+  local.total_seconds = local.traversal_seconds;
+  record_stats(local, stats);
+}
+
+void SceneRaycaster::occluded(const Vec3& origin, const DirectionSet& directions, const std::vector<uint32_t>& indices, OcclusionMask& mask, QueryContext& context, QueryStats* stats) const {
+  if(!has_bvh() || indices.empty()) {
+    throw std::runtime_error("BVH is not built or no rays to cast.");
+  }
+
+  QueryStats local;
+  const bool measure = stats || stats_sink;
+  StageTimer timer(measure ? &local : nullptr);
+  const tinybvh::bvhvec3 o((float)origin[0], (float)origin[1], (float)origin[2]);
+  const size_t count = indices.size();
+  tinybvh::Ray* rays = reserve_rays(context.rays, count, measure ? &local : nullptr);
+  for(size_t k = 0; k < count; k++) {
+    const uint32_t i = indices[k];
+    if(i >= directions.size()) throw std::invalid_argument("Direction index is out of range");
+    rays[k] = tinybvh::Ray(o, tinybvh::bvhvec3(directions.x[i], directions.y[i], directions.z[i]));
+  }
+  timer.lap(&QueryStats::setup_seconds);
+
+  const size_t capacity = mask.capacity();
+  mask.assign((count + 63) / 64, 0);
+  for(size_t k = 0; k < count; k++) {
+    if(test_occlusion(rays[k])) mask[k >> 6] |= uint64_t{1} << (k & 63);
+  }
+
+  if(!measure) return;
+  timer.lap(&QueryStats::traversal_seconds);
+  local.rays = count;
+  for(uint64_t bits : mask) local.hits += std::bitset<64>(bits).count();
+  local.allocations  += mask.capacity() != capacity ? 1 : 0;
+  local.total_seconds = local.setup_seconds + local.traversal_seconds;
+  record_stats(local, stats);
+}
+
+void SceneRaycaster::accumulate_occlusion(const Vec3& origin, const DirectionSet& directions, OcclusionMask& mask, QueryStats* stats) const {
+  if(!has_bvh()) throw std::runtime_error("BVH is not built.");
+  if(mask.size() < (directions.size() + 63) / 64) throw std::invalid_argument("Occlusion mask is smaller than the direction set");
+
+  QueryStats local;
+  const bool measure = stats || stats_sink;
+  StageTimer timer(measure ? &local : nullptr);
+  const tinybvh::bvhvec3 o((float)origin[0], (float)origin[1], (float)origin[2]);
+  for(size_t w = 0; w < (directions.size() + 63) / 64; w++) {
+    // すでに遮られているレイは飛ばさない
+    uint64_t bits    = mask[w];
+    const size_t end = std::min(directions.size(), (w + 1) * 64);
+    for(size_t i = w * 64; i < end; i++) {
+      if((bits >> (i & 63)) & 1u) continue;
+      const tinybvh::Ray ray(o, tinybvh::bvhvec3(directions.x[i], directions.y[i], directions.z[i]));
+      local.rays++;
+      if(test_occlusion(ray)) {
+        bits |= uint64_t{1} << (i & 63);
+        local.hits++;
+      }
+    }
+    mask[w] = bits;
+  }
+
+  if(!measure) return;
+  timer.lap(&QueryStats::traversal_seconds);
+  local.total_seconds = local.traversal_seconds;
+  record_stats(local, stats);
+}
+
+void SceneRaycaster::project_horizon(const Vec3& origin, int azimuth_steps, double min_tan, double* tan_elevation, QueryContext& context, QueryStats* stats) const {
+  if(!has_bvh()) throw std::runtime_error("BVH is not built.");
+  if(azimuth_steps <= 0) throw std::invalid_argument("azimuth_steps must be positive");
+
+  QueryStats local;
+  const bool measure = stats || stats_sink;
+  StageTimer timer(measure ? &local : nullptr);
+  const size_t count = static_cast<size_t>(azimuth_steps) * 2;
+  if(context.azimuths.size() != count) {
+    if(context.azimuths.capacity() < count) local.allocations++;
+    context.azimuths.resize(count);
+    for(int p = 0; p < azimuth_steps; p++) {
+      const double phi            = 2.0 * M_PI * p / azimuth_steps;
+      context.azimuths[p * 2]     = std::cos(phi);
+      context.azimuths[p * 2 + 1] = std::sin(phi);
+    }
+  }
+  std::fill(tan_elevation, tan_elevation + azimuth_steps, min_tan);
+
+  HorizonProjector projector(origin, azimuth_steps, context.azimuths.data(), tan_elevation);
+  if(bvh) projector.traverse(*bvh, [&](uint32_t tri) { projector.project_triangle(triangle_vertex(tri, 0), triangle_vertex(tri, 1), triangle_vertex(tri, 2)); });
+  if(analytic_bvh) {
+    projector.traverse(analytic_bvh->bvh, [&](uint32_t i) {
+      const AnalyticShape& shape = analytic_bvh->shapes[i];
+      if(shape.removed) return;
+      if(shape.sphere) {
+        projector.project_sphere(shape);
+      } else {
+        projector.project_box(shape);
+      }
+    });
+  }
+
+  if(!measure) return;
+  timer.lap(&QueryStats::traversal_seconds);
+  local.scalar_nodes_visited = projector.nodes;
+  local.projected            = projector.projected;
+  local.total_seconds        = local.traversal_seconds;
+  record_stats(local, stats);
+}
+
+SceneRaycaster SceneRaycaster::extract_region(const Vec3& region_min, const Vec3& region_max, const CullOptions& options) const {
+  if(needs_build()) throw std::logic_error("Scene must be built before extracting a region");
+
+  // レイの方向は単精度なので、仰角の下限には少し余裕を持たせる
+  const double slope     = std::tan(std::max(options.min_elevation_deg - 0.01, 0.0) * M_PI / 180.0);
+  const double min_ratio = options.min_angular_size_deg > 0.0 ? std::tan(options.min_angular_size_deg * M_PI / 180.0) : 0.0;
+
+  std::vector<Vec3> kept;
+  // 小さな三角形をまとめる箱（大きさの段階と位置のセルごとの外接箱）
+  std::map<std::array<int64_t, 4>, std::pair<Vec3, Vec3>> merged;
+  // AABBが [lo, hi] の形状をそのまま残すか（まとめる場合は merged に足して false を返す）
+  auto keep = [&](const Vec3& lo, const Vec3& hi) {
+    // 2つの箱の間の各軸の距離
+    Vec3 gap;
+    for(int k = 0; k < 3; k++) gap[k] = std::max({lo[k] - region_max[k], region_min[k] - hi[k], 0.0});
+
+    // 領域の最も低い点から見て、最も近い位置でも仰角の下限に届かなければ当たらない
+    const double rise = hi[2] - region_min[2];
+    if(rise < 0.0 || rise < slope * std::hypot(gap[0], gap[1])) return false;
+
+    if(min_ratio > 0.0) {
+      const double distance = std::sqrt(gap[0] * gap[0] + gap[1] * gap[1] + gap[2] * gap[2]);
+      const double extent   = std::sqrt((hi[0] - lo[0]) * (hi[0] - lo[0]) + (hi[1] - lo[1]) * (hi[1] - lo[1]) + (hi[2] - lo[2]) * (hi[2] - lo[2]));
+      if(extent < min_ratio * distance) {
+        if(!options.merge_small) return false;
+        // 距離に応じた2の累乗の大きさのセルでまとめる（1つの箱の見かけの大きさが下限程度になる）
+        const int level = static_cast<int>(std::floor(std::log2(min_ratio * distance)));
+        const double cell = std::ldexp(1.0, level);
+        const std::array<int64_t, 4> key = {level, static_cast<int64_t>(std::floor((lo[0] + hi[0]) * 0.5 / cell)), static_cast<int64_t>(std::floor((lo[1] + hi[1]) * 0.5 / cell)),
+                                            static_cast<int64_t>(std::floor((lo[2] + hi[2]) * 0.5 / cell))};
+        auto it = merged.find(key);
+        if(it == merged.end()) {
+          merged.emplace(key, std::make_pair(lo, hi));
+        } else {
+          for(int k = 0; k < 3; k++) {
+            it->second.first[k]  = std::min(it->second.first[k], lo[k]);
+            it->second.second[k] = std::max(it->second.second[k], hi[k]);
+          }
+        }
+        return false;
+      }
+    }
+    return true;
+  };
+
+  for(size_t i = 0; i < triangle_count(); i++) {
+    const auto& a = triangle_vertex(i, 0);
+    const auto& b = triangle_vertex(i, 1);
+    const auto& c = triangle_vertex(i, 2);
+    // 削除されたボックス・球の三角形は1点に潰れている
+    if(a.x == b.x && a.x == c.x && a.y == b.y && a.y == c.y && a.z == b.z && a.z == c.z) continue;
+
+    const Vec3 lo = {std::min({a.x, b.x, c.x}), std::min({a.y, b.y, c.y}), std::min({a.z, b.z, c.z})};
+    const Vec3 hi = {std::max({a.x, b.x, c.x}), std::max({a.y, b.y, c.y}), std::max({a.z, b.z, c.z})};
+    if(!keep(lo, hi)) continue;
+    kept.push_back({a.x, a.y, a.z});
+    kept.push_back({b.x, b.y, b.z});
+    kept.push_back({c.x, c.y, c.z});
+  }
+
+  SceneRaycaster region;
+  region.set_build_options(build_options);
+  region.add_mesh(kept);
+  if(analytic_bvh) {
+    // 解析的なボックス・球は外接するAABBで判定し、残すものは元の形のまま移す
+    for(size_t i = 0; i < analytic_bvh->shapes.size(); i++) {
+      const AnalyticShape& shape = analytic_bvh->shapes[i];
+      if(shape.removed || !keep({shape.lo.x, shape.lo.y, shape.lo.z}, {shape.hi.x, shape.hi.y, shape.hi.z})) continue;
+      if(i < boxes.size()) {
+        region.add_box(boxes[i].center, boxes[i].size, boxes[i].euler);
+      } else {
+        region.add_sphere(spheres[i - boxes.size()].center, spheres[i - boxes.size()].radius);
+      }
+    }
+  }
+  for(const auto& box : merged) {
+    const Vec3& lo = box.second.first;
+    const Vec3& hi = box.second.second;
+    region.add_box({(lo[0] + hi[0]) * 0.5, (lo[1] + hi[1]) * 0.5, (lo[2] + hi[2]) * 0.5}, {hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]}, {0.0, 0.0, 0.0});
+  }
+  return region;
 }
 
 void SceneRaycaster::save(const char* filepath) {
+  // ボックス・球のテッセレーション結果も書き出すため先にビルドする
+  build();
+
   std::ofstream file(filepath, std::ios::binary);
   if(!file) {
     throw std::runtime_error(std::string("Failed to open file for writing: ") + filepath);
@@ -228,52 +1986,217 @@ void SceneRaycaster::save(const char* filepath) {
   char header[80] = {0};
   file.write(header, 80);
 
+  // 解析的に扱うボックス・球はBVH用のバッファにないので、書き出し用にテッセレーションする
+  std::vector<Vec3> shape_vertices;
+  std::vector<Vec3i> shape_indices;
+  if(analytic_bvh) {
+    for(const auto& box : boxes) {
+      if(box.removed) continue;
+      const int base = static_cast<int>(shape_vertices.size());
+      shape_vertices.resize(base + BOX_VERTICES);
+      generate_box_corners(box, &shape_vertices[base]);
+      for(const auto& f : BOX_FACES) shape_indices.push_back(Vec3i{base + f[0], base + f[1], base + f[2]});
+    }
+    for(const auto& sphere : spheres) {
+      if(sphere.removed) continue;
+      const int base = static_cast<int>(shape_vertices.size());
+      shape_vertices.resize(base + SPHERE_VERTICES);
+      generate_uv_sphere(sphere.center, sphere.radius, &shape_vertices[base]);
+      shape_indices.resize(shape_indices.size() + SPHERE_TRIANGLES);
+      generate_uv_sphere_indices(base, &shape_indices[shape_indices.size() - SPHERE_TRIANGLES]);
+    }
+  }
+
   // Number of triangles (4 bytes)
-  uint32_t num_triangles = static_cast<uint32_t>(indices.size());
+  uint32_t num_triangles = static_cast<uint32_t>(triangle_count() + shape_indices.size());
   file.write(reinterpret_cast<const char*>(&num_triangles), sizeof(uint32_t));
 
-  // Write each triangle
-  for(const auto& idx : indices) {
-    // Validate indices
-    if(idx[0] >= static_cast<int>(vertices.size()) || idx[1] >= static_cast<int>(vertices.size()) || idx[2] >= static_cast<int>(vertices.size())) {
-      throw std::runtime_error("Invalid vertex index in triangle");
-    }
+  // Encode each triangle from the BVH buffers (user meshes, then tessellated boxes and spheres) and write them at once
+  // コンパクトモードで vertices を解放した後でも書き出せる
+  std::vector<char> facets(num_triangles * STL_FACET_BYTES);
+  auto to_vec3 = [](const tinybvh::bvhvec4& v) { return Vec3{v.x, v.y, v.z}; };
+  char* out    = facets.data();
+  for(size_t i = 0; i < triangle_count(); i++) {
+    out = encode_stl_triangle(out, to_vec3(triangle_vertex(i, 0)), to_vec3(triangle_vertex(i, 1)), to_vec3(triangle_vertex(i, 2)));
+  }
+  for(const auto& tri : shape_indices) out = encode_stl_triangle(out, shape_vertices[tri[0]], shape_vertices[tri[1]], shape_vertices[tri[2]]);
+  file.write(facets.data(), facets.size());
 
-    // Calculate normal vector (cross product)
-    const Vec3& v0 = vertices[idx[0]];
-    const Vec3& v1 = vertices[idx[1]];
-    const Vec3& v2 = vertices[idx[2]];
+  file.close();
+}
 
-    Vec3 edge1 = {v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2]};
-    Vec3 edge2 = {v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2]};
-    Vec3 normal = {edge1[1] * edge2[2] - edge1[2] * edge2[1], edge1[2] * edge2[0] - edge1[0] * edge2[2], edge1[0] * edge2[1] - edge1[1] * edge2[0]};
+void SceneRaycaster::save_scene(const char* filepath) {
+  // 保留中の変更を反映してから、BVHを含めて書き出す
+  build();
 
-    // Normalize
-    double len = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
-    if(len > 0.0) {
-      normal[0] /= len;
-      normal[1] /= len;
-      normal[2] /= len;
-    } else {
-      // Degenerate triangle: use default normal
-      normal = {0.0, 0.0, 1.0};
-    }
+  // 一時ファイルに書き出してから置き換える（load_scene でマップ中のファイルを切り詰めず、途中まで書いたファイルを他のプロセスに読ませない）
+  const std::string temp = unique_temp_path(filepath);
+  std::ofstream file(temp, std::ios::binary);
+  if(!file) {
+    throw std::runtime_error("Failed to open file for writing: " + temp);
+  }
 
-    // Write normal
-    float normal_f[3] = {static_cast<float>(normal[0]), static_cast<float>(normal[1]), static_cast<float>(normal[2])};
-    file.write(reinterpret_cast<const char*>(normal_f), 3 * sizeof(float));
+  SceneHeader header{};
+  std::memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+  header.version             = SCENE_VERSION;
+  header.flags               = (compact ? SCENE_COMPACT : 0u) | (host_released ? SCENE_HOST_RELEASED : 0u);
+  header.node_size           = sizeof(tinybvh::BVH::BVHNode);
+  header.build_options       = static_cast<uint32_t>(build_options.builder) | static_cast<uint32_t>(build_options.layout) << 8 | (build_options.optimize ? 1u : 0u) << 16 | (build_options.analytic_primitives ? 1u : 0u) << 24;
+  header.user_vertex_count   = user_vertex_count;
+  header.user_triangle_count = user_triangle_count;
+  header.vertex_count        = vertices.size();
+  header.index_count         = indices.size();
+  header.box_count           = boxes.size();
+  header.sphere_count        = spheres.size();
+  header.bvh_vertex_count    = triangles.size();
+  header.bvh_index_count     = triangle_indices.size();
+  header.node_count          = bvh ? bvh->usedNodes : 0;
+  header.prim_index_count    = bvh ? bvh->idxCount : 0;
+  header.refits_since_build  = refits_since_build;
 
-    // Write vertices
-    for(int i = 0; i < 3; i++) {
-      const Vec3& v = vertices[idx[i]];
-      float v_f[3]  = {static_cast<float>(v[0]), static_cast<float>(v[1]), static_cast<float>(v[2])};
-      file.write(reinterpret_cast<const char*>(v_f), 3 * sizeof(float));
-    }
+  std::vector<double> box_records;
+  box_records.reserve(boxes.size() * BOX_RECORD);
+  for(const auto& b : boxes) {
+    box_records.insert(box_records.end(), b.center.begin(), b.center.end());
+    box_records.insert(box_records.end(), b.size.begin(), b.size.end());
+    box_records.insert(box_records.end(), b.euler.begin(), b.euler.end());
+    box_records.push_back(b.removed ? 1.0 : 0.0);
+  }
+  std::vector<double> sphere_records;
+  sphere_records.reserve(spheres.size() * SPHERE_RECORD);
+  for(const auto& sp : spheres) {
+    sphere_records.insert(sphere_records.end(), sp.center.begin(), sp.center.end());
+    sphere_records.push_back(sp.radius);
+    sphere_records.push_back(sp.removed ? 1.0 : 0.0);
+  }
 
-    // Attribute byte count (2 bytes, typically 0)
-    uint16_t attribute_count = 0;
-    file.write(reinterpret_cast<const char*>(&attribute_count), sizeof(uint16_t));
+  size_t offset = 0;
+  write_section(file, offset, &header, sizeof(header));
+  write_section(file, offset, vertices.data(), vertices.size() * sizeof(Vec3));
+  write_section(file, offset, indices.data(), indices.size() * sizeof(Vec3i));
+  write_section(file, offset, box_records.data(), box_records.size() * sizeof(double));
+  write_section(file, offset, sphere_records.data(), sphere_records.size() * sizeof(double));
+  write_section(file, offset, triangles.data(), triangles.size() * sizeof(tinybvh::bvhvec4));
+  write_section(file, offset, triangle_indices.data(), triangle_indices.size() * sizeof(uint32_t));
+  if(bvh) {
+    write_section(file, offset, bvh->bvhNode, header.node_count * sizeof(tinybvh::BVH::BVHNode));
+    write_section(file, offset, bvh->primIdx, header.prim_index_count * sizeof(uint32_t));
   }
 
   file.close();
+  if(!file) {
+    std::remove(temp.c_str());
+    throw std::runtime_error(std::string("Failed to write scene file: ") + filepath);
+  }
+  if(!replace_file(temp, filepath)) throw std::runtime_error(std::string("Failed to replace scene file: ") + filepath);
+}
+
+void SceneRaycaster::load_scene(const char* filepath) {
+  // 書き込み可能（コピーオンライト）でマップし、BVH用の頂点・インデックスとノードはマップ領域を直接使う
+  auto mapped = std::make_unique<MappedFile>(filepath, true);
+  SectionCursor file(mapped->mutable_data(), mapped->size());
+
+  SceneHeader header;
+  if(file.size() < sizeof(header)) throw std::runtime_error(std::string("Not a scene file: ") + filepath);
+  std::memcpy(&header, file.next<SceneHeader>(1), sizeof(header));
+  if(std::memcmp(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) != 0) throw std::runtime_error(std::string("Not a scene file: ") + filepath);
+  if(header.version != SCENE_VERSION) throw std::runtime_error("Unsupported scene file version: " + std::to_string(header.version));
+  if(header.node_size != sizeof(tinybvh::BVH::BVHNode)) throw std::runtime_error("Scene file was written with an incompatible BVH layout");
+
+  // 読み込みが全て成功してから入れ替える（失敗しても現在のシーンは壊さない）
+  SceneRaycaster scene;
+  scene.compact             = (header.flags & SCENE_COMPACT) != 0;
+  scene.host_released       = (header.flags & SCENE_HOST_RELEASED) != 0;
+  scene.user_vertex_count   = header.user_vertex_count;
+  scene.user_triangle_count = header.user_triangle_count;
+  scene.refits_since_build  = static_cast<int>(header.refits_since_build);
+  scene.build_options.builder             = static_cast<BvhBuilder>(std::min<uint32_t>(header.build_options & 0xff, static_cast<uint32_t>(BvhBuilder::HighQuality)));
+  scene.build_options.layout              = static_cast<BvhLayout>(std::min<uint32_t>(header.build_options >> 8 & 0xff, static_cast<uint32_t>(BvhLayout::Wide8)));
+  scene.build_options.optimize            = (header.build_options >> 16 & 1) != 0;
+  scene.build_options.analytic_primitives = (header.build_options >> 24 & 1) != 0;
+
+  // 公開している倍精度の vertices / indices と、ボックス・球は std::vector なのでコピーする
+  const Vec3* vertices_section = file.next<Vec3>(header.vertex_count);
+  scene.vertices.assign(vertices_section, vertices_section + header.vertex_count);
+  const Vec3i* indices_section = file.next<Vec3i>(header.index_count);
+  scene.indices.assign(indices_section, indices_section + header.index_count);
+
+  const double* records = file.next<double>(header.box_count * BOX_RECORD);
+  scene.boxes.resize(header.box_count);
+  for(size_t i = 0; i < scene.boxes.size(); i++) {
+    const double* r = &records[i * BOX_RECORD];
+    scene.boxes[i]  = {{r[0], r[1], r[2]}, {r[3], r[4], r[5]}, {r[6], r[7], r[8]}, r[9] != 0.0};
+  }
+  records = file.next<double>(header.sphere_count * SPHERE_RECORD);
+  scene.spheres.resize(header.sphere_count);
+  for(size_t i = 0; i < scene.spheres.size(); i++) {
+    const double* r  = &records[i * SPHERE_RECORD];
+    scene.spheres[i] = {{r[0], r[1], r[2]}, r[3], r[4] != 0.0};
+  }
+
+  // BVH用の頂点とインデックスはコピーせずにマップ領域を参照する
+  scene.triangles.attach(file.next<tinybvh::bvhvec4>(header.bvh_vertex_count), header.bvh_vertex_count);
+  scene.triangle_indices.attach(file.next<uint32_t>(header.bvh_index_count), header.bvh_index_count);
+
+  // 数の整合性を確認する（解析的に扱うボックス・球は三角形を持たない）
+  const bool tessellated     = !scene.build_options.analytic_primitives;
+  const size_t num_triangles = scene.triangle_count();
+  const bool counts_valid    = num_triangles == header.user_triangle_count + (tessellated ? header.box_count * BOX_TRIANGLES + header.sphere_count * SPHERE_TRIANGLES : 0) &&
+                            (scene.compact ? scene.triangles.size() == header.user_vertex_count + (tessellated ? header.box_count * BOX_VERTICES + header.sphere_count * SPHERE_VERTICES : 0) : scene.triangles.size() % 3 == 0) &&
+                            (scene.host_released || (header.vertex_count == header.user_vertex_count && header.index_count == header.user_triangle_count)) &&
+                            (header.node_count > 0) == (num_triangles > 0) &&
+                            // 空間分割で作った木は1つの三角形を複数の葉から参照する
+                            (scene.build_options.builder == BvhBuilder::HighQuality ? header.prim_index_count >= num_triangles : header.prim_index_count == (header.node_count > 0 ? num_triangles : 0));
+  if(!counts_valid) throw std::runtime_error("Scene file is corrupted");
+  for(uint32_t idx : scene.triangle_indices) {
+    if(idx >= scene.triangles.size()) throw std::runtime_error("Scene file is corrupted");
+  }
+
+  // ボックス・球のテッセレーション（リフィット用）と解析的に扱う形状のBVHは保存せずに作り直す
+  scene.tessellate_primitives();
+  scene.rebuild_analytic_bvh();
+
+  if(header.node_count > 0) {
+    // 保存したノードをマップ領域のまま検査して使い、BVHは再構築しない
+    auto* nodes     = file.next<tinybvh::BVH::BVHNode>(header.node_count);
+    uint32_t* prims = file.next<uint32_t>(header.prim_index_count);
+    // 根から辿れるノードだけを検査する（未使用のノードは中身が不定）
+    std::vector<uint32_t> stack = {0};
+    for(uint64_t visited = 0; !stack.empty(); visited++) {
+      const tinybvh::BVH::BVHNode& node = nodes[stack.back()];
+      stack.pop_back();
+      const bool valid = visited < header.node_count && (node.isLeaf() ? uint64_t{node.leftFirst} + node.triCount <= header.prim_index_count : node.leftFirst > 0 && uint64_t{node.leftFirst} + 1 < header.node_count);
+      if(!valid) throw std::runtime_error("Scene file is corrupted");
+      if(!node.isLeaf()) {
+        stack.push_back(node.leftFirst);
+        stack.push_back(node.leftFirst + 1);
+      }
+    }
+    for(uint64_t i = 0; i < header.prim_index_count; i++) {
+      if(prims[i] >= num_triangles) throw std::runtime_error("Scene file is corrupted");
+    }
+
+    auto restored          = std::make_unique<tinybvh::BVH>();
+    restored->context.free = keep_mapped;
+    restored->bvhNode      = nodes;
+    restored->primIdx      = prims;
+
+    restored->allocatedNodes = restored->usedNodes = static_cast<uint32_t>(header.node_count);
+    restored->triCount = static_cast<uint32_t>(num_triangles);
+    restored->idxCount = static_cast<uint32_t>(header.prim_index_count);
+    restored->verts    = tinybvh::bvhvec4slice(scene.triangles.data(), (uint32_t)scene.triangles.size(), sizeof(tinybvh::bvhvec4));
+    if(scene.compact) {
+      restored->vertIdx          = scene.triangle_indices.data();
+      restored->bvh_over_indices = true;
+    }
+    scene.bvh = std::move(restored);
+  }
+  scene.scene_file = std::move(mapped);
+
+  // 同じ内容のシーンを構築した場合と同じハッシュになる（変更の記録は引き継がない）
+  scene.mesh_hash   = scene.hash_user_mesh();
+  scene.scene_hash  = scene.hash_content();
+  scene.build_dirty = false;
+  *this             = std::move(scene);
+  update_converted_bvh();
 }
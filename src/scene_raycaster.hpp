@@ -1,10 +1,14 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <cstdint>
+#include <memory>
 #include <vector>
 
 #include "ext/tinybvh/tiny_bvh.h"
+#include "query_stats.hpp"
 
 using Vec3 = std::array<double, 3>;
 using Vec3i = std::array<int, 3>;
@@ -15,27 +19,227 @@ struct HitResult {
   double distance = 0.0;
 };
 
+// レイごとの遮蔽判定を64本ずつ詰めたビットマスク（レイ i が遮られていれば word i/64 の bit i%64 が立つ）
+using OcclusionMask = std::vector<uint64_t>;
+
+inline bool mask_test(const OcclusionMask& mask, size_t i) { return (mask[i >> 6] >> (i & 63)) & 1u; }
+
+// DirectionSet の方向を、角度の近いもの同士で Intersect256Rays 用のパケットにまとめた計画
+// パケットは256枠で、角の4枠（0, 51, 204, 255）は視錐台を作るためのガード用の方向を入れる
+struct RayPacketPlan {
+  std::vector<uint32_t> slots; // パケットごとに256個の方向の添字（角の枠は未使用。余った枠は同じ方向を繰り返す）
+  std::vector<float> guards;   // パケットごとに角4枠の方向 (x, y, z) x 4
+  std::vector<uint32_t> scalar; // パケットにできなかった方向（1本ずつ走査する）
+
+  size_t size() const { return slots.size() / 256; }
+  bool empty() const { return slots.empty(); }
+};
+
+// 同じ原点から放つレイの方向（SoA, 単精度）
+struct DirectionSet {
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> z;
+  RayPacketPlan packets; // 空なら1本ずつ走査する
+
+  size_t size() const { return x.size(); }
+  // rows x cols の格子（添字 r * cols + c。行は仰角、列は方位角の昇順）として、隣接する方向をパケットにまとめる
+  // tile_cols が0なら列は全周を等分した方位角とみなしてタイルの列数を決め、正ならタイルを tile_cols 列にする（列が全周を覆わない格子用）
+  // 64本に満たないタイルと、視錐台が広すぎるタイルは1本ずつ走査する
+  void plan_packets(int rows, int cols, int tile_cols = 0);
+};
+
+// 問い合わせの作業バッファ。大きくなった領域は解放せずに次の問い合わせで使い回す
+// スレッドごとに1つ持ち、同時に複数のスレッドから使わないこと（どの SceneRaycaster の問い合わせにも使える）
+struct QueryContext {
+  std::vector<tinybvh::Ray> rays;   // レイと走査結果
+  std::vector<tinybvh::Ray> packet; // Intersect256Rays に渡すパケット
+  std::vector<double> azimuths;     // project_horizon の方位角ごとの (cos, sin)
+
+  // 確保済みの作業バッファの大きさ（バイト）
+  size_t memory_usage() const { return (rays.capacity() + packet.capacity()) * sizeof(tinybvh::Ray) + azimuths.capacity() * sizeof(double); }
+};
+
+// BVHの構築方法
+enum class BvhBuilder {
+  Binned,      // ビン分割SAH（tinybvh標準。構築と走査のバランスが良い）
+  Quick,       // 中央分割（構築が最速で走査は遅め。一度きりの問い合わせ向け。コンパクトモードでは Binned になる）
+  HighQuality, // 空間分割付きSAH（構築は遅いが走査が最速。リフィットできないため形状の変更時は作り直す）
+};
+
+// 走査に使うノードレイアウト（Standard 以外は構築後に変換して持つ）
+enum class BvhLayout {
+  Standard, // 2分木（tinybvh::BVH）。256本単位のパケット走査を使う
+  SoA,      // 子ノードのAABBをSoAで並べた2分木（AVX / NEON）
+  Wide4,    // 4分木（SSE / NEON）
+  Wide8,    // 8分木（AVX2）
+};
+
+struct BuildOptions {
+  BvhBuilder builder       = BvhBuilder::Binned;
+  BvhLayout layout         = BvhLayout::Standard; // この環境で使えない場合は Standard で走査する
+  bool optimize            = false;               // 構築後に部分木の付け替えで木を最適化する（HighQuality では行わない）
+  bool analytic_primitives = false;               // ボックス・球を三角形に分割せず、専用のBVHで解析的に交差判定する（三角形のBVHと合わせて走査する）
+  int threads              = 0;                   // 三角形分割・単精度バッファへの変換と、BVHの構築に使うスレッド数（0以下なら論理コア数）
+};
+
+// 測定点の領域から見て結果に影響しない三角形を除く条件（extract_region）
+struct CullOptions {
+  double min_elevation_deg    = 20.0;  // この仰角以上のレイが届かない三角形を除く（結果は変わらない）
+  double min_angular_size_deg = 0.0;   // 見かけの大きさがこの角度未満の三角形を除く（0なら除かない。近似）
+  bool merge_small            = false; // 除く代わりに近くの小さな三角形ごとに外接する箱へまとめる（遮蔽を大きく見積もる近似）
+};
+
 struct Box {
   Vec3 center;
   Vec3 size;
   Vec3 euler;
+  bool removed = false;
 };
 
 struct Sphere {
   Vec3 center;
   double radius;
+  bool removed = false;
+};
+
+// 自前の配列か、load_scene でマップしたシーンキャッシュの領域を参照する配列
+// マップ領域は書き込み可能（書き込んだページだけがコピーされる）なので、参照したままリフィットできる。大きさを変えるときは自前の配列にコピーする
+template <typename T> class SceneBuffer {
+private:
+  std::vector<T> owned;
+  T* view          = nullptr; // nullptr でなければマップ領域の view_size 個を参照する
+  size_t view_size = 0;
+
+public:
+  size_t size() const { return view ? view_size : owned.size(); }
+  T* data() { return view ? view : owned.data(); }
+  const T* data() const { return view ? view : owned.data(); }
+  T& operator[](size_t i) { return data()[i]; }
+  const T& operator[](size_t i) const { return data()[i]; }
+  const T* begin() const { return data(); }
+  const T* end() const { return data() + size(); }
+  // マップ領域を参照している場合はその大きさ
+  size_t capacity() const { return view ? view_size : owned.capacity(); }
+  bool mapped() const { return view != nullptr; }
+
+  void clear() {
+    view      = nullptr;
+    view_size = 0;
+    owned.clear();
+  }
+  void resize(size_t count) {
+    if(view) {
+      owned.assign(view, view + std::min(count, view_size));
+      view      = nullptr;
+      view_size = 0;
+    }
+    owned.resize(count);
+  }
+  // 自前の配列を解放し、マップ領域 data[count] を参照する
+  void attach(T* data, size_t count) {
+    owned     = {};
+    view      = count > 0 ? data : nullptr;
+    view_size = view ? count : 0;
+  }
 };
 
+class MappedFile;
+
 class SceneRaycaster {
 private:
-  std::vector<tinybvh::bvhvec4> triangles;
-  bool build_dirty = true;
+  // BVHに渡す単精度の頂点。並びは [ユーザーメッシュ][ボックス][球]
+  // 通常モードでは三角形ごとに3頂点（非インデックス）、コンパクトモードでは頂点を共有し triangle_indices で参照する
+  SceneBuffer<tinybvh::bvhvec4> triangles;
+  SceneBuffer<uint32_t> triangle_indices; // コンパクトモードのみ
+  bool build_dirty           = true;      // trueなら次のbuildで全体を作り直す
+  bool compact               = false;     // インデックス付き・単精度のみで保持する
+  bool host_released         = false;     // release_host_geometry で vertices / indices を解放済み
+  size_t user_vertex_count   = 0;         // BVHバッファ中のユーザーメッシュの頂点数・三角形数
+  size_t user_triangle_count = 0;
   std::vector<Box> boxes;
   std::vector<Sphere> spheres;
-  tinybvh::BVH* bvh = nullptr;
+  std::unique_ptr<tinybvh::BVH> bvh;
+  // load_scene でマップしたシーンキャッシュ（定義は mapped_file.hpp）
+  // triangles / triangle_indices と bvh のノード・primIdx がこの領域を直接参照している間は保持する
+  std::unique_ptr<MappedFile> scene_file;
+
+  // BvhLayout::Standard 以外で走査に使う変換済みの木（定義は scene_raycaster.cpp）
+  struct ConvertedBvh;
+  BuildOptions build_options;
+  BvhLayout active_layout = BvhLayout::Standard;
+  std::unique_ptr<ConvertedBvh> converted_bvh;
+
+  // analytic_primitives で使うボックス・球のBVH（定義は scene_raycaster.cpp）
+  struct AnalyticBvh;
+  std::unique_ptr<AnalyticBvh> analytic_bvh;
+
+  // ボックス・球をテッセレーションした頂点とインデックス（ユーザーメッシュとは別に保持。analytic_primitives では空）
+  std::vector<Vec3> primitive_vertices;
+  std::vector<Vec3i> primitive_indices;
+
+  // 形状だけが変わったオブジェクト（次のbuildでBVHをリフィットする）
+  std::vector<size_t> dirty_boxes;
+  std::vector<size_t> dirty_spheres;
+  int refits_since_build = 0;
+
+  // 部分リフィット用のノードの親と、三角形が属する葉ノード（必要になった時に作る）
+  std::vector<uint32_t> node_parent;
+  std::vector<uint32_t> prim_leaf;
+
+  // build ごとの形状の内容の変化（結果キャッシュの無効化に使う）
+  struct SceneChange {
+    uint64_t from_hash = 0;
+    uint64_t to_hash   = 0;
+    Vec3 lo            = {HUGE_VAL, HUGE_VAL, HUGE_VAL}; // 変わった形状の変更前後を含むAABB
+    Vec3 hi            = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+    bool full          = false; // 範囲を特定できない変更（clear / mark_dirty など）
+  };
+  uint64_t mesh_hash  = 0; // ユーザーメッシュ部分のハッシュ（全体を作り直すときに求め直す）
+  uint64_t scene_hash = 0;
+  SceneChange pending_change; // 次のbuildで記録する変更
+  std::vector<SceneChange> change_log;
+
+  // 計測の集計先（set_collect_stats(true) の間だけ確保する。定義は scene_raycaster.cpp）
+  struct StatsSink;
+  std::unique_ptr<StatsSink> stats_sink;
+
+  const tinybvh::bvhvec4& triangle_vertex(size_t tri, int k) const { return compact ? triangles[triangle_indices[tri * 3 + k]] : triangles[tri * 3 + k]; }
+  void tessellate_primitives();
+  void tessellate_box(size_t id);
+  void tessellate_sphere(size_t id);
+  void write_triangles(size_t first_index, size_t last_index, size_t tri_offset, size_t vertex_offset, const std::vector<Vec3>& src_vertices, const std::vector<Vec3i>& src_indices);
+  void upload_vertices(size_t first, size_t last, size_t vertex_offset, const std::vector<Vec3>& src_vertices);
+  void rebuild_bvh();
+  bool build_split_bvh(); // 上の数段を分けて部分木を並列に構築する（分けない場合は何もせず false）
+  void rebuild_analytic_bvh();
+  void update_converted_bvh();
+  bool has_bvh() const { return bvh || analytic_bvh; }
+  int32_t intersect(tinybvh::Ray& ray) const; // 訪れたノード数を返す
+  int32_t intersect_triangles(tinybvh::Ray& ray) const;
+  int32_t intersect_analytic(tinybvh::Ray& ray) const;
+  bool test_occlusion(const tinybvh::Ray& ray) const;
+  bool test_triangle_occlusion(const tinybvh::Ray& ray) const;
+  bool test_analytic_occlusion(const tinybvh::Ray& ray) const;
+  void refit_triangles(const std::vector<uint32_t>& tri_ids);
+  uint64_t trace(tinybvh::Ray* rays, size_t count) const;
+  // directions をパケットで走査できればパケットの角の並び（0 / 1）、できなければ -1
+  int usable_packet_orientation(const DirectionSet& directions) const;
+  // rays[directions.size()] を走査する（パケットは context の作業バッファに作る）
+  uint64_t trace_packets(const DirectionSet& directions, tinybvh::Ray* rays, QueryContext& context, QueryStats* stats) const;
+  // directions のパケットの計画に従って遮蔽判定し、遮られたレイのビットを mask に立てる
+  void occlude_packets(const tinybvh::bvhvec3& origin, const DirectionSet& directions, int orientation, uint64_t* mask, QueryContext& context, QueryStats* stats) const;
+  // occluded / occluded_packets の本体（context が nullptr なら1本ずつ遮蔽判定する）
+  void occlusion_query(const Vec3& origin, const DirectionSet& directions, OcclusionMask& mask, QueryContext* context, QueryStats* stats) const;
+  // stats が nullptr でなければそこへ、そうでなければ（有効なら）シーンの計測に足す
+  void record_stats(const QueryStats& local, QueryStats* stats) const;
+  // 変更された範囲 [lo, hi] を次のbuildで記録する変更に加える
+  void note_change(const Vec3& lo, const Vec3& hi);
+  uint64_t hash_user_mesh() const;
+  uint64_t hash_content() const;
 
 public:
-  SceneRaycaster() = default;
+  SceneRaycaster();
   ~SceneRaycaster();
 
   // コピー禁止
@@ -47,13 +251,105 @@ public:
   SceneRaycaster& operator=(SceneRaycaster&& other) noexcept;
 
   void clear();
-  void add_box(const Vec3& pos, const Vec3& size, const Vec3& euler);
-  void add_sphere(const Vec3& center, double radius);
+  size_t add_box(const Vec3& pos, const Vec3& size, const Vec3& euler);
+  size_t add_sphere(const Vec3& center, double radius);
   void add_mesh(const std::vector<Vec3>& mesh_vertices);
-  void build();
+  // 頂点とインデックス（0始まり、このメッシュ内の番号）でメッシュを追加する
+  void add_indexed_mesh(std::vector<Vec3> mesh_vertices, std::vector<Vec3i> mesh_indices);
+
+  // 追加済みオブジェクトの変更・削除（BVHは作り直さずにリフィットする）
+  void update_box(size_t id, const Vec3& pos, const Vec3& size, const Vec3& euler);
+  void update_sphere(size_t id, const Vec3& center, double radius);
+  void remove_box(size_t id);
+  void remove_sphere(size_t id);
+
+  // vertices / indices を直接書き換えた場合に呼ぶ
+  void mark_dirty() {
+    build_dirty         = true;
+    pending_change.full = true;
+  }
+  bool needs_build() const { return build_dirty || !dirty_boxes.empty() || !dirty_spheres.empty(); }
+  // build後の三角形数（ユーザーメッシュ＋ボックス・球。analytic_primitives ではボックス・球を含まない）
+  size_t triangle_count() const { return compact ? triangle_indices.size() / 3 : triangles.size() / 3; }
+  // build後に交差判定する形状があるか（三角形または解析的に扱うボックス・球）
+  bool has_geometry() const;
+
+  // コンパクトモード: 単精度の共有頂点＋インデックスでBVHを構築し、非インデックスのコピーを作らない
+  void set_compact_storage(bool enable);
+  bool compact_storage() const { return compact; }
+  // ビルド後に倍精度の vertices / indices を解放する（コンパクトモードのみ。以降 add_mesh は不可）
+  void release_host_geometry();
+  // ジオメトリとBVHが保持しているおおよそのメモリ量（バイト）
+  size_t memory_usage() const;
+
+  // 構築方法・レイアウトの変更（構築方法が変わった場合は次のbuildで作り直す）
+  void set_build_options(const BuildOptions& options);
+  const BuildOptions& get_build_options() const { return build_options; }
+  // 実際に走査に使っているレイアウト
+  BvhLayout traversal_layout() const { return active_layout; }
+  static bool layout_supported(BvhLayout layout);
+
+  // 計測（既定では無効）。有効な間は build / raycast / occluded の段階ごとの時間とカウンタを積算する
+  // 無効なら各呼び出しの分岐1つ分のコストしかかからない。is_occluded は1本ごとなので数えない
+  void set_collect_stats(bool enable);
+  bool collect_stats() const { return stats_sink != nullptr; }
+  QueryStats stats() const;
+  void reset_stats();
+
+  // stats を渡すと計測をそこに足す（渡さなければ set_collect_stats の集計先）
+  void build(QueryStats* stats = nullptr);
   std::vector<HitResult> raycast(const std::vector<Vec3>& origins, const std::vector<Vec3>& directions) const;
+  // 呼び出し側のメモリ results[origins.size()] に書き込む版（作業バッファは context のものを使い回す）
+  void raycast(const std::vector<Vec3>& origins, const std::vector<Vec3>& directions, HitResult* results, QueryContext& context) const;
+  // 1点から複数方向へのレイキャスト（結果は results に書き込む）
+  // stats を渡すとシーンの計測の代わりにそこへ足す（呼び出し側がスレッドごとに集計する場合）
+  void raycast(const Vec3& origin, const DirectionSet& directions, std::vector<HitResult>& results, QueryStats* stats = nullptr) const;
+  // results[directions.size()] に書き込む版。同じ context で繰り返し呼べば、作業バッファの確保は最初の1回だけになる
+  void raycast(const Vec3& origin, const DirectionSet& directions, HitResult* results, QueryContext& context, QueryStats* stats = nullptr) const;
+
+  // 遮蔽判定のみ（最初に当たった時点で探索を打ち切るため raycast より速い）
+  bool is_occluded(const Vec3& origin, const Vec3& direction) const;
+  OcclusionMask occluded(const std::vector<Vec3>& origins, const std::vector<Vec3>& directions) const;
+  // 1点から複数方向への遮蔽判定。directions のパケットの計画は使わず、1本ずつ最初に当たった時点で探索を打ち切る（天空率の計算の既定）
+  void occluded(const Vec3& origin, const DirectionSet& directions, OcclusionMask& mask, QueryStats* stats = nullptr) const;
+  // directions のパケットの計画に従って Intersect256Rays でまとめて判定する（パケットの作業バッファは context のものを使い回す）
+  // tiny_bvh にパケットの遮蔽判定はないため、最近接ヒットを求める走査（早期打ち切りなし）で当たったレイを遮られたとする。結果は occluded と同じ
+  // パケットで走査できない場合（計画がない・Standard 以外のレイアウト・コンパクトモード）は occluded と同じく1本ずつ遮蔽判定する
+  void occluded_packets(const Vec3& origin, const DirectionSet& directions, OcclusionMask& mask, QueryContext& context, QueryStats* stats = nullptr) const;
+  // directions のうち indices の方向だけを1本ずつ遮蔽判定し、indices[k] の方向が遮られていれば mask のビット k を立てる
+  // 前の結果で次の方向が決まる探索（ホライズンの二分探索など）で、その時点で決まっている方向をまとめて判定する用。レイは context の作業バッファに作る
+  void occluded(const Vec3& origin, const DirectionSet& directions, const std::vector<uint32_t>& indices, OcclusionMask& mask, QueryContext& context, QueryStats* stats = nullptr) const;
+  // mask のビットが立っていないレイだけを飛ばし、遮られたレイのビットを追加する（複数のシーンの遮蔽を重ねる）
+  void accumulate_occlusion(const Vec3& origin, const DirectionSet& directions, OcclusionMask& mask, QueryStats* stats = nullptr) const;
+
+  // レイを飛ばさずに、原点から見た方位角ごとの遮蔽の最大仰角を求める
+  // 方位角 2π p / azimuth_steps の鉛直な半平面と三角形・ボックス・球の交わりのうち、最も高い点の仰角の正接を tan_elevation[p] に書き込む
+  // 正接が min_tan 以下の遮蔽は無視して min_tan のままにし、原点の真上を覆う場合は無限大にする
+  // 仰角は刻みによらず正確。BVHは見えうるノード（既に求めた仰角より高くなりうるもの）の選別にだけ使う
+  void project_horizon(const Vec3& origin, int azimuth_steps, double min_tan, double* tan_elevation, QueryContext& context, QueryStats* stats = nullptr) const;
+
+  // build 時点の形状の内容のハッシュ（三角形・ボックス・球と analytic_primitives から求める。同じ内容なら同じ値になる）
+  uint64_t content_hash() const { return scene_hash; }
+  // content_hash() が from だった時点から現在までに変わった形状の、変更前後を含むAABBを [lo, hi] に求める（変更がなければ lo > hi の空の箱）
+  // 記録が残っていない場合と、範囲を特定できない変更（clear / mark_dirty / analytic_primitives の切り替えなど）を挟む場合は false
+  bool changed_bounds(uint64_t from, Vec3& lo, Vec3& hi) const;
+
+  // Nx3 の連続配列（T = float / double）を直接受け取る版。NumPy配列をコピーせずに渡すために使う
+  template <typename T> void add_mesh(const T* mesh_vertices, size_t vertex_count);
+  // hit[count], position[count * 3], distance[count] に書き込む（context を渡すとその作業バッファを使い回す）
+  template <typename T> void raycast(const T* origins, const T* directions, size_t count, bool* hit, double* position, double* distance, QueryContext* context = nullptr) const;
+  // mask[(count + 63) / 64] に書き込む
+  template <typename T> void occluded(const T* origins, const T* directions, size_t count, uint64_t* mask) const;
   void save(const char* filepath);
 
+  // 領域 [region_min, region_max] 内の測定点から見て影響しうる三角形だけを集めた新しいシーンを作る（build済みであること）
+  // 構築オプションは引き継ぎ、BVHは未構築で返す
+  SceneRaycaster extract_region(const Vec3& region_min, const Vec3& region_max, const CullOptions& options) const;
+
+  // 構築済みのBVHを含むシーン全体をバイナリ形式で保存・読み込みする（読み込み時にBVHを再構築しない）
+  void save_scene(const char* filepath);
+  void load_scene(const char* filepath);
+
   std::vector<Vec3> vertices;
   std::vector<Vec3i> indices;
 };
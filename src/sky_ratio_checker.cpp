@@ -1,6 +1,18 @@
 #include "sky_ratio_checker.hpp"
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -10,32 +22,437 @@
 constexpr double THETA_MIN_DEG = 20.0;
 constexpr double THETA_MAX_DEG = 89.0;
 
-std::vector<std::tuple<Vec3, Vec3>> SkyRatioChecker::generate_rays_from_checkpoint(const Vec3& checkpoint) {
-  if(ray_resolution <= 0.0f || ray_resolution > 180.0f) ray_resolution = 1.0f;
+// 1スレッドが一度に取り出す測定点の数
+constexpr size_t CHECKPOINT_GRAIN = 4;
+// 遮蔽マスクの集計はレイキャストより十分軽いので、大きめのチャンクで取り出す
+constexpr size_t MASK_GRAIN = 64;
+// Guidedで直前の結果を引き継ぐ測定点の数。ブロックの先頭はDescendで求め直す
+// ブロックの区切りを固定しておくことで、スレッド数によらず同じ結果になる
+constexpr size_t GUIDED_BLOCK = 64;
+
+namespace {
+// 遮蔽インデックス h（-1..theta_steps）ごとの cos(空が見え始める天頂角)。添字は h + 1
+std::vector<double> make_visible_cos(float resolution, int theta_steps, bool safe) {
+  const double resolution_rad = resolution * M_PI / 180.0;
+  std::vector<double> table(theta_steps + 2, 1.0); // h = -1（遮蔽なし）は天頂角0
+  for(int t = 0; t <= theta_steps; t++) {
+    // この方位角での最大遮蔽角度（空が見え始める角度）
+    double blocked_theta = (THETA_MIN_DEG + resolution * t) * M_PI / 180.0;
+
+    // 安全側評価の適用
+    if(safe) {
+      blocked_theta += resolution_rad; // 内接近似：建物を大きく見積もる（空を小さく見積もる）
+    } else {
+      blocked_theta -= resolution_rad; // 外接近似：建物を小さく見積もる（空を大きく見積もる）
+    }
+    if(blocked_theta > M_PI / 2.0) blocked_theta = M_PI / 2.0;
+    table[t + 1] = std::cos(std::max(blocked_theta, 0.0));
+  }
+  return table;
+}
+} // namespace
+
+const SkyRatioChecker::DirectionTable& SkyRatioChecker::update_direction_table() {
+  if(direction_table.resolution == ray_resolution) return direction_table;
+
   // 天頂角(theta): 20度から89度までに変更（負荷軽減のため）
-  int theta_steps = static_cast<int>((THETA_MAX_DEG - THETA_MIN_DEG) / ray_resolution);
+  const int theta_steps = static_cast<int>((THETA_MAX_DEG - THETA_MIN_DEG) / ray_resolution);
 
   // 方位角(phi): 0度から360度まで
-  int phi_steps = static_cast<int>(360.0 / ray_resolution);
+  const int phi_steps = std::max(static_cast<int>(360.0 / ray_resolution), 1);
 
-  if(phi_steps < 1) phi_steps = 1;
+  // sin/cosは天頂角・方位角それぞれで一度だけ計算する
+  std::vector<double> cos_phi(phi_steps), sin_phi(phi_steps);
+  for(int p = 0; p < phi_steps; p++) {
+    double phi = p * 2.0 * M_PI / phi_steps;
+    cos_phi[p] = std::cos(phi);
+    sin_phi[p] = std::sin(phi);
+  }
 
-  std::vector<std::tuple<Vec3, Vec3>> rays;
+  auto& dirs         = direction_table.directions;
+  const size_t count = static_cast<size_t>(theta_steps + 1) * phi_steps;
+  dirs.x.resize(count);
+  dirs.y.resize(count);
+  dirs.z.resize(count);
   for(int t = 0; t <= theta_steps; t++) {
     double theta     = (THETA_MIN_DEG + t * ray_resolution) * M_PI / 180.0;
     double sin_theta = std::sin(theta);
     double cos_theta = std::cos(theta);
 
     for(int p = 0; p < phi_steps; p++) {
-      double phi = p * 2.0 * M_PI / phi_steps;
-
       // 球面座標から直交座標への変換
-      Vec3 direction{cos_theta * std::cos(phi), cos_theta * std::sin(phi), sin_theta};
-      rays.push_back(std::make_tuple(checkpoint, direction));
+      const size_t i = static_cast<size_t>(t) * phi_steps + p;
+      dirs.x[i]      = static_cast<float>(cos_theta * cos_phi[p]);
+      dirs.y[i]      = static_cast<float>(cos_theta * sin_phi[p]);
+      dirs.z[i]      = static_cast<float>(sin_theta);
     }
   }
 
-  return rays;
+  // 隣接する方向を Intersect256Rays のパケットにまとめておく（全測定点で共有する）
+  dirs.plan_packets(theta_steps + 1, phi_steps);
+
+  // 遮蔽インデックスごとの cos(空が見え始める天頂角) を外接近似・安全側評価それぞれで求めておく
+  for(int safe = 0; safe < 2; safe++) direction_table.visible_cos[safe] = make_visible_cos(ray_resolution, theta_steps, safe != 0);
+
+  direction_table.theta_steps = theta_steps;
+  direction_table.phi_steps   = phi_steps;
+  direction_table.resolution  = ray_resolution;
+  return direction_table;
+}
+
+namespace {
+// マスクのビット位置 first から64ビットを取り出す（範囲外は0）
+uint64_t load_bits(const OcclusionMask& mask, size_t first) {
+  const size_t w = first >> 6, s = first & 63;
+  uint64_t bits = w < mask.size() ? mask[w] >> s : 0;
+  if(s != 0 && w + 1 < mask.size()) bits |= mask[w + 1] << (64 - s);
+  return bits;
+}
+
+int lowest_bit(uint64_t bits) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, bits);
+  return static_cast<int>(index);
+#else
+  return __builtin_ctzll(bits);
+#endif
+}
+
+// 方位角ごとの空が見え始める仰角の cos から天空率を求める
+float integrate_visible_cos(const std::vector<double>& c) {
+  const size_t phi = c.size();
+
+  // 三斜求積法による面積計算（隣接する2つの方位角の積の和）
+  // 4本の独立した和に分けてベクトル化しやすくする
+  double sum[4] = {0.0, 0.0, 0.0, 0.0};
+  size_t p      = 0;
+  for(; p + 4 < phi; p += 4) {
+    for(size_t k = 0; k < 4; k++) sum[k] += c[p + k] * c[p + k + 1];
+  }
+  for(; p + 1 < phi; p++) sum[0] += c[p] * c[p + 1];
+  double sky_area = (sum[0] + sum[1]) + (sum[2] + sum[3]) + c[phi - 1] * c[0];
+
+  float sky_ratio = sky_area / phi;
+
+  // 範囲制限
+  if(sky_ratio < 0.0f) sky_ratio = 0.0f;
+  if(sky_ratio > 1.0f) sky_ratio = 1.0f;
+  return sky_ratio;
+}
+
+// 結果キャッシュ（result_cache_path）のファイル形式: [ヘッダ][CachedResult x count]
+// エンディアンは書き出した環境のネイティブ
+constexpr char RESULT_CACHE_MAGIC[8]    = {'S', 'K', 'Y', 'R', 'A', 'T', 'I', 'O'};
+constexpr uint32_t RESULT_CACHE_VERSION = 1;
+
+struct ResultCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t settings_hash; // SkyRatioChecker::settings_hash
+  uint64_t scene_hash;    // SceneRaycaster::content_hash
+  uint64_t count;
+};
+
+struct CachedResult {
+  Vec3 checkpoint;
+  float ratio;
+  uint32_t reserved;
+};
+
+// 形式やバージョンが違う場合と壊れている場合は false（キャッシュなしとして扱い、次の書き出しで作り直す）
+bool read_result_cache(const std::string& path, ResultCacheHeader& header, std::vector<CachedResult>& entries) {
+  std::ifstream file(path, std::ios::binary);
+  if(!file || !file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+  if(std::memcmp(header.magic, RESULT_CACHE_MAGIC, sizeof(RESULT_CACHE_MAGIC)) != 0 || header.version != RESULT_CACHE_VERSION) return false;
+  file.seekg(0, std::ios::end);
+  if(static_cast<uint64_t>(file.tellg()) != sizeof(header) + header.count * sizeof(CachedResult)) return false;
+  file.seekg(sizeof(header));
+  entries.resize(header.count);
+  return static_cast<bool>(file.read(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(CachedResult)));
+}
+
+// 一時ファイルに書いてから置き換える（書き出し中に中断しても古いキャッシュは壊れない）
+// 一時ファイルの名前はプロセスと呼び出しごとに変え、同じキャッシュを共有する別のプロセスの書きかけを公開しないようにする
+void write_result_cache(const std::string& path, const ResultCacheHeader& header, const std::vector<CachedResult>& entries) {
+  const std::string temp = unique_temp_path(path);
+  {
+    std::ofstream file(temp, std::ios::binary);
+    if(!file) throw std::runtime_error("Failed to open file for writing: " + temp);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(CachedResult));
+    if(!file) {
+      file.close();
+      std::remove(temp.c_str());
+      throw std::runtime_error("Failed to write result cache: " + temp);
+    }
+  }
+  if(!replace_file(temp, path)) throw std::runtime_error("Failed to replace result cache: " + path);
+}
+
+// AABB [lo, hi] の形状が測定点から仰角の下限以上に見えうるか（extract_region と同じ判定）
+bool may_occlude(const Vec3& checkpoint, const Vec3& lo, const Vec3& hi) {
+  // レイの方向は単精度なので、仰角の下限には少し余裕を持たせる
+  const double slope = std::tan((THETA_MIN_DEG - 0.01) * M_PI / 180.0);
+  const double gap_x = std::max({lo[0] - checkpoint[0], checkpoint[0] - hi[0], 0.0});
+  const double gap_y = std::max({lo[1] - checkpoint[1], checkpoint[1] - hi[1], 0.0});
+  const double rise  = hi[2] - checkpoint[2];
+  return lo[0] <= hi[0] && rise >= 0.0 && rise >= slope * std::hypot(gap_x, gap_y);
+}
+} // namespace
+
+void SkyRatioChecker::horizon_from_mask(const OcclusionMask& mask, Scratch& scratch) const {
+  const auto& table   = direction_table;
+  const size_t phi    = table.phi_steps;
+  const size_t blocks = (phi + 63) / 64;
+  auto& horizon       = scratch.horizon;
+  auto& pending       = scratch.pending;
+
+  // 天頂角の行を上から64方位ずつまとめて見ていき、初めて遮られた行をその方位角のホライズンにする
+  horizon.assign(phi, -1);
+  pending.assign(blocks, ~uint64_t{0});
+  if(phi % 64 != 0) pending.back() = (uint64_t{1} << (phi % 64)) - 1;
+  for(int t = table.theta_steps; t >= 0; t--) {
+    const size_t row = static_cast<size_t>(t) * phi;
+    uint64_t remaining = 0;
+    for(size_t b = 0; b < blocks; b++) {
+      uint64_t found = load_bits(mask, row + b * 64) & pending[b];
+      pending[b] &= ~found;
+      remaining |= pending[b];
+      for(; found != 0; found &= found - 1) horizon[b * 64 + lowest_bit(found)] = t;
+    }
+    // 全方位角のホライズンが決まれば下の行は見なくてよい
+    if(remaining == 0) break;
+  }
+}
+
+float SkyRatioChecker::integrate_horizon(Scratch& scratch) const {
+  const auto& table   = direction_table;
+  const auto& cos_lut = table.visible_cos[use_safe_side ? 1 : 0];
+  const size_t phi    = table.phi_steps;
+
+  // 各方位角(phi)における、空が見える最小天頂角の cos
+  auto& c = scratch.visible_cos;
+  c.resize(phi);
+  for(size_t p = 0; p < phi; p++) c[p] = cos_lut[scratch.horizon[p] + 1];
+  return integrate_visible_cos(c);
+}
+
+float SkyRatioChecker::integrate_projection(Scratch& scratch) const {
+  const double min_tan = std::tan(THETA_MIN_DEG * M_PI / 180.0);
+  const size_t phi     = direction_table.phi_steps;
+
+  // 仰角の下限以下の遮蔽は無視し、真上を覆う方位角は空が見えない
+  auto& c = scratch.visible_cos;
+  c.resize(phi);
+  for(size_t p = 0; p < phi; p++) {
+    const double t = scratch.tan_horizon[p];
+    c[p]           = t <= min_tan ? 1.0 : (std::isinf(t) ? 0.0 : 1.0 / std::sqrt(1.0 + t * t));
+  }
+  return integrate_visible_cos(c);
+}
+
+void SkyRatioChecker::find_horizon_sweep(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const {
+  auto& occlusion = scratch.occlusion;
+  if(use_occlusion_query && use_packet_occlusion) {
+    raycaster.occluded_packets(checkpoint, direction_table.directions, occlusion, scratch.context, scratch_stats(scratch));
+  } else if(use_occlusion_query) {
+    raycaster.occluded(checkpoint, direction_table.directions, occlusion, scratch_stats(scratch));
+  } else {
+    // 結果と作業バッファはスレッドごとに使い回し、測定点ごとには確保しない
+    scratch.hit_results.resize(direction_table.directions.size());
+    raycaster.raycast(checkpoint, direction_table.directions, scratch.hit_results.data(), scratch.context, scratch_stats(scratch));
+    StageTimer timer(scratch_stats(scratch));
+    occlusion.assign((scratch.hit_results.size() + 63) / 64, 0);
+    for(size_t i = 0; i < scratch.hit_results.size(); i++) {
+      if(scratch.hit_results[i].hit) occlusion[i >> 6] |= uint64_t{1} << (i & 63);
+    }
+    timer.lap(&QueryStats::conversion_seconds);
+  }
+  StageTimer timer(scratch_stats(scratch));
+  horizon_from_mask(occlusion, scratch);
+  timer.lap(&QueryStats::integration_seconds);
+}
+
+template <class Next, class Update> void SkyRatioChecker::probe_columns(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch, Next&& next, Update&& update) const {
+  const auto& table = direction_table;
+  auto& columns     = scratch.columns;
+  auto& probes      = scratch.probes;
+  columns.resize(table.phi_steps);
+  for(int p = 0; p < table.phi_steps; p++) columns[p] = p;
+  for(;;) {
+    // 終わった方位角を除きながら、残りの方位角の次のレイを集める
+    size_t active = 0;
+    probes.clear();
+    for(int p : columns) {
+      const int t = next(scratch.search[p]);
+      if(t < 0) continue;
+      columns[active++] = p;
+      probes.push_back(static_cast<uint32_t>(t) * table.phi_steps + p);
+    }
+    columns.resize(active);
+    if(active == 0) break;
+    raycaster.occluded(checkpoint, table.directions, probes, scratch.occlusion, scratch.context, scratch_stats(scratch));
+    for(size_t k = 0; k < active; k++) update(scratch.search[columns[k]], static_cast<int>(probes[k] / table.phi_steps), mask_test(scratch.occlusion, k));
+  }
+}
+
+void SkyRatioChecker::find_horizon_descend(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const {
+  const auto& table = direction_table;
+  scratch.search.assign(table.phi_steps, ColumnSearch{-1, table.theta_steps + 1});
+  // 天頂側から順に飛ばし、最初に遮られたレイがこの方位角の最大遮蔽角度
+  probe_columns(
+      raycaster, checkpoint, scratch, [](const ColumnSearch& s) { return s.lo < 0 ? s.hi - 1 : -1; },
+      [](ColumnSearch& s, int t, bool hit) {
+        if(hit) {
+          s.lo = t;
+        } else {
+          s.hi = t;
+        }
+      });
+  for(int p = 0; p < table.phi_steps; p++) scratch.horizon[p] = scratch.search[p].lo;
+}
+
+void SkyRatioChecker::find_horizon_bisection(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const {
+  const auto& table = direction_table;
+  // 未確定のレイがこの本数以下になったら打ち切る
+  const int tolerance_steps = std::max(static_cast<int>(horizon_tolerance / ray_resolution), 0);
+
+  scratch.search.assign(table.phi_steps, ColumnSearch{-1, table.theta_steps + 1});
+  probe_columns(
+      raycaster, checkpoint, scratch, [&](const ColumnSearch& s) { return s.hi - s.lo - 1 > tolerance_steps ? (s.lo + s.hi) / 2 : -1; },
+      [](ColumnSearch& s, int t, bool hit) {
+        if(hit) {
+          s.lo = t;
+        } else {
+          s.hi = t;
+        }
+      });
+  // 未確定の範囲は安全側なら遮蔽、外接近似なら天空として扱う
+  for(int p = 0; p < table.phi_steps; p++) scratch.horizon[p] = use_safe_side ? scratch.search[p].hi - 1 : scratch.search[p].lo;
+}
+
+void SkyRatioChecker::find_horizon_guided(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const {
+  if(!scratch.has_guess) {
+    find_horizon_descend(raycaster, checkpoint, scratch);
+    scratch.has_guess = true;
+    return;
+  }
+
+  // 直前の測定点のホライズンから、遮られていれば上へ、遮られていなければ下へ間隔を倍にしながら境界を挟み、挟んだ範囲を二分探索する
+  // 推定を試す間は lo（hi）に推定を入れておく
+  const auto& table = direction_table;
+  using Phase       = ColumnSearch::Phase;
+  scratch.search.resize(table.phi_steps);
+  for(int p = 0; p < table.phi_steps; p++) scratch.search[p] = ColumnSearch{std::max(scratch.horizon[p], 0), table.theta_steps + 1};
+  const int theta_steps = table.theta_steps;
+  probe_columns(
+      raycaster, checkpoint, scratch,
+      [theta_steps](ColumnSearch& s) {
+        switch(s.phase) {
+          case Phase::Guess: return s.lo;
+          case Phase::Up:
+            if(s.lo + s.step <= theta_steps) return s.lo + s.step;
+            s.phase = Phase::Bisect;
+            break;
+          case Phase::Down:
+            if(s.hi - s.step >= 0) return s.hi - s.step;
+            s.phase = Phase::Bisect;
+            break;
+          case Phase::Bisect: break;
+        }
+        return s.hi - s.lo > 1 ? (s.lo + s.hi) / 2 : -1;
+      },
+      [](ColumnSearch& s, int t, bool hit) {
+        switch(s.phase) {
+          case Phase::Guess:
+            s.phase = hit ? Phase::Up : Phase::Down;
+            s.lo    = hit ? t : -1;
+            s.hi    = hit ? s.hi : t;
+            break;
+          case Phase::Up:
+            if(hit) {
+              s.lo = t;
+              s.step *= 2;
+            } else {
+              s.hi    = t;
+              s.phase = Phase::Bisect;
+            }
+            break;
+          case Phase::Down:
+            if(hit) {
+              s.lo    = t;
+              s.phase = Phase::Bisect;
+            } else {
+              s.hi = t;
+              s.step *= 2;
+            }
+            break;
+          case Phase::Bisect:
+            if(hit) {
+              s.lo = t;
+            } else {
+              s.hi = t;
+            }
+            break;
+        }
+      });
+  for(int p = 0; p < table.phi_steps; p++) scratch.horizon[p] = scratch.search[p].lo;
+}
+
+void SkyRatioChecker::find_horizon_projection(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const {
+  const int phi = direction_table.phi_steps;
+  scratch.tan_horizon.resize(phi);
+  raycaster.project_horizon(checkpoint, phi, std::tan(THETA_MIN_DEG * M_PI / 180.0), scratch.tan_horizon.data(), scratch.context, scratch_stats(scratch));
+}
+
+float SkyRatioChecker::evaluate_checkpoint(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch, int16_t* profile) const {
+  StageTimer timer(scratch_stats(scratch));
+  scratch.horizon.resize(direction_table.phi_steps);
+  switch(horizon_search) {
+    case HorizonSearch::Sweep: find_horizon_sweep(raycaster, checkpoint, scratch); break;
+    case HorizonSearch::Descend: find_horizon_descend(raycaster, checkpoint, scratch); break;
+    case HorizonSearch::Bisection: find_horizon_bisection(raycaster, checkpoint, scratch); break;
+    case HorizonSearch::Guided: find_horizon_guided(raycaster, checkpoint, scratch); break;
+    case HorizonSearch::Projection: find_horizon_projection(raycaster, checkpoint, scratch); break;
+  }
+  // Sweep と Projection は段階ごとに中で計測する。1本ずつの探索はレイの生成と走査が交互なのでまとめて走査の時間とする
+  timer.lap(horizon_search == HorizonSearch::Sweep || horizon_search == HorizonSearch::Projection ? nullptr : &QueryStats::traversal_seconds);
+  const float sky_ratio = horizon_search == HorizonSearch::Projection ? integrate_projection(scratch) : integrate_horizon(scratch);
+  if(profile) store_profile(scratch, profile);
+  timer.lap(&QueryStats::integration_seconds);
+  scratch.stats.checkpoints++;
+  return sky_ratio;
+}
+
+void SkyRatioChecker::store_profile(const Scratch& scratch, int16_t* profile) const {
+  const auto& table = direction_table;
+  if(horizon_search != HorizonSearch::Projection) {
+    for(int p = 0; p < table.phi_steps; p++) profile[p] = static_cast<int16_t>(scratch.horizon[p]);
+    return;
+  }
+  // 投影した仰角は、それより低いレイのうち最も高いもの（Sweep で遮られる最も高いレイ）のインデックスにする
+  const double min_tan = std::tan(THETA_MIN_DEG * M_PI / 180.0);
+  for(int p = 0; p < table.phi_steps; p++) {
+    const double t = scratch.tan_horizon[p];
+    int h          = -1;
+    if(std::isinf(t)) {
+      h = table.theta_steps;
+    } else if(t > min_tan) {
+      const double elevation = std::atan(t) * 180.0 / M_PI;
+      h                      = std::min(static_cast<int>(std::ceil((elevation - THETA_MIN_DEG) / ray_resolution)) - 1, table.theta_steps);
+    }
+    profile[p] = static_cast<int16_t>(h);
+  }
+}
+
+void SkyRatioChecker::merge_stats(const std::vector<Scratch>& scratch, StageTimer& total) {
+  if(!collect_stats) return;
+  for(const auto& s : scratch) last_stats += s.stats;
+  // スレッドごとの total_seconds は問い合わせ単位の合計なので、呼び出し全体の経過時間で置き換える
+  last_stats.total_seconds = 0.0;
+  total.lap(&QueryStats::total_seconds);
 }
 
 std::vector<float> SkyRatioChecker::check(SceneRaycaster* raycaster) {
@@ -44,83 +461,523 @@ std::vector<float> SkyRatioChecker::check(SceneRaycaster* raycaster) {
     return {};
   }
 
-  std::vector<float> results;
-  results.reserve(checkpoints.size());
+  last_stats = {};
+  StageTimer total(collect_stats ? &last_stats : nullptr);
+  StageTimer timer(collect_stats ? &last_stats : nullptr);
+
+  if(ray_resolution <= 0.0f || ray_resolution > 180.0f) ray_resolution = 1.0f;
+  update_direction_table();
+  timer.lap(&QueryStats::setup_seconds);
+
+  // 変更がなければ何もしない（形状の変更だけならBVHをリフィットする）。時間は三角形分割とBVHの構築に分けて数える
+  raycaster->build(collect_stats ? &last_stats : nullptr);
+  timer.lap(nullptr);
+
+  return result_cache_path.empty() ? evaluate_all(*raycaster, checkpoints, total) : check_cached(*raycaster, total);
+}
+
+std::vector<float> SkyRatioChecker::evaluate_all(const SceneRaycaster& scene, const std::vector<Vec3>& points, StageTimer& total, int16_t* profiles) {
+  // 結果は測定点の順番どおりに格納する（スレッド数によらず同じ出力になる）
+  std::vector<float> results(points.size(), 0.0f);
+  const int threads = std::min<int>(resolve_thread_count(num_threads), static_cast<int>((points.size() + CHECKPOINT_GRAIN - 1) / CHECKPOINT_GRAIN));
+  std::vector<Scratch> scratch(std::max(threads, 1));
+
+  if(!scene.has_geometry()) printf("[WARNING] SkyRatioChecker: SceneRaycaster has no geometry.\n");
+  evaluate_range(scene, points, 0, points.size(), threads, scratch, results.data(), profiles);
+
+  merge_stats(scratch, total);
+  return results;
+}
+
+uint64_t SkyRatioChecker::settings_hash() const {
+  // 結果に影響しない設定（num_threads / use_occlusion_query / use_packet_occlusion / collect_stats）は含めない
+  const double values[] = {ray_resolution, use_safe_side ? 1.0 : 0.0, static_cast<double>(horizon_search), horizon_tolerance, static_cast<double>(far_field_culling), far_field_culling != FarFieldCulling::Off ? culling_region_size : 0.0};
+  uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+  for(double value : values) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    h = (h ^ bits) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+std::vector<float> SkyRatioChecker::check_cached(const SceneRaycaster& scene, StageTimer& total) {
+  ResultCacheHeader header{};
+  std::vector<CachedResult> entries;
+  const uint64_t settings = settings_hash();
+  if(!read_result_cache(result_cache_path, header, entries) || header.settings_hash != settings) entries.clear();
+
+  // シーンが変わっていれば、変わった範囲が見えうる測定点の結果を捨てる
+  // 範囲が分からない場合と、近くの形状ごと箱にまとめる Merge（変わった形状の外まで箱が変わる）では全て捨てる
+  if(!entries.empty() && header.scene_hash != scene.content_hash()) {
+    Vec3 lo, hi;
+    if(far_field_culling == FarFieldCulling::Merge || !scene.changed_bounds(header.scene_hash, lo, hi)) {
+      entries.clear();
+    } else {
+      entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const CachedResult& entry) { return may_occlude(entry.checkpoint, lo, hi); }), entries.end());
+    }
+  }
+
+  std::map<Vec3, float> cache;
+  for(const auto& entry : entries) cache[entry.checkpoint] = entry.ratio;
+
+  // キャッシュにない測定点だけを、元の順番のまま評価する
+  std::vector<float> results(checkpoints.size(), 0.0f);
+  std::vector<size_t> missing;
+  std::vector<Vec3> pending;
+  for(size_t i = 0; i < checkpoints.size(); i++) {
+    const auto it = cache.find(checkpoints[i]);
+    if(it != cache.end()) {
+      results[i] = it->second;
+    } else {
+      missing.push_back(i);
+      pending.push_back(checkpoints[i]);
+    }
+  }
+  if(!missing.empty()) {
+    const auto evaluated = evaluate_all(scene, pending, total);
+    for(size_t n = 0; n < missing.size(); n++) {
+      results[missing[n]]           = evaluated[n];
+      cache[checkpoints[missing[n]]] = evaluated[n];
+    }
+  } else {
+    merge_stats({}, total);
+  }
+
+  // 今回の測定点以外の結果も残しておく
+  if(!missing.empty() || header.scene_hash != scene.content_hash() || header.settings_hash != settings) {
+    std::memcpy(header.magic, RESULT_CACHE_MAGIC, sizeof(RESULT_CACHE_MAGIC));
+    header.version       = RESULT_CACHE_VERSION;
+    header.reserved      = 0;
+    header.settings_hash = settings;
+    header.scene_hash    = scene.content_hash();
+    header.count         = cache.size();
+    entries.clear();
+    entries.reserve(cache.size());
+    for(const auto& entry : cache) entries.push_back({entry.first, entry.second, 0});
+    write_result_cache(result_cache_path, header, entries);
+  }
+  return results;
+}
+
+size_t SkyRatioChecker::check_stream(SceneRaycaster* raycaster, const ChunkCallback& callback, size_t start, size_t chunk_size) {
+  if(raycaster == nullptr) {
+    printf("[ERROR] SkyRatioChecker: SceneRaycaster is not set.\n");
+    return start;
+  }
+  if(chunk_size == 0) throw std::invalid_argument("Chunk size must be positive");
+  if(start > checkpoints.size()) throw std::out_of_range("Start offset is past the last checkpoint");
+
+  last_stats = {};
+  StageTimer total(collect_stats ? &last_stats : nullptr);
+  StageTimer timer(collect_stats ? &last_stats : nullptr);
+
+  if(ray_resolution <= 0.0f || ray_resolution > 180.0f) ray_resolution = 1.0f;
+  update_direction_table();
+  timer.lap(&QueryStats::setup_seconds);
+  raycaster->build(collect_stats ? &last_stats : nullptr);
+  timer.lap(nullptr);
+
+  // Guidedのブロックの区切りが check と同じになるように、チャンクの境界をブロックの倍数にそろえる
+  chunk_size = (chunk_size + GUIDED_BLOCK - 1) / GUIDED_BLOCK * GUIDED_BLOCK;
+  std::vector<float> results(std::min(chunk_size, checkpoints.size() - start));
+  const int threads = std::min<int>(resolve_thread_count(num_threads), static_cast<int>((results.size() + CHECKPOINT_GRAIN - 1) / CHECKPOINT_GRAIN));
+  std::vector<Scratch> scratch(std::max(threads, 1));
+
+  if(!raycaster->has_geometry()) printf("[WARNING] SkyRatioChecker: SceneRaycaster has no geometry.\n");
+  size_t next = start;
+  while(next < checkpoints.size()) {
+    // 最初のチャンクは次のブロックの境界まで（start がブロックの途中なら短くなる）
+    const size_t last = std::min((next / chunk_size + 1) * chunk_size, checkpoints.size());
+    evaluate_range(*raycaster, checkpoints, next, last, threads, scratch, results.data());
+
+    CheckChunk chunk;
+    chunk.first  = next;
+    chunk.count  = last - next;
+    chunk.ratios = results.data();
+    chunk.total  = checkpoints.size();
+    next         = last;
+    if(!callback(chunk)) break;
+  }
+
+  merge_stats(scratch, total);
+  return next;
+}
+
+void SkyRatioChecker::evaluate_range(const SceneRaycaster& scene, const std::vector<Vec3>& points, size_t first, size_t last, int threads, std::vector<Scratch>& scratch, float* results, int16_t* profiles) const {
+  const size_t phi = direction_table.phi_steps;
+  auto profile     = [&](size_t i) { return profiles ? profiles + (i - first) * phi : nullptr; };
+  // BVHは読み取り専用なので全スレッドで共有する
+  if(!scene.has_geometry()) {
+    std::fill(results, results + (last - first), 1.0f);
+    if(profiles) std::fill(profiles, profiles + (last - first) * phi, int16_t{-1});
+  } else if(far_field_culling != FarFieldCulling::Off) {
+    check_regions(scene, points, first, last, threads, scratch, results, profiles);
+  } else if(horizon_search == HorizonSearch::Guided) {
+    // 固定のブロックごとに順番に評価し、直前の測定点の結果を次の測定点の初期値にする
+    const size_t first_block = first / GUIDED_BLOCK;
+    const size_t blocks      = (last + GUIDED_BLOCK - 1) / GUIDED_BLOCK - first_block;
+    parallel_for(blocks, threads, 1, [&](size_t begin, size_t end, int tid) {
+      for(size_t b = first_block + begin; b < first_block + end; b++) {
+        scratch[tid].has_guess = false;
+        for(size_t i = std::max(b * GUIDED_BLOCK, first); i < std::min((b + 1) * GUIDED_BLOCK, last); i++) results[i - first] = evaluate_checkpoint(scene, points[i], scratch[tid], profile(i));
+      }
+    });
+  } else {
+    parallel_for(last - first, threads, CHECKPOINT_GRAIN, [&](size_t begin, size_t end, int tid) {
+      for(size_t i = first + begin; i < first + end; i++) results[i - first] = evaluate_checkpoint(scene, points[i], scratch[tid], profile(i));
+    });
+  }
+}
+
+void SkyRatioChecker::check_regions(const SceneRaycaster& scene, const std::vector<Vec3>& points, size_t first, size_t last, int threads, std::vector<Scratch>& scratch, float* results, int16_t* profiles) const {
+  if(!(culling_region_size > 0.0)) throw std::invalid_argument("Culling region size must be positive");
+
+  // 測定点を xy 平面の正方形の領域ごとに分ける（領域内は元の順番のまま）
+  std::map<std::pair<int64_t, int64_t>, std::vector<size_t>> cells;
+  for(size_t i = first; i < last; i++) {
+    const auto key = std::make_pair(static_cast<int64_t>(std::floor(points[i][0] / culling_region_size)), static_cast<int64_t>(std::floor(points[i][1] / culling_region_size)));
+    cells[key].push_back(i);
+  }
+  std::vector<const std::vector<size_t>*> regions;
+  for(const auto& cell : cells) regions.push_back(&cell.second);
+
+  CullOptions options;
+  options.min_elevation_deg = THETA_MIN_DEG;
+  if(far_field_culling != FarFieldCulling::Exact) options.min_angular_size_deg = ray_resolution;
+  options.merge_small = far_field_culling == FarFieldCulling::Merge;
+
+  // 領域ごとに小さなシーンを作って評価する（シーンはスレッドごとに1つずつ作っては捨てる）
+  const int workers = std::min<int>(threads, static_cast<int>(regions.size()));
+  parallel_for(regions.size(), workers, 1, [&](size_t begin, size_t end, int tid) {
+    for(size_t r = begin; r < end; r++) {
+      const auto& ids = *regions[r];
+      Vec3 lo = points[ids[0]], hi = points[ids[0]];
+      for(size_t i : ids) {
+        for(int k = 0; k < 3; k++) {
+          lo[k] = std::min(lo[k], points[i][k]);
+          hi[k] = std::max(hi[k], points[i][k]);
+        }
+      }
+      StageTimer timer(scratch_stats(scratch[tid]));
+      SceneRaycaster local = scene.extract_region(lo, hi, options);
+      // 領域ごとに並列に作るので、1つの領域のシーンは1スレッドで構築する
+      BuildOptions build_options = local.get_build_options();
+      build_options.threads      = 1;
+      local.set_build_options(build_options);
+      local.build();
+      timer.lap(&QueryStats::build_seconds);
+      scratch[tid].stats.builds++;
+
+      const size_t phi = direction_table.phi_steps;
+      for(size_t n = 0; n < ids.size(); n++) {
+        int16_t* profile = profiles ? profiles + (ids[n] - first) * phi : nullptr;
+        if(!local.has_geometry()) {
+          results[ids[n] - first] = 1.0f;
+          if(profile) std::fill(profile, profile + phi, int16_t{-1});
+          continue;
+        }
+        // Guidedは領域の先頭と一定数ごとにDescendで求め直す
+        if(n % GUIDED_BLOCK == 0) scratch[tid].has_guess = false;
+        results[ids[n] - first] = evaluate_checkpoint(local, points[ids[n]], scratch[tid], profile);
+      }
+    }
+  });
+}
+
+HorizonProfiles SkyRatioChecker::check_horizons(SceneRaycaster* raycaster) {
+  if(raycaster == nullptr) {
+    printf("[ERROR] SkyRatioChecker: SceneRaycaster is not set.\n");
+    return {};
+  }
+
+  last_stats = {};
+  StageTimer total(collect_stats ? &last_stats : nullptr);
+  StageTimer timer(collect_stats ? &last_stats : nullptr);
+
+  if(ray_resolution <= 0.0f || ray_resolution > 180.0f) ray_resolution = 1.0f;
+  const auto& table = update_direction_table();
+  if(table.theta_steps > std::numeric_limits<int16_t>::max()) throw std::invalid_argument("Ray resolution is too fine for horizon profiles");
+  timer.lap(&QueryStats::setup_seconds);
+  raycaster->build(collect_stats ? &last_stats : nullptr);
+  timer.lap(nullptr);
+
+  HorizonProfiles profiles;
+  profiles.resolution  = table.resolution;
+  profiles.theta_steps = table.theta_steps;
+  profiles.phi_steps   = table.phi_steps;
+  profiles.horizon.resize(checkpoints.size() * table.phi_steps);
+  evaluate_all(*raycaster, checkpoints, total, profiles.horizon.data());
+  return profiles;
+}
 
-  raycaster->build();
-  if(raycaster->vertices.empty() || raycaster->indices.empty()) {
-    printf("[WARNING] SkyRatioChecker: SceneRaycaster has no geometry.\n");
-    return {1};
+std::vector<float> SkyRatioChecker::integrate_horizons(const HorizonProfiles& profiles, bool safe_side, double azimuth_from_deg, double azimuth_to_deg) const {
+  const size_t phi = profiles.phi_steps;
+  if(profiles.phi_steps <= 0 || profiles.theta_steps < 0 || profiles.horizon.size() % phi != 0) throw std::invalid_argument("Invalid horizon profiles");
+  for(int16_t h : profiles.horizon) {
+    if(h < -1 || h > profiles.theta_steps) throw std::out_of_range("Horizon index out of range");
   }
+  const auto cos_lut = make_visible_cos(profiles.resolution, profiles.theta_steps, safe_side);
 
-  for(const auto& checkpoint : checkpoints) {
-    auto rays = generate_rays_from_checkpoint(checkpoint);
+  // 方位角の範囲に中央が入る区間 [p, p + 1] だけを足す（全周なら check と同じ式で積分する）
+  const bool full_circle = azimuth_to_deg - azimuth_from_deg >= 360.0;
+  std::vector<size_t> sector;
+  if(!full_circle) {
+    double width = std::fmod(azimuth_to_deg - azimuth_from_deg, 360.0);
+    if(width < 0.0) width += 360.0;
+    for(size_t p = 0; p < phi; p++) {
+      double offset = std::fmod((p + 0.5) * 360.0 / phi - azimuth_from_deg, 360.0);
+      if(offset < 0.0) offset += 360.0;
+      if(offset < width) sector.push_back(p);
+    }
+    if(sector.empty()) throw std::invalid_argument("Azimuth sector contains no azimuth steps");
+  }
 
-    // レイの原点と方向を分離
-    std::vector<Vec3> origins, directions;
-    origins.reserve(rays.size());
-    directions.reserve(rays.size());
+  std::vector<float> results(profiles.size());
+  const int threads = std::min<int>(resolve_thread_count(num_threads), static_cast<int>((results.size() + MASK_GRAIN - 1) / MASK_GRAIN));
+  parallel_for(results.size(), threads, MASK_GRAIN, [&](size_t begin, size_t end, int) {
+    std::vector<double> c(phi);
+    for(size_t i = begin; i < end; i++) {
+      const int16_t* horizon = &profiles.horizon[i * phi];
+      for(size_t p = 0; p < phi; p++) c[p] = cos_lut[horizon[p] + 1];
+      if(full_circle) {
+        results[i] = integrate_visible_cos(c);
+        continue;
+      }
+      double sky_area = 0.0;
+      for(size_t p : sector) sky_area += c[p] * c[(p + 1) % phi];
+      results[i] = static_cast<float>(std::min(std::max(sky_area / sector.size(), 0.0), 1.0));
+    }
+  });
+  return results;
+}
 
-    for(const auto& ray : rays) {
-      origins.push_back(std::get<0>(ray));
-      directions.push_back(std::get<1>(ray));
+std::vector<std::vector<float>> SkyRatioChecker::check_scenes(const std::vector<SceneRaycaster*>& scenes) {
+  for(auto* scene : scenes) {
+    if(scene == nullptr) {
+      printf("[ERROR] SkyRatioChecker: SceneRaycaster is not set.\n");
+      return {};
     }
+  }
 
-    const auto hit_results    = raycaster->raycast(origins, directions);
-    const auto resolution_rad = ray_resolution * M_PI / 180.0;
-    const int phi_steps       = std::max((int)(360.0 / ray_resolution), 1);
-    const int theta_steps     = static_cast<int>((THETA_MAX_DEG - THETA_MIN_DEG) / ray_resolution);
+  last_stats = {};
+  StageTimer total(collect_stats ? &last_stats : nullptr);
+  StageTimer timer(collect_stats ? &last_stats : nullptr);
 
-    if((theta_steps + 1) * phi_steps != (int)hit_results.size()) {
-      printf("[ERROR] SkyRatioChecker: Raycast result size mismatch. Expected %d, got %zu\n", //
-             (theta_steps + 1) * phi_steps, hit_results.size());
-      results.push_back(-1.0f);
-      continue;
+  if(ray_resolution <= 0.0f || ray_resolution > 180.0f) ray_resolution = 1.0f;
+  update_direction_table();
+  timer.lap(&QueryStats::setup_seconds);
+  for(auto* scene : scenes) scene->build(collect_stats ? &last_stats : nullptr);
+  timer.lap(nullptr);
+
+  // 形状のないシーンは全天が見える
+  std::vector<std::vector<float>> results(scenes.size(), std::vector<float>(checkpoints.size(), 1.0f));
+  const size_t blocks = (checkpoints.size() + GUIDED_BLOCK - 1) / GUIDED_BLOCK;
+  const int threads   = std::min<int>(resolve_thread_count(num_threads), static_cast<int>(blocks));
+  // 作業領域はスレッドとシーンの組ごと（Guidedの初期値がシーン間で混ざらないように）
+  std::vector<Scratch> scratch(std::max(threads, 1) * std::max<size_t>(scenes.size(), 1));
+  if(far_field_culling != FarFieldCulling::Off) {
+    // 領域ごとのシーンはシーンごとに切り出すので、シーンを1つずつ check と同じ方法で評価する
+    for(size_t v = 0; v < scenes.size(); v++) evaluate_range(*scenes[v], checkpoints, 0, checkpoints.size(), threads, scratch, results[v].data());
+    merge_stats(scratch, total);
+    return results;
+  }
+  parallel_for(blocks, threads, 1, [&](size_t begin, size_t end, int tid) {
+    for(size_t b = begin; b < end; b++) {
+      const size_t first = b * GUIDED_BLOCK, last = std::min(first + GUIDED_BLOCK, checkpoints.size());
+      // ブロック内ではシーンごとにまとめて評価し、同じBVHを続けて使う
+      for(size_t v = 0; v < scenes.size(); v++) {
+        if(!scenes[v]->has_geometry()) continue;
+        Scratch& s  = scratch[tid * scenes.size() + v];
+        s.has_guess = false;
+        for(size_t i = first; i < last; i++) results[v][i] = evaluate_checkpoint(*scenes[v], checkpoints[i], s);
+      }
     }
+  });
+  merge_stats(scratch, total);
+  return results;
+}
 
-    // 各方位角(phi)における、空が見える最小天頂角を格納する配列
-    std::vector<double> visible_theta(phi_steps, 0.0);
+std::vector<std::vector<float>> SkyRatioChecker::check_overlays(SceneRaycaster* base, const std::vector<SceneRaycaster*>& overlays) {
+  if(base == nullptr) {
+    printf("[ERROR] SkyRatioChecker: SceneRaycaster is not set.\n");
+    return {};
+  }
+  for(auto* overlay : overlays) {
+    if(overlay == nullptr) {
+      printf("[ERROR] SkyRatioChecker: SceneRaycaster is not set.\n");
+      return {};
+    }
+  }
 
-    for(int p = 0; p < phi_steps; p++) {
-      // この方位角での最大遮蔽角度（空が見え始める角度）
-      double max_blocked_theta = 0.0;
-
-      for(int t = 0; t <= theta_steps; t++) {
-        int ray_index = t * phi_steps + p;
-        if(!hit_results[ray_index].hit) continue;
-        // 建物にヒット → この角度では空が見えない
-        double blocked_theta = (THETA_MIN_DEG + ray_resolution * t) * M_PI / 180.0;
-
-        // 安全側評価の適用
-        if(use_safe_side) {
-          blocked_theta += resolution_rad; // 内接近似：建物を大きく見積もる（空を小さく見積もる）
+  last_stats = {};
+  StageTimer total(collect_stats ? &last_stats : nullptr);
+  StageTimer timer(collect_stats ? &last_stats : nullptr);
+
+  if(ray_resolution <= 0.0f || ray_resolution > 180.0f) ray_resolution = 1.0f;
+  update_direction_table();
+  timer.lap(&QueryStats::setup_seconds);
+  base->build(collect_stats ? &last_stats : nullptr);
+  for(auto* overlay : overlays) overlay->build(collect_stats ? &last_stats : nullptr);
+  timer.lap(nullptr);
+
+  const auto& dirs = direction_table.directions;
+  std::vector<std::vector<float>> results(overlays.size(), std::vector<float>(checkpoints.size(), 0.0f));
+  const int threads = std::min<int>(resolve_thread_count(num_threads), static_cast<int>((checkpoints.size() + CHECKPOINT_GRAIN - 1) / CHECKPOINT_GRAIN));
+  std::vector<Scratch> scratch(std::max(threads, 1));
+  parallel_for(checkpoints.size(), threads, CHECKPOINT_GRAIN, [&](size_t begin, size_t end, int tid) {
+    Scratch& s = scratch[tid];
+    for(size_t i = begin; i < end; i++) {
+      if(base->has_geometry()) {
+        if(use_packet_occlusion) {
+          base->occluded_packets(checkpoints[i], dirs, s.base_occlusion, s.context, scratch_stats(s));
         } else {
-          blocked_theta -= resolution_rad; // 外接近似：建物を小さく見積もる（空を大きく見積もる）
+          base->occluded(checkpoints[i], dirs, s.base_occlusion, scratch_stats(s));
         }
-        if(blocked_theta > M_PI / 2.0) blocked_theta = M_PI / 2.0;
-        max_blocked_theta = std::max(max_blocked_theta, blocked_theta);
+      } else {
+        s.base_occlusion.assign((dirs.size() + 63) / 64, 0);
+      }
+      for(size_t v = 0; v < overlays.size(); v++) {
+        s.occlusion = s.base_occlusion;
+        if(overlays[v]->has_geometry()) overlays[v]->accumulate_occlusion(checkpoints[i], dirs, s.occlusion, scratch_stats(s));
+        StageTimer timer(scratch_stats(s));
+        horizon_from_mask(s.occlusion, s);
+        results[v][i] = integrate_horizon(s);
+        timer.lap(&QueryStats::integration_seconds);
+        s.stats.checkpoints++;
       }
-      visible_theta[p] = max_blocked_theta;
     }
+  });
+  merge_stats(scratch, total);
+  return results;
+}
 
-    // 三斜求積法による面積計算
-    double sky_area = 0.0;
-    for(int p = 0; p < phi_steps; p++) {
-      // 2つの隣接する方位角での空が見える開始角度（遮蔽終了角度）
-      double theta1       = visible_theta[p];
-      double theta2       = visible_theta[(p + 1) % phi_steps];
-      double segment_area = std::cos(theta1) * std::cos(theta2);
-      sky_area += segment_area;
+std::vector<std::vector<float>> SkyRatioChecker::ratio_differences(const std::vector<std::vector<float>>& ratios) {
+  std::vector<std::vector<float>> differences(ratios.size());
+  for(size_t v = 0; v < ratios.size(); v++) {
+    differences[v].resize(ratios[v].size());
+    for(size_t i = 0; i < ratios[v].size(); i++) differences[v][i] = ratios[v][i] - ratios[0][i];
+  }
+  return differences;
+}
+
+const DirectionSet& SkyRatioChecker::ray_directions() {
+  if(ray_resolution <= 0.0f || ray_resolution > 180.0f) ray_resolution = 1.0f;
+  return update_direction_table().directions;
+}
+
+std::vector<float> SkyRatioChecker::reduce_occlusion(const std::vector<OcclusionMask>& masks) {
+  last_stats = {};
+  StageTimer total(collect_stats ? &last_stats : nullptr);
+  StageTimer timer(collect_stats ? &last_stats : nullptr);
+  const size_t words = (ray_directions().size() + 63) / 64;
+  timer.lap(&QueryStats::setup_seconds);
+  for(const auto& mask : masks) {
+    if(mask.size() < words) throw std::invalid_argument("Occlusion mask is smaller than the direction table");
+  }
+
+  std::vector<float> results(masks.size(), 0.0f);
+  const int threads = std::min<int>(resolve_thread_count(num_threads), static_cast<int>((masks.size() + MASK_GRAIN - 1) / MASK_GRAIN));
+  std::vector<Scratch> scratch(std::max(threads, 1));
+  parallel_for(masks.size(), threads, MASK_GRAIN, [&](size_t begin, size_t end, int tid) {
+    StageTimer timer(scratch_stats(scratch[tid]));
+    for(size_t i = begin; i < end; i++) {
+      horizon_from_mask(masks[i], scratch[tid]);
+      results[i] = integrate_horizon(scratch[tid]);
     }
+    timer.lap(&QueryStats::integration_seconds);
+    scratch[tid].stats.checkpoints += end - begin;
+  });
+  merge_stats(scratch, total);
+  return results;
+}
 
-    float sky_ratio = sky_area / phi_steps;
+namespace {
+// n x n の格子（n は2の累乗）上の (x, y) のヒルベルト曲線上の位置
+uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+  uint64_t d = 0;
+  for(uint32_t s = n / 2; s > 0; s /= 2) {
+    const uint32_t rx = (x & s) > 0;
+    const uint32_t ry = (y & s) > 0;
+    d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+    // 部分格子の向きをそろえる
+    if(ry == 0) {
+      if(rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
 
-    // 範囲制限
-    if(sky_ratio < 0.0f) sky_ratio = 0.0f;
-    if(sky_ratio > 1.0f) sky_ratio = 1.0f;
+// 偶奇規則による点の内外判定
+bool inside_polygon(const std::vector<Vec2>& polygon, double x, double y) {
+  bool inside = false;
+  for(size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+    const Vec2& a = polygon[i];
+    const Vec2& b = polygon[j];
+    if((a[1] > y) != (b[1] > y) && x < (b[0] - a[0]) * (y - a[1]) / (b[1] - a[1]) + a[0]) inside = !inside;
+  }
+  return inside;
+}
+} // namespace
+
+size_t SkyRatioChecker::set_grid_checkpoints(const std::vector<Vec2>& polygon, double spacing, double height) {
+  if(!(spacing > 0.0)) throw std::invalid_argument("Grid spacing must be positive");
+  if(polygon.size() < 3) throw std::invalid_argument("Polygon needs at least 3 vertices");
 
-    results.push_back(sky_ratio);
+  Vec2 lo = polygon[0], hi = polygon[0];
+  for(const auto& v : polygon) {
+    lo = {std::min(lo[0], v[0]), std::min(lo[1], v[1])};
+    hi = {std::max(hi[0], v[0]), std::max(hi[1], v[1])};
   }
+  const double nx = std::ceil((hi[0] - lo[0]) / spacing);
+  const double ny = std::ceil((hi[1] - lo[1]) / spacing);
+  if(nx * ny > 1e9) throw std::length_error("Grid has too many points");
+  const uint32_t cols = static_cast<uint32_t>(std::max(nx, 1.0));
+  const uint32_t rows = static_cast<uint32_t>(std::max(ny, 1.0));
 
-  return results;
+  uint32_t n = 1;
+  while(n < std::max(cols, rows)) n *= 2;
+
+  // 内側のセルをヒルベルト曲線の順に並べる
+  std::vector<std::pair<uint64_t, Vec3>> cells;
+  for(uint32_t j = 0; j < rows; j++) {
+    const double y = lo[1] + (j + 0.5) * spacing;
+    for(uint32_t i = 0; i < cols; i++) {
+      const double x = lo[0] + (i + 0.5) * spacing;
+      if(inside_polygon(polygon, x, y)) cells.push_back({hilbert_index(n, i, j), Vec3{x, y, height}});
+    }
+  }
+  std::sort(cells.begin(), cells.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  checkpoints.clear();
+  checkpoints.reserve(cells.size());
+  for(const auto& cell : cells) checkpoints.push_back(cell.second);
+  return checkpoints.size();
+}
+
+size_t SkyRatioChecker::set_polyline_checkpoints(const std::vector<Vec2>& polyline, double spacing, double height) {
+  if(!(spacing > 0.0)) throw std::invalid_argument("Polyline spacing must be positive");
+  if(polyline.size() < 2) throw std::invalid_argument("Polyline needs at least 2 vertices");
+
+  checkpoints.clear();
+  checkpoints.push_back({polyline[0][0], polyline[0][1], height});
+  // next は現在の線分の始点から次の測定点までの距離
+  double next = spacing;
+  for(size_t i = 0; i + 1 < polyline.size(); i++) {
+    const Vec2& a       = polyline[i];
+    const Vec2& b       = polyline[i + 1];
+    const double length = std::hypot(b[0] - a[0], b[1] - a[1]);
+    for(; next <= length; next += spacing) {
+      const double t = next / length;
+      checkpoints.push_back({a[0] + (b[0] - a[0]) * t, a[1] + (b[1] - a[1]) * t, height});
+    }
+    next -= length;
+  }
+  // 終点が間隔の途中にあれば追加する（直前の点とほぼ重なるなら追加しない）
+  if(next < spacing * (1.0 - 1e-9)) checkpoints.push_back({polyline.back()[0], polyline.back()[1], height});
+  return checkpoints.size();
 }
@@ -1,18 +1,174 @@
 #pragma once
 
 #include "scene_raycaster.hpp"
-#include <tuple>
+#include <array>
+#include <functional>
+#include <string>
 #include <vector>
 
+using Vec2 = std::array<double, 2>;
+
+// 方位角ごとの遮蔽境界（ホライズン）の求め方
+enum class HorizonSearch {
+  Sweep,      // 全天頂角にレイを飛ばす
+  Descend,    // 天頂側から下向きに飛ばし、最初に遮られた所で打ち切る（Sweepと同じ結果）
+  Bisection,  // 二分探索（方位角ごとに遮蔽が下から連続している前提の近似）
+  Guided,     // 直前の測定点のホライズンから上下に探索する（Bisectionと同じ前提の近似。近い測定点が続く格子向き）
+  Projection, // レイを飛ばさずに形状を投影する（方位角は ray_resolution で刻むが、仰角は刻みによらず正確。use_safe_side は使わない）
+};
+
+// 測定点の領域ごとに、結果に影響しない遠くの形状を除いた小さなシーンで計算する
+enum class FarFieldCulling {
+  Off,   // シーン全体のBVHをそのまま使う
+  Exact, // 仰角の下限以上のレイが届かない形状だけを除く（結果は変わらない）
+  Prune, // さらに見かけの大きさが ray_resolution 未満の形状を除く（近似）
+  Merge, // 見かけの大きさが ray_resolution 未満の形状を近くのものごとに箱へまとめる（遮蔽を大きく見積もる近似）
+};
+
+// check_stream に渡す、評価の終わった連続する測定点の結果
+struct CheckChunk {
+  size_t first        = 0;       // 先頭の測定点の番号
+  size_t count        = 0;       // 測定点の数
+  const float* ratios = nullptr; // 天空率（count 個。コールバックの中でのみ有効）
+  size_t total        = 0;       // 測定点の総数（first + count が進捗）
+};
+
+// check_horizons の結果。測定点ごとに、方位角ごとの遮蔽境界を天空率の計算と同じ仰角の刻みで量子化して持つ
+struct HorizonProfiles {
+  float resolution = 0.0f; // 作成時の ray_resolution（仰角は 20 + t * resolution 度、方位角は 360 * p / phi_steps 度）
+  int theta_steps  = 0;
+  int phi_steps    = 0;
+  std::vector<int16_t> horizon; // [測定点 * phi_steps + p] 遮られた最も高い仰角のインデックス t（遮蔽がなければ-1）
+
+  size_t size() const { return phi_steps > 0 ? horizon.size() / phi_steps : 0; }
+};
+
 class SkyRatioChecker {
 private:
-  std::vector<std::tuple<Vec3, Vec3>> generate_rays_from_checkpoint(const Vec3& checkpoint);
+  // 半球上のレイ方向表。方向は ray_resolution だけで決まるので全測定点で共有する
+  // 並びは天頂角ごと (t * phi_steps + p)
+  struct DirectionTable {
+    float resolution = 0.0f; // 作成時の ray_resolution（0なら未作成）
+    int theta_steps  = 0;
+    int phi_steps    = 0;
+    DirectionSet directions;
+    // 遮蔽インデックス h（-1..theta_steps）ごとの cos(空が見え始める天頂角)。添字は h + 1、[0] は外接近似、[1] は安全側評価
+    std::vector<double> visible_cos[2];
+  };
+
+  // Descend / Bisection / Guided の方位角ごとの探索の状態。lo は遮られている（-1は地面側）、hi は遮られていない（theta_steps+1は天頂側）天頂角インデックス
+  struct ColumnSearch {
+    enum class Phase : uint8_t { Guess, Up, Down, Bisect }; // Guided の段階（直前の推定を試す、上へ広げる、下へ広げる、二分探索）
+    int lo      = -1;
+    int hi      = 0;
+    int step    = 1; // Guided で範囲を広げる幅
+    Phase phase = Phase::Guess;
+  };
+
+  // スレッドごとに使い回す作業領域
+  struct Scratch {
+    QueryContext context; // レイとパケットの作業バッファ
+    std::vector<HitResult> hit_results;
+    OcclusionMask occlusion;
+    OcclusionMask base_occlusion; // check_overlays で共通のシーンの遮蔽を測定点ごとに一度だけ求めて使い回す
+    std::vector<int> horizon;     // 方位角ごとの最も高い遮蔽レイの天頂角インデックス（なければ-1）
+    std::vector<uint64_t> pending; // まだ遮蔽が見つかっていない方位角のビットマスク
+    std::vector<double> visible_cos;
+    std::vector<double> tan_horizon;  // 方位角ごとの遮蔽の最大仰角の正接（Projection用）
+    bool has_guess = false;           // horizon に直前の測定点の結果が入っているか（Guided用）
+    std::vector<ColumnSearch> search; // 方位角ごとの探索の状態（Descend / Bisection / Guided用）
+    std::vector<int> columns;         // 探索が終わっていない方位角
+    std::vector<uint32_t> probes;     // columns の次のレイの方向表の添字（まとめて遮蔽判定する）
+    QueryStats stats;                 // collect_stats が有効なときのこのスレッドの計測
+  };
+
+  DirectionTable direction_table;
+  QueryStats last_stats;
+
+  const DirectionTable& update_direction_table();
+  void horizon_from_mask(const OcclusionMask& mask, Scratch& scratch) const;
+  float integrate_horizon(Scratch& scratch) const;
+  float integrate_projection(Scratch& scratch) const;
+  void find_horizon_sweep(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const;
+  // 探索が終わっていない全ての方位角の次のレイを1本ずつまとめて遮蔽判定しながら、方位角ごとの探索を進める
+  // next(search) は次に飛ばす天頂角インデックス（終わっていれば負）を返し、update(search, t, hit) が結果を受け取る
+  template <class Next, class Update> void probe_columns(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch, Next&& next, Update&& update) const;
+  void find_horizon_descend(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const;
+  void find_horizon_bisection(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const;
+  void find_horizon_guided(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const;
+  void find_horizon_projection(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const;
+  // profile を渡すと、量子化したホライズン（phi_steps 個）も書き込む
+  float evaluate_checkpoint(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch, int16_t* profile = nullptr) const;
+  void store_profile(const Scratch& scratch, int16_t* profile) const;
+  // 測定点 points[first, last) を評価して results[i - first] に書き込む（profiles を渡すとホライズンも profiles[(i - first) * phi_steps ...] に書き込む）
+  void evaluate_range(const SceneRaycaster& scene, const std::vector<Vec3>& points, size_t first, size_t last, int threads, std::vector<Scratch>& scratch, float* results, int16_t* profiles = nullptr) const;
+  void check_regions(const SceneRaycaster& scene, const std::vector<Vec3>& points, size_t first, size_t last, int threads, std::vector<Scratch>& scratch, float* results, int16_t* profiles) const;
+  QueryStats* scratch_stats(Scratch& scratch) const { return collect_stats ? &scratch.stats : nullptr; }
+  void merge_stats(const std::vector<Scratch>& scratch, StageTimer& total);
+  // points を全て評価する（check の本体。profiles を渡すとホライズンも書き込む）
+  std::vector<float> evaluate_all(const SceneRaycaster& scene, const std::vector<Vec3>& points, StageTimer& total, int16_t* profiles = nullptr);
+  // result_cache_path のキャッシュにない測定点だけを評価し、キャッシュを更新する
+  std::vector<float> check_cached(const SceneRaycaster& scene, StageTimer& total);
+  // 結果キャッシュのキーにする、結果に影響する設定のハッシュ
+  uint64_t settings_hash() const;
 
 public:
   std::vector<Vec3> checkpoints;
-  float ray_resolution = 1.0f;
-  bool use_safe_side   = false; // 安全側評価（内接近似）を使うかどうか
+  float ray_resolution     = 1.0f;
+  bool use_safe_side       = false; // 安全側評価（内接近似）を使うかどうか
+  int num_threads          = 0;     // 並列実行するスレッド数（0以下なら論理コア数）
+  bool use_occlusion_query = true;  // 遮蔽判定のみのクエリを使うかどうか（falseなら最近接ヒットを求める。Sweepのみ）
+  // 遮蔽判定を Intersect256Rays のパケットで行うかどうか（Sweep と check_overlays の共通のシーンのみ。falseなら1本ずつ早期打ち切りの遮蔽判定をする）
+  // パケットは最近接ヒットを求める走査なので早期打ち切りがなく、速くなるかはシーンによる（skyratio_benchmark の check_packet_occlusion で比べられる）
+  bool use_packet_occlusion = false;
+  HorizonSearch horizon_search = HorizonSearch::Sweep;
+  float horizon_tolerance      = 0.0f; // Bisectionで探索を打ち切る角度幅(度)。0なら刻み幅まで探索
+  FarFieldCulling far_field_culling = FarFieldCulling::Off;
+  double culling_region_size        = 50.0; // 測定点をまとめる領域（xy平面の正方形）の一辺
+  bool collect_stats                = false; // 段階ごとの時間とカウンタを集計するかどうか（結果は stats()）
+  // 空でなければ check の結果をこのファイルにキャッシュし、シーンの内容と設定が同じ測定点は評価し直さない
+  // シーンを部分的に変更した場合は、変わった形状が仰角の下限以上に見えうる測定点だけを評価し直す
+  // 複数のプロセスが同じファイルに同時に書き出すと最後に書いたものが残る（他のプロセスが追加した測定点は失われる）
+  std::string result_cache_path;
+
+  // 直前の check / check_scenes / check_overlays / reduce_occlusion の計測（collect_stats が有効な場合のみ）
+  const QueryStats& stats() const { return last_stats; }
 
   void set_scene(SceneRaycaster scene);
   std::vector<float> check(SceneRaycaster *raycaster);
+
+  // false を返すと残りの測定点を評価せずに check_stream を終える
+  using ChunkCallback = std::function<bool(const CheckChunk& chunk)>;
+  // 測定点 start 以降をおよそ chunk_size 個ずつ順番に評価し、チャンクごとに呼び出したスレッドで callback を呼ぶ
+  // 評価の終わった次の測定点の番号を返す（中断した場合は、この値を start に渡せば続きから再開できる）
+  // 結果は check と同じ。ただし far_field_culling を使う場合（領域をチャンクごとに作る）と、Guided で start が64の倍数でない場合
+  // （最初の測定点から探索し直す）は、近似の結果がわずかに異なることがある
+  size_t check_stream(SceneRaycaster* raycaster, const ChunkCallback& callback, size_t start = 0, size_t chunk_size = 1024);
+
+  // 多角形（xy平面、閉じていなくてよい）の内側に spacing 間隔の格子を取り、高さ height の測定点にする
+  // 格子点はセルの中心で、近い点が続くようにヒルベルト曲線の順に並べる。測定点の数を返す
+  size_t set_grid_checkpoints(const std::vector<Vec2>& polygon, double spacing, double height);
+  // 折れ線（xy平面）に沿って始点から spacing 間隔で測定点を置く（終点も含む）。測定点の数を返す
+  size_t set_polyline_checkpoints(const std::vector<Vec2>& polyline, double spacing, double height);
+
+  // 同じ測定点を複数のシーンでまとめて評価する（方向表とスレッドの割り振りを共有する）。戻り値は [シーン][測定点]
+  // far_field_culling を使う場合は、シーンごとに領域のシーンを切り出して check と同じ結果にする。result_cache_path は使わない
+  std::vector<std::vector<float>> check_scenes(const std::vector<SceneRaycaster*>& scenes);
+  // 共通の base に各 overlay を重ねたシーン（どちらかで遮られれば遮蔽）をまとめて評価する。戻り値は [overlay][測定点]
+  // base の遮蔽は測定点ごとに一度だけ求め、overlay は base で遮られなかったレイだけを飛ばす（horizon_search によらず全方向を使う）
+  // far_field_culling と result_cache_path は使わない
+  std::vector<std::vector<float>> check_overlays(SceneRaycaster* base, const std::vector<SceneRaycaster*>& overlays);
+  // 全測定点のホライズンを求める（レイの飛ばし方は check と同じ。Bisection の未確定の範囲は use_safe_side に従う）
+  HorizonProfiles check_horizons(SceneRaycaster* raycaster);
+  // ホライズンから天空率を求め直す（レイを飛ばさない）。safe_side で安全側評価・外接近似を選ぶ
+  // 方位角 [azimuth_from_deg, azimuth_to_deg)（度、x軸から反時計回り。360度をまたいでよい）を指定すると、その範囲だけの天空率にする
+  // 全周なら check と同じ値になる
+  std::vector<float> integrate_horizons(const HorizonProfiles& profiles, bool safe_side, double azimuth_from_deg = 0.0, double azimuth_to_deg = 360.0) const;
+  // 各行と先頭の行の差（ratios[v][i] - ratios[0][i]）
+  static std::vector<std::vector<float>> ratio_differences(const std::vector<std::vector<float>>& ratios);
+
+  // 天空率の計算に使うレイの方向（並びは天頂角ごと t * phi_steps + p）
+  const DirectionSet& ray_directions();
+  // ray_directions() の並びで作った測定点ごとの遮蔽マスクから、まとめて天空率を求める
+  std::vector<float> reduce_occlusion(const std::vector<OcclusionMask>& masks);
 };
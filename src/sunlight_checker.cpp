@@ -0,0 +1,161 @@
+#include "sunlight_checker.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// 1スレッドが一度に取り出す測定点の数
+constexpr size_t CHECKPOINT_GRAIN = 4;
+// 1日の時刻の刻みの上限（刻みが細かすぎる設定で方向表が膨らまないように）
+constexpr double MAX_STEPS_PER_DAY = 24.0 * 60.0;
+// 1つのパケットにまとめる時刻の幅の上限[h]（太陽の方位角が大きく変わり、視錐台が広がりすぎないように）
+constexpr double PACKET_SPAN_HOURS = 4.0;
+
+const SunlightChecker::SunTable& SunlightChecker::update_sun_table() {
+  const std::array<double, 8> key = {latitude_deg, static_cast<double>(first_day), static_cast<double>(last_day), start_hour, end_hour, time_step_minutes, north_azimuth_deg, use_packets ? 1.0 : 0.0};
+  if(sun_table.valid && sun_table.key == key) return sun_table;
+
+  if(!(latitude_deg >= -90.0 && latitude_deg <= 90.0)) throw std::invalid_argument("Latitude must be between -90 and 90 degrees");
+  if(first_day < 1 || last_day > 366 || first_day > last_day) throw std::invalid_argument("Day range must satisfy 1 <= first_day <= last_day <= 366");
+  if(!(start_hour >= 0.0 && end_hour <= 24.0 && start_hour < end_hour)) throw std::invalid_argument("Hour range must satisfy 0 <= start_hour < end_hour <= 24");
+  if(!(time_step_minutes > 0.0)) throw std::invalid_argument("Time step must be positive");
+  const double step_hours = time_step_minutes / 60.0;
+  if((end_hour - start_hour) / step_hours > MAX_STEPS_PER_DAY) throw std::invalid_argument("Time step is too fine");
+
+  // 区間 [start + k * step, start + (k + 1) * step) の中央の時刻で代表させる（最後の区間は end_hour で切る）
+  const int steps = static_cast<int>(std::ceil((end_hour - start_hour) / step_hours - 1e-9));
+  const int days  = last_day - first_day + 1;
+  std::vector<double> sample_hour(steps), sample_weight(steps);
+  for(int k = 0; k < steps; k++) {
+    const double t0  = start_hour + k * step_hours;
+    const double t1  = std::min(t0 + step_hours, end_hour);
+    sample_hour[k]   = 0.5 * (t0 + t1);
+    sample_weight[k] = t1 - t0;
+  }
+
+  // 局所座標（東・北・天頂）の方向をシーンの座標に直す
+  const double north = north_azimuth_deg * M_PI / 180.0;
+  const double nx = std::cos(north), ny = std::sin(north);
+  const double ex = ny, ey = -nx; // 北から時計回りに90度
+  const double phi     = latitude_deg * M_PI / 180.0;
+  const double sin_phi = std::sin(phi), cos_phi = std::cos(phi);
+
+  // [日 * steps + k] の太陽方向（天頂成分が0以下なら地平線より下）
+  std::vector<double> east(static_cast<size_t>(days) * steps), up(east.size()), to_north(east.size());
+  for(int d = 0; d < days; d++) {
+    // 赤緯（Cooperの式）
+    const double declination = 23.45 * M_PI / 180.0 * std::sin(2.0 * M_PI * (284 + first_day + d) / 365.0);
+    const double sin_dec = std::sin(declination), cos_dec = std::cos(declination);
+    for(int k = 0; k < steps; k++) {
+      const double hour_angle = (sample_hour[k] - 12.0) * 15.0 * M_PI / 180.0;
+      const size_t i          = static_cast<size_t>(d) * steps + k;
+      east[i]                 = -cos_dec * std::sin(hour_angle);
+      to_north[i]             = sin_dec * cos_phi - cos_dec * sin_phi * std::cos(hour_angle);
+      up[i]                   = sin_dec * sin_phi + cos_dec * cos_phi * std::cos(hour_angle);
+    }
+  }
+
+  // 全ての日で地平線より上にある時刻は日付 x 時刻の格子にしてパケットにまとめ、残りの方向は後ろに並べて1本ずつ走査する
+  std::vector<int> columns, partial;
+  for(int k = 0; k < steps; k++) {
+    bool all = true;
+    for(int d = 0; d < days && all; d++) all = up[static_cast<size_t>(d) * steps + k] > 0.0;
+    (all ? columns : partial).push_back(k);
+  }
+
+  SunTable table;
+  table.key  = key;
+  auto& dirs = table.directions;
+  auto push  = [&](int d, int k) {
+    const size_t i = static_cast<size_t>(d) * steps + k;
+    dirs.x.push_back(static_cast<float>(east[i] * ex + to_north[i] * nx));
+    dirs.y.push_back(static_cast<float>(east[i] * ey + to_north[i] * ny));
+    dirs.z.push_back(static_cast<float>(up[i]));
+    table.hours.push_back(static_cast<float>(sample_weight[k]));
+    table.possible_hours += sample_weight[k];
+  };
+  for(int d = 0; d < days; d++) {
+    for(int k : columns) push(d, k);
+  }
+  // 行は日付（太陽の高さがゆっくり変わる）、列は時刻（方位角が順に変わる）
+  // 列は全周の方位角ではないので、タイルは PACKET_SPAN_HOURS 分の時刻 x 収まるだけの日付にする
+  if(use_packets && !columns.empty()) dirs.plan_packets(days, static_cast<int>(columns.size()), std::max(1, static_cast<int>(PACKET_SPAN_HOURS / step_hours + 1e-9)));
+  for(int d = 0; d < days; d++) {
+    for(int k : partial) {
+      if(up[static_cast<size_t>(d) * steps + k] <= 0.0) continue;
+      if(!dirs.packets.empty()) dirs.packets.scalar.push_back(static_cast<uint32_t>(dirs.size()));
+      push(d, k);
+    }
+  }
+
+  table.valid = true;
+  sun_table   = std::move(table);
+  return sun_table;
+}
+
+float SunlightChecker::evaluate_checkpoint(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const {
+  const auto& table = sun_table;
+  QueryStats* stats = collect_stats ? &scratch.stats : nullptr;
+  // パケットの計画があれば Intersect256Rays でまとめて遮蔽判定する（作業バッファはスレッドごとに使い回す）
+  raycaster.occluded_packets(checkpoint, table.directions, scratch.occlusion, scratch.context, stats);
+  StageTimer timer(stats);
+  double hours = 0.0;
+  for(size_t i = 0; i < table.directions.size(); i++) {
+    if(!mask_test(scratch.occlusion, i)) hours += table.hours[i];
+  }
+  timer.lap(&QueryStats::integration_seconds);
+  scratch.stats.checkpoints++;
+  return static_cast<float>(hours);
+}
+
+std::vector<float> SunlightChecker::check(SceneRaycaster* raycaster) {
+  if(raycaster == nullptr) {
+    printf("[ERROR] SunlightChecker: SceneRaycaster is not set.\n");
+    return {};
+  }
+
+  last_stats = {};
+  StageTimer total(collect_stats ? &last_stats : nullptr);
+  StageTimer timer(collect_stats ? &last_stats : nullptr);
+  const auto& table = update_sun_table();
+  timer.lap(&QueryStats::setup_seconds);
+
+  // 変更がなければ何もしない（天空率の計算で構築したBVHをそのまま使う）
+  raycaster->build(collect_stats ? &last_stats : nullptr);
+  timer.lap(nullptr);
+
+  // 結果は測定点の順番どおりに格納する（スレッド数によらず同じ出力になる）
+  std::vector<float> results(checkpoints.size(), static_cast<float>(table.possible_hours));
+  if(!raycaster->has_geometry()) {
+    printf("[WARNING] SunlightChecker: SceneRaycaster has no geometry.\n");
+  } else if(table.directions.size() > 0) {
+    const int threads = std::min<int>(resolve_thread_count(num_threads), static_cast<int>((checkpoints.size() + CHECKPOINT_GRAIN - 1) / CHECKPOINT_GRAIN));
+    std::vector<Scratch> scratch(std::max(threads, 1));
+    // BVHは読み取り専用なので全スレッドで共有する
+    parallel_for(checkpoints.size(), threads, CHECKPOINT_GRAIN, [&](size_t begin, size_t end, int tid) {
+      for(size_t i = begin; i < end; i++) results[i] = evaluate_checkpoint(*raycaster, checkpoints[i], scratch[tid]);
+    });
+    if(collect_stats) {
+      for(const auto& s : scratch) last_stats += s.stats;
+    }
+  }
+  if(collect_stats) {
+    // スレッドごとの total_seconds は問い合わせ単位の合計なので、呼び出し全体の経過時間で置き換える
+    last_stats.total_seconds = 0.0;
+    total.lap(&QueryStats::total_seconds);
+  }
+  return results;
+}
+
+const DirectionSet& SunlightChecker::sun_directions() { return update_sun_table().directions; }
+
+const std::vector<float>& SunlightChecker::sun_hours() { return update_sun_table().hours; }
+
+double SunlightChecker::possible_hours() { return update_sun_table().possible_hours; }
+
+size_t SunlightChecker::packet_count() { return update_sun_table().directions.packets.size(); }
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "scene_raycaster.hpp"
+#include <array>
+#include <vector>
+
+// 測定点ごとの日照時間（太陽の直射が当たる時間）を求めるクラス
+// 日付・時刻は真太陽時（南中が12時）で、大気差と均時差は考えない
+class SunlightChecker {
+private:
+  // 太陽方向の表。方向は設定だけで決まるので全測定点で共有する
+  struct SunTable {
+    std::array<double, 8> key{}; // 作成時の設定（latitude_deg, first_day, last_day, start_hour, end_hour, time_step_minutes, north_azimuth_deg, use_packets）
+    bool valid = false;
+    // 地平線より上の太陽方向。先頭は全ての日で地平線より上の時刻の格子（日付ごと、時刻の昇順）で、残りは1本ずつ走査する
+    DirectionSet directions;
+    std::vector<float> hours; // 方向ごとに、その時刻が代表する時間[h]
+    double possible_hours = 0.0; // hours の合計（遮蔽がないときの日照時間）
+  };
+
+  // スレッドごとに使い回す作業領域
+  struct Scratch {
+    QueryContext context; // パケットの作業バッファ
+    OcclusionMask occlusion;
+    QueryStats stats; // collect_stats が有効なときのこのスレッドの計測
+  };
+
+  SunTable sun_table;
+  QueryStats last_stats;
+
+  const SunTable& update_sun_table();
+  float evaluate_checkpoint(const SceneRaycaster& raycaster, const Vec3& checkpoint, Scratch& scratch) const;
+
+public:
+  std::vector<Vec3> checkpoints;
+  double latitude_deg      = 35.0;  // 緯度(度、北緯が正)
+  int first_day            = 355;   // 最初の日（1月1日を1とする通し日。既定は冬至ごろ）
+  int last_day             = 355;   // 最後の日（first_day 以上、366以下）
+  double start_hour        = 8.0;   // 1日の評価時間帯の始め（真太陽時）
+  double end_hour          = 16.0;  // 1日の評価時間帯の終わり（真太陽時）
+  double time_step_minutes = 10.0;  // 時刻の刻み(分)。太陽方向は各区間の中央の時刻で求める
+  double north_azimuth_deg = 90.0;  // 真北の向き（度、x軸から反時計回り）。既定は +y が北
+  int num_threads          = 0;     // 並列実行するスレッド数（0以下なら論理コア数）
+  // 太陽方向を Intersect256Rays のパケットで遮蔽判定するかどうか（falseなら1本ずつ遮蔽判定する。結果は同じ）
+  // パケットは全ての日で地平線より上にある時刻を、4時間分の時刻 x 日付のタイルにまとめる。タイルが64本以上にならないと使われないので、
+  // 日数 x min(4時間分の刻み数, そのような時刻の数) が64以上のとき（10分刻みなら3日以上、1日だけなら3.75分以下の刻み）に効く。packet_count() で確かめられる
+  bool use_packets         = true;
+  bool collect_stats       = false; // 段階ごとの時間とカウンタを集計するかどうか（結果は stats()）
+
+  // 直前の check の計測（collect_stats が有効な場合のみ）
+  const QueryStats& stats() const { return last_stats; }
+
+  // 各測定点の日照時間[h]（first_day から last_day までの合計）
+  // シーンのBVHは変更がなければ作り直さないので、天空率の計算と同じ SceneRaycaster を使い回せる
+  std::vector<float> check(SceneRaycaster* raycaster);
+
+  // 日照時間の計算に使う太陽の方向
+  const DirectionSet& sun_directions();
+  // sun_directions() の方向ごとの時間[h]
+  const std::vector<float>& sun_hours();
+  // 遮蔽がないときの日照時間[h]（評価時間帯のうち太陽が地平線より上にある時間の合計）
+  double possible_hours();
+  // 太陽方向をまとめた Intersect256Rays のパケットの数（0なら全ての方向を1本ずつ遮蔽判定する）
+  size_t packet_count();
+};
@@ -187,6 +187,94 @@ def benchmark_comparison_2():
     return num_checkpoints_list, cpp_times, python_times
 
 
+def benchmark_thread_scaling():
+    """
+    比較3: スレッド数と処理速度（測定点/秒）
+    固定値: 長方形10個、測定点1000個、ray_resolution = 2.0度
+    """
+    print("\n=== ベンチマーク3: スレッド数と処理速度 ===")
+
+    scene = skyratio_calc.SceneRaycaster()
+    for i in range(10):
+        x = (i % 5) * 5.0 - 10.0
+        y = (i // 5) * 5.0 - 10.0
+        scene.add_box([x, y, 5.0], [2.0, 2.0, 4.0], [0.0, 0.0, 0.0])
+    scene.build()
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 2.0
+    checker.checkpoints = [[(i % 40) * 0.5 - 10.0, (i // 40) * 0.5 - 10.0, 1.5] for i in range(1000)]
+
+    max_threads = os.cpu_count() or 1
+    thread_counts = sorted({1, 2, 4, 8, 16, 32, max_threads} & set(range(1, max_threads + 1)))
+
+    throughputs = []
+    baseline = None
+    for num_threads in thread_counts:
+        checker.num_threads = num_threads
+        start_time = time.perf_counter()
+        ratios = checker.check(scene)
+        elapsed = time.perf_counter() - start_time
+
+        # スレッド数によらず結果が一致することを確認
+        if baseline is None:
+            baseline = ratios
+        assert ratios == baseline, "スレッド数によって結果が変わっています"
+
+        throughput = len(checker.checkpoints) / elapsed
+        throughputs.append(throughput)
+        print(f"  {num_threads:3d}スレッド: {elapsed:.4f}秒, {throughput:.1f} 測定点/秒, 高速化倍率 {throughput / throughputs[0]:.2f}x")
+
+    plt.figure(figsize=(10, 6))
+    plt.plot(thread_counts, throughputs, "o-", label="C++実装", linewidth=2, markersize=8)
+    plt.xlabel("スレッド数", fontsize=12)
+    plt.ylabel("処理速度（測定点/秒）", fontsize=12)
+    plt.title("スレッド数と処理速度\n（長方形10個、測定点1000個、解像度2°）", fontsize=14)
+    plt.legend(fontsize=11)
+    plt.grid(True, alpha=0.3)
+    plt.tight_layout()
+    output_path = os.path.join(OUTPUT_DIR, "benchmark_threads.png")
+    plt.savefig(output_path, dpi=150)
+    print(f"グラフを保存しました: {output_path}")
+
+    return thread_counts, throughputs
+
+
+def benchmark_build_options():
+    """
+    比較4: BVHの構築方法・レイアウトと、構築時間・計算時間
+    固定値: 長方形400個、測定点200個、ray_resolution = 2.0度
+    """
+    print("\n=== ベンチマーク4: BVH構築オプション ===")
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 2.0
+    checker.checkpoints = [[(i % 20) * 1.0 - 10.0, (i // 20) * 1.0 - 5.0, 1.5] for i in range(200)]
+
+    for builder in [skyratio_calc.BvhBuilder.Quick, skyratio_calc.BvhBuilder.Binned, skyratio_calc.BvhBuilder.HighQuality]:
+        for layout in [skyratio_calc.BvhLayout.Standard, skyratio_calc.BvhLayout.SoA, skyratio_calc.BvhLayout.Wide4, skyratio_calc.BvhLayout.Wide8]:
+            if not skyratio_calc.SceneRaycaster.layout_supported(layout):
+                continue
+            scene = skyratio_calc.SceneRaycaster()
+            options = skyratio_calc.BuildOptions()
+            options.builder = builder
+            options.layout = layout
+            scene.build_options = options
+            for i in range(400):
+                x = (i % 20) * 4.0 - 40.0
+                y = (i // 20) * 4.0 - 40.0
+                scene.add_box([x, y, 5.0], [2.0, 2.0, 4.0 + (i % 7)], [0.0, 0.0, 0.1 * (i % 5)])
+
+            start_time = time.perf_counter()
+            scene.build()
+            build_time = time.perf_counter() - start_time
+
+            start_time = time.perf_counter()
+            checker.check(scene)
+            check_time = time.perf_counter() - start_time
+            print(f"  {builder.name:12s} {layout.name:9s}: 構築 {build_time * 1000:.2f}ms, 計算 {check_time:.4f}秒")
+
+
 def print_summary(boxes_data, checkpoints_data):
     """サマリー統計を出力"""
     print("\n" + "=" * 70)
@@ -251,6 +339,8 @@ def main():
     # ベンチマークを実行
     boxes_data = benchmark_comparison_1()
     checkpoints_data = benchmark_comparison_2()
+    benchmark_thread_scaling()
+    benchmark_build_options()
 
     # サマリーを出力
     print_summary(boxes_data, checkpoints_data)
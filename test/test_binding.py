@@ -1,6 +1,9 @@
 """
 C++バインディングのテスト
 """
+import os
+import tempfile
+
 import skyratio_calc
 
 
@@ -23,6 +26,67 @@ def test_scene_raycaster():
     print(f"✓ SceneRaycaster: ヒット距離 {results[0].distance:.2f}")
 
 
+def test_occluded():
+    """遮蔽判定のみのクエリのテスト"""
+    scene = skyratio_calc.SceneRaycaster()
+    scene.add_box([0.0, 0.0, 5.0], [2.0, 2.0, 2.0], [0.0, 0.0, 0.0])
+    scene.build()
+
+    origins = [[0.0, 0.0, 0.0]] * 70
+    directions = [[0.0, 0.0, 1.0] if i % 3 == 0 else [1.0, 0.0, 0.0] for i in range(70)]
+    mask = scene.occluded(origins, directions)
+    hits = scene.raycast(origins, directions)
+
+    assert len(mask) == 2, f"Expected 2 words, got {len(mask)}"
+    for i, hit in enumerate(hits):
+        assert bool((mask[i // 64] >> (i % 64)) & 1) == hit.hit, f"ray {i} mismatch"
+    assert scene.is_occluded([0.0, 0.0, 0.0], [0.0, 0.0, 1.0])
+    assert not scene.is_occluded([0.0, 0.0, 0.0], [0.0, 0.0, -1.0])
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 5.0
+    checker.checkpoints = [[3.0, 0.0, 0.0]]
+    any_hit = checker.check(scene)
+    checker.use_occlusion_query = False
+    closest_hit = checker.check(scene)
+    assert any_hit == closest_hit, f"{any_hit} != {closest_hit}"
+    print("✓ occluded: raycastと同じ判定")
+
+
+def test_numpy_interface():
+    """NumPy配列を使うインターフェースのテスト"""
+    import numpy as np
+
+    scene = skyratio_calc.SceneRaycaster()
+    triangle = np.array([[-1.0, -1.0, 3.0], [1.0, -1.0, 3.0], [0.0, 1.0, 3.0]], dtype=np.float32)
+    scene.add_mesh(triangle)
+    scene.build()
+
+    for dtype in [np.float32, np.float64]:
+        origins = np.zeros((100, 3), dtype=dtype)
+        directions = np.tile(np.array([0.0, 0.0, 1.0], dtype=dtype), (100, 1))
+        directions[1::2] = [1.0, 0.0, 0.0]
+
+        hits = scene.raycast(origins, directions)
+        assert hits["hit"].dtype == np.bool_ and hits["hit"].shape == (100,)
+        assert hits["hit"][0::2].all() and not hits["hit"][1::2].any()
+        assert np.allclose(hits["distance"][0::2], 3.0)
+        assert np.allclose(hits["position"][0], [0.0, 0.0, 3.0])
+
+        mask = scene.occluded(origins, directions)
+        bits = np.unpackbits(mask.view(np.uint8), bitorder="little")[:100].astype(bool)
+        assert (bits == hits["hit"]).all()
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 10.0
+    checker.checkpoints = np.array([[0.0, 0.0, 0.0], [50.0, 0.0, 0.0]])
+    assert len(checker.checkpoints) == 2
+    ratios = checker.check_array(scene)
+    assert ratios.dtype == np.float32 and ratios.shape == (2,)
+    assert np.allclose(ratios, checker.check(scene))
+    print(f"✓ NumPyインターフェース: 天空率 {ratios}")
+
+
 def test_sky_ratio_checker():
     """SkyRatioCheckerのテスト"""
     scene = skyratio_calc.SceneRaycaster()
@@ -41,7 +105,374 @@ def test_sky_ratio_checker():
     print(f"✓ SkyRatioChecker: 天空率 {sky_ratios[0] * 100:.2f}%")
 
 
+def test_incremental_build():
+    """buildの冪等性と、オブジェクト変更時のリフィットのテスト"""
+    scene = skyratio_calc.SceneRaycaster()
+    wall = scene.add_box([0.0, 5.0, 5.0], [20.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+    scene.add_sphere([0.0, -5.0, 5.0], 1.0)
+    scene.build()
+    num_triangles = scene.triangle_count()
+
+    # 2回目のbuildで三角形が重複しないこと
+    scene.build()
+    assert not scene.needs_build()
+    assert scene.triangle_count() == num_triangles, f"Expected {num_triangles} triangles, got {scene.triangle_count()}"
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 5.0
+    checker.checkpoints = [[0.0, 0.0, 1.5]]
+    before = checker.check(scene)[0]
+
+    # 壁を移動 → リフィット後の結果が最初から作ったシーンと一致すること
+    scene.update_box(wall, [0.0, 15.0, 5.0], [20.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+    assert scene.needs_build()
+    moved = checker.check(scene)[0]
+    assert scene.triangle_count() == num_triangles
+
+    fresh = skyratio_calc.SceneRaycaster()
+    fresh.add_box([0.0, 15.0, 5.0], [20.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+    fresh.add_sphere([0.0, -5.0, 5.0], 1.0)
+    expected = checker.check(fresh)[0]
+    assert abs(moved - expected) < 1e-6, f"Expected {expected}, got {moved}"
+    assert moved > before, "壁を遠ざけたので天空率は増えるはず"
+
+    # 削除すると遮蔽がなくなる
+    scene.remove_box(wall)
+    removed = checker.check(scene)[0]
+    assert removed >= moved
+    print(f"✓ インクリメンタルビルド: {before * 100:.2f}% → {moved * 100:.2f}% → {removed * 100:.2f}%")
+
+
+def test_compact_storage():
+    """コンパクトモードでも同じ天空率になり、入力データを解放できることのテスト"""
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 5.0
+    checker.checkpoints = [[0.0, 0.0, 1.5], [3.0, -2.0, 1.5]]
+
+    def make_scene(compact):
+        scene = skyratio_calc.SceneRaycaster()
+        scene.compact_storage = compact
+        scene.add_mesh([[-10.0, 8.0, 0.0], [10.0, 8.0, 0.0], [0.0, 8.0, 15.0]])
+        scene.add_box([0.0, -6.0, 4.0], [10.0, 1.0, 8.0], [0.0, 0.0, 0.0])
+        scene.add_sphere([6.0, 0.0, 6.0], 2.0)
+        return scene
+
+    expected = checker.check(make_scene(False))
+    scene = make_scene(True)
+    assert scene.compact_storage
+    ratios = checker.check(scene)
+    for r, e in zip(ratios, expected):
+        assert abs(r - e) < 1e-6, f"Expected {e}, got {r}"
+
+    num_triangles = scene.triangle_count()
+    before = scene.memory_usage()
+    scene.release_host_geometry()
+    assert scene.memory_usage() < before
+    assert len(scene.vertices) == 0
+    assert scene.triangle_count() == num_triangles
+    ratios = checker.check(scene)
+    for r, e in zip(ratios, expected):
+        assert abs(r - e) < 1e-6, f"Expected {e}, got {r}"
+    print(f"✓ コンパクトモード: {before} → {scene.memory_usage()} バイト")
+
+
+def test_scene_cache():
+    """save_scene / load_scene でBVHごと保存・復元できることのテスト"""
+    scene = skyratio_calc.SceneRaycaster()
+    scene.add_mesh([[-10.0, 8.0, 0.0], [10.0, 8.0, 0.0], [0.0, 8.0, 15.0]])
+    wall = scene.add_box([0.0, -6.0, 4.0], [10.0, 1.0, 8.0], [0.0, 0.0, 0.0])
+    scene.add_sphere([6.0, 0.0, 6.0], 2.0)
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 5.0
+    checker.checkpoints = [[0.0, 0.0, 1.5], [3.0, -2.0, 1.5]]
+    expected = checker.check(scene)
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        path = os.path.join(tmpdir, "scene.bin")
+        scene.save_scene(path)
+
+        loaded = skyratio_calc.SceneRaycaster()
+        loaded.load_scene(path)
+        assert not loaded.needs_build(), "読み込んだシーンは再構築不要のはず"
+        assert loaded.triangle_count() == scene.triangle_count()
+        assert checker.check(loaded) == expected, "読み込んだシーンの天空率が一致しない"
+
+        # 読み込み後もオブジェクトを変更できる
+        loaded.update_box(wall, [0.0, -16.0, 4.0], [10.0, 1.0, 8.0], [0.0, 0.0, 0.0])
+        scene.update_box(wall, [0.0, -16.0, 4.0], [10.0, 1.0, 8.0], [0.0, 0.0, 0.0])
+        assert checker.check(loaded) == checker.check(scene)
+
+        # 壊れたファイルは例外になる
+        broken = os.path.join(tmpdir, "broken.bin")
+        with open(broken, "wb") as f:
+            f.write(b"not a scene")
+        try:
+            loaded.load_scene(broken)
+            assert False, "Expected RuntimeError"
+        except RuntimeError:
+            pass
+    print("✓ シーンキャッシュ: 保存・読み込み後の天空率が一致")
+
+
+def test_import_mesh():
+    """STL / OBJ / PLY の読み込みのテスト"""
+    source = skyratio_calc.SceneRaycaster()
+    source.add_box([0.0, 6.0, 4.0], [10.0, 1.0, 8.0], [0.0, 0.0, 0.3])
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 5.0
+    checker.checkpoints = [[0.0, 0.0, 1.5]]
+    expected = checker.check(source)[0]
+
+    # ボックスの8頂点・12三角形（add_boxと同じ面の並び）
+    corners = [[x, y, z] for z in (-1.0, 1.0) for y in (-1.0, 1.0) for x in (-1.0, 1.0)]
+    faces = [[0, 1, 2], [2, 1, 3], [4, 6, 5], [5, 6, 7], [0, 2, 4], [4, 2, 6],
+             [1, 5, 3], [3, 5, 7], [0, 4, 1], [1, 4, 5], [2, 3, 6], [6, 3, 7]]
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        # バイナリSTL（saveの出力）を溶接して読み込む
+        stl = os.path.join(tmpdir, "box.stl")
+        source.save(stl)
+        progress = []
+        scene = skyratio_calc.SceneRaycaster()
+        count = scene.import_mesh(stl, weld=True, progress=lambda done, total: progress.append((done, total)))
+        assert count == 12, f"Expected 12 triangles, got {count}"
+        assert len(scene.vertices) == 8, f"溶接後の頂点数は8のはず: {len(scene.vertices)}"
+        assert progress and progress[-1][0] == progress[-1][1]
+        result = checker.check(scene)[0]
+        assert abs(result - expected) < 1e-6, f"Expected {expected}, got {result}"
+
+        # OBJ（四角形の面を含む）とASCII PLY
+        obj = os.path.join(tmpdir, "quad.obj")
+        with open(obj, "w") as f:
+            f.write("# quad\n")
+            for v in corners:
+                f.write(f"v {v[0]} {v[1]} {v[2]}\n")
+            f.write("f 1/1/1 2/2/1 4/3/1 3/4/1\n")
+        scene = skyratio_calc.SceneRaycaster()
+        assert scene.import_mesh(obj) == 2
+
+        ply = os.path.join(tmpdir, "cube.ply")
+        with open(ply, "w") as f:
+            f.write(f"ply\nformat ascii 1.0\nelement vertex {len(corners)}\n")
+            f.write("property float x\nproperty float y\nproperty float z\n")
+            f.write(f"element face {len(faces)}\nproperty list uchar int vertex_indices\nend_header\n")
+            for v in corners:
+                f.write(f"{v[0]} {v[1]} {v[2]}\n")
+            for t in faces:
+                f.write(f"3 {t[0]} {t[1]} {t[2]}\n")
+        scene = skyratio_calc.SceneRaycaster()
+        assert scene.import_mesh(ply) == 12
+        assert scene.indices == faces
+
+        # add_indexed_mesh で追加したものと同じになる
+        indexed = skyratio_calc.SceneRaycaster()
+        indexed.add_indexed_mesh(corners, faces)
+        assert indexed.vertices == scene.vertices
+
+        try:
+            scene.import_mesh(os.path.join(tmpdir, "mesh.txt"))
+            assert False, "Expected ValueError"
+        except ValueError:
+            pass
+    print("✓ メッシュ読み込み: STL / OBJ / PLY")
+
+
+def test_reduce_occlusion():
+    """遮蔽マスクからまとめて天空率を求めるテスト"""
+    import numpy as np
+
+    scene = skyratio_calc.SceneRaycaster()
+    scene.add_box([0.0, 10.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+    scene.add_box([-8.0, 0.0, 10.0], [1.0, 30.0, 20.0], [0.0, 0.0, 0.3])
+    scene.build()
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 2.0
+    checker.checkpoints = [[0.0, 0.0, 1.5], [2.0, -3.0, 1.5], [0.0, 0.0, 100.0]]
+    expected = checker.check(scene)
+
+    # ray_directions() の方向で遮蔽マスクを作れば check と同じ結果になる
+    directions = checker.ray_directions()
+    masks = np.stack([scene.occluded(np.tile(np.array(p, dtype=np.float32), (len(directions), 1)), directions) for p in checker.checkpoints])
+    assert checker.reduce_occlusion(masks) == expected
+    assert checker.reduce_occlusion([list(map(int, m)) for m in masks]) == expected
+
+    try:
+        checker.reduce_occlusion([[0]])
+        assert False, "Expected ValueError"
+    except ValueError:
+        pass
+    print(f"✓ reduce_occlusion: {len(expected)}点")
+
+
+def test_query_stats():
+    """段階ごとの時間とカウンタのテスト"""
+    scene = skyratio_calc.SceneRaycaster()
+    box = scene.add_box([0.0, 10.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+
+    # 無効な間は集計しない
+    scene.build()
+    assert not scene.collect_stats
+    assert scene.stats().builds == 0
+
+    scene.collect_stats = True
+    scene.update_box(box, [0.0, 11.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+    scene.build()
+    scene.occluded([[0.0, 0.0, 1.5], [0.0, 0.0, 1.5]], [[0.0, 1.0, 0.1], [0.0, -1.0, 0.1]])
+    stats = scene.stats()
+    assert stats.refits == 1
+    assert stats.rays == 2 and stats.hits == 1
+    scene.reset_stats()
+    assert scene.stats().rays == 0
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 5.0
+    checker.checkpoints = [[0.0, 0.0, 1.5], [2.0, -3.0, 1.5]]
+    expected = checker.check(scene)
+    assert checker.stats().checkpoints == 0
+
+    # 計測しても結果は変わらない
+    checker.collect_stats = True
+    for search in [skyratio_calc.HorizonSearch.Sweep, skyratio_calc.HorizonSearch.Descend]:
+        checker.horizon_search = search
+        ratios = checker.check(scene)
+        stats = checker.stats()
+        assert stats.checkpoints == 2
+        assert 0 < stats.hits < stats.rays
+        assert stats.traversal_seconds > 0.0 and stats.total_seconds > 0.0
+        if search == skyratio_calc.HorizonSearch.Sweep:
+            assert ratios == expected
+            assert stats.rays == 2 * len(checker.ray_directions())
+    print(f"✓ 計測: {stats.rays}本, {stats.total_seconds * 1000:.1f}ms")
+
+
+def test_query_context():
+    """作業バッファを使い回すレイキャストのテスト"""
+    import numpy as np
+
+    scene = skyratio_calc.SceneRaycaster()
+    scene.add_box([0.0, 0.0, 5.0], [2.0, 2.0, 2.0], [0.0, 0.0, 0.0])
+    scene.build()
+    scene.collect_stats = True
+
+    origins = np.zeros((1000, 3))
+    directions = np.tile([0.0, 0.0, 1.0], (1000, 1))
+    directions[1::2] = [1.0, 0.0, 0.0]
+    expected = scene.raycast(origins, directions)
+
+    # 最初の呼び出しだけ作業バッファを確保し、同じ大きさ以下の問い合わせでは確保しない
+    context = skyratio_calc.QueryContext()
+    assert context.memory_usage() == 0
+    allocations = []
+    for count in [1000, 1000, 10]:
+        scene.reset_stats()
+        hits = scene.raycast(origins[:count], directions[:count], context)
+        assert (hits["hit"] == expected["hit"][:count]).all()
+        assert np.allclose(hits["distance"], expected["distance"][:count])
+        allocations.append(scene.stats().allocations)
+    assert allocations == [1, 0, 0]
+    assert context.memory_usage() > 0
+    print(f"✓ 作業バッファの使い回し: {context.memory_usage()}バイト")
+
+
+def test_parallel_build():
+    """三角形分割・変換とBVHの構築を並列に行う構築のテスト"""
+    import numpy as np
+
+    rng = np.random.default_rng(1)
+    origins = np.column_stack([rng.uniform(-50.0, 50.0, (500, 2)), np.full(500, 1.5)])
+    directions = np.column_stack([rng.normal(size=(500, 2)), rng.uniform(0.1, 1.0, 500)])
+    mesh = rng.uniform(-60.0, 60.0, (3000, 3)) * [1.0, 1.0, 0.2]
+
+    # スレッド数・保存形式によらず同じ三角形になり、同じ交点が求まる（4スレッドではBVHを4つの部分木に分けて構築する）
+    expected = None
+    for compact in [False, True]:
+        for threads in [1, 4]:
+            scene = skyratio_calc.SceneRaycaster()
+            scene.compact_storage = compact
+            options = skyratio_calc.BuildOptions()
+            options.threads = threads
+            scene.build_options = options
+            scene.add_mesh(mesh)
+            for i in range(5000):
+                scene.add_box([(i % 71) * 2.0 - 70.0, (i // 71) * 2.0 - 70.0, 5.0], [1.0, 1.0, 2.0 + i % 7], [0.0, 0.0, 0.1 * (i % 5)])
+            for i in range(1000):
+                scene.add_sphere([(i % 31) * 4.0 - 60.0, (i // 31) * 4.0 - 60.0, 12.0], 1.0)
+            scene.collect_stats = True
+            scene.build()
+            assert scene.triangle_count() >= 4 * 65536
+            stats = scene.stats()
+            assert stats.builds == 1 and stats.tessellation_seconds > 0.0
+            assert abs(stats.total_seconds - stats.tessellation_seconds - stats.build_seconds) < 1e-9
+            hits = scene.raycast(origins, directions)
+            if expected is None:
+                expected = hits
+            assert (hits["hit"] == expected["hit"]).all()
+            assert (hits["distance"] == expected["distance"]).all()
+    print(f"✓ 並列の構築: 三角形分割 {stats.tessellation_seconds * 1000:.1f}ms, BVH {stats.build_seconds * 1000:.1f}ms")
+
+
+def test_result_cache():
+    """結果キャッシュが変更の影響を受ける測定点だけを評価し直すことのテスト"""
+    def make_scene():
+        scene = skyratio_calc.SceneRaycaster()
+        scene.add_box([10.0, 0.0, 5.0], [4.0, 4.0, 10.0], [0.0, 0.0, 0.0])
+        scene.add_sphere([0.0, 15.0, 6.0], 3.0)
+        far = scene.add_box([200.0, 0.0, 5.0], [4.0, 4.0, 10.0], [0.0, 0.0, 0.0])
+        return scene, far
+
+    scene, far = make_scene()
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 2.0
+    checker.collect_stats = True
+    checker.checkpoints = [[i * 10.0, 0.0, 1.5] for i in range(20)]
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        checker.result_cache_path = os.path.join(tmpdir, "ratios.bin")
+        expected = checker.check(scene)
+        assert checker.stats().checkpoints == 20
+
+        # 2回目はレイを飛ばさずに同じ結果を返す
+        assert checker.check(scene) == expected
+        assert checker.stats().checkpoints == 0 and checker.stats().rays == 0
+
+        # 遠くのボックスを高くすると、それが見えうる近くの測定点だけを評価し直す
+        scene.update_box(far, [200.0, 0.0, 10.0], [4.0, 4.0, 20.0], [0.0, 0.0, 0.0])
+        ratios = checker.check(scene)
+        assert 0 < checker.stats().checkpoints < 20
+        fresh = skyratio_calc.SkyRatioChecker()
+        fresh.ray_resolution = 2.0
+        fresh.checkpoints = checker.checkpoints
+        assert ratios == fresh.check(scene), "キャッシュを使った結果が評価し直した結果と一致しない"
+
+        # 同じ内容の別のシーンでもキャッシュを使える
+        other, far = make_scene()
+        other.update_box(far, [200.0, 0.0, 10.0], [4.0, 4.0, 20.0], [0.0, 0.0, 0.0])
+        other.build()
+        assert other.content_hash() == scene.content_hash()
+        assert checker.check(other) == ratios and checker.stats().checkpoints == 0
+
+        # 結果に影響する設定を変えると全て評価し直す
+        checker.use_safe_side = True
+        checker.check(scene)
+        assert checker.stats().checkpoints == 20
+    print("✓ 結果キャッシュ: キャッシュにない測定点と変更の影響を受ける測定点だけを評価")
+
+
 if __name__ == "__main__":
     test_scene_raycaster()
+    test_occluded()
+    test_numpy_interface()
     test_sky_ratio_checker()
+    test_incremental_build()
+    test_compact_storage()
+    test_scene_cache()
+    test_import_mesh()
+    test_reduce_occlusion()
+    test_query_stats()
+    test_query_context()
+    test_parallel_build()
+    test_result_cache()
     print("\nすべてのテストが成功しました！")
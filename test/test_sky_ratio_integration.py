@@ -160,6 +160,456 @@ def test_completely_enclosed():
     print("✓ 天井があるケース: PASS")
 
 
+def test_horizon_search_modes():
+    """
+    テスト6: ホライズン探索方法による結果の比較
+
+    Descendは常にSweepと同じ結果になり、遮蔽が地面から連続している壁だけのシーンでは
+    Bisectionも同じ結果になることを確認
+    """
+    scene = skyratio_calc.SceneRaycaster()
+    scene.add_box([0.0, 10.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+    scene.add_box([-8.0, 0.0, 10.0], [1.0, 30.0, 20.0], [0.0, 0.0, 0.3])
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 1.0
+    checker.checkpoints = [[0.0, 0.0, 1.5], [2.0, -3.0, 1.5]]
+
+    results = {}
+    for mode in [skyratio_calc.HorizonSearch.Sweep, skyratio_calc.HorizonSearch.Descend, skyratio_calc.HorizonSearch.Bisection]:
+        checker.horizon_search = mode
+        results[mode] = checker.check(scene)
+
+    sweep = results[skyratio_calc.HorizonSearch.Sweep]
+    assert results[skyratio_calc.HorizonSearch.Descend] == sweep
+    assert results[skyratio_calc.HorizonSearch.Bisection] == sweep
+    print(f"ホライズン探索テスト: 天空率 {sweep[0] * 100:.2f}%, {sweep[1] * 100:.2f}%")
+    print("✓ ホライズン探索方法: PASS")
+
+
+def test_build_options():
+    """
+    テスト7: BVHの構築方法・レイアウトによらず同じ天空率になることを確認
+    """
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 2.0
+    checker.checkpoints = [[0.0, 0.0, 1.5], [2.0, -3.0, 1.5]]
+
+    expected = None
+    for builder in [skyratio_calc.BvhBuilder.Binned, skyratio_calc.BvhBuilder.Quick, skyratio_calc.BvhBuilder.HighQuality]:
+        for layout in [skyratio_calc.BvhLayout.Standard, skyratio_calc.BvhLayout.SoA, skyratio_calc.BvhLayout.Wide4, skyratio_calc.BvhLayout.Wide8]:
+            scene = skyratio_calc.SceneRaycaster()
+            options = skyratio_calc.BuildOptions()
+            options.builder = builder
+            options.layout = layout
+            options.optimize = True
+            scene.build_options = options
+            scene.add_box([0.0, 10.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+            wall = scene.add_box([-8.0, 0.0, 10.0], [1.0, 30.0, 20.0], [0.0, 0.0, 0.3])
+            scene.add_sphere([5.0, -5.0, 8.0], 3.0)
+
+            # 使えないレイアウトは Standard で走査する
+            active = scene.traversal_layout()
+            assert active == (layout if skyratio_calc.SceneRaycaster.layout_supported(layout) else skyratio_calc.BvhLayout.Standard)
+
+            # 形状を変更した後（リフィットまたは再構築）も同じ結果になる
+            ratios = checker.check(scene)
+            scene.update_box(wall, [-12.0, 0.0, 10.0], [1.0, 30.0, 20.0], [0.0, 0.0, 0.3])
+            ratios += checker.check(scene)
+
+            if expected is None:
+                expected = ratios
+            for r, e in zip(ratios, expected):
+                assert abs(r - e) < 1e-3, f"{builder}, {layout}: Expected {e}, got {r}"
+    print("✓ BVH構築オプション: PASS")
+
+
+def test_packet_traversal():
+    """
+    テスト8: 最近接ヒットと遮蔽判定（use_packet_occlusion）のパケット走査が、1本ずつの走査（コンパクトモード）と同じ天空率になることを確認
+
+    刻み幅によってパケットの大きさやパケットにできない方向の扱いが変わるので、複数の刻み幅で比較する
+    """
+    scene = skyratio_calc.SceneRaycaster()
+    # コンパクトモードはパケット走査を使わない
+    scalar = skyratio_calc.SceneRaycaster()
+    scalar.compact_storage = True
+    for i in range(40):
+        angle = 2.0 * math.pi * i / 40
+        distance = 8.0 + (i % 7) * 3.0
+        height = 4.0 + (i % 5) * 6.0
+        for s in (scene, scalar):
+            s.add_box([distance * math.cos(angle), distance * math.sin(angle), height / 2], [2.0, 2.0, height], [0.0, 0.0, angle])
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.checkpoints = [[0.0, 0.0, 1.5], [3.0, -2.0, 1.5], [-5.0, 4.0, 10.0]]
+    for resolution in [0.5, 1.0, 5.0, 10.0, 30.0]:
+        checker.ray_resolution = resolution
+        checker.use_occlusion_query = True
+        any_hit = checker.check(scene)
+        expected = checker.check(scalar)
+        checker.use_packet_occlusion = True
+        packet_occlusion = checker.check(scene)
+        checker.use_packet_occlusion = False
+        checker.use_occlusion_query = False
+        closest_hit = checker.check(scene)
+        assert any_hit == expected, f"resolution {resolution}: {any_hit} != {expected}"
+        assert packet_occlusion == expected, f"resolution {resolution}: {packet_occlusion} != {expected}"
+        assert closest_hit == expected, f"resolution {resolution}: {closest_hit} != {expected}"
+    print("✓ パケット走査: PASS")
+
+
+def test_grid_checkpoints():
+    """
+    テスト9: 格子・折れ線の測定点と、直前の測定点の結果を使うGuided探索
+
+    遮蔽が地面から連続している建物だけのシーンでは、GuidedもDescendと同じ結果になることを確認
+    """
+    scene = skyratio_calc.SceneRaycaster()
+    scene.add_box([0.0, 10.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+    scene.add_box([-8.0, 0.0, 10.0], [1.0, 30.0, 20.0], [0.0, 0.0, 0.3])
+    scene.add_box([5.0, -5.0, 4.0], [3.0, 3.0, 8.0], [0.0, 0.0, 0.5])
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 2.0
+
+    # 4x4のセルの中心がヒルベルト曲線の順（隣り合う点の距離が常に1）に並ぶ
+    assert checker.set_grid_checkpoints([[0.0, 0.0], [4.0, 0.0], [4.0, 4.0], [0.0, 4.0]], 1.0, 1.5) == 16
+    points = checker.checkpoints
+    assert sorted((p[0], p[1]) for p in points) == [(x + 0.5, y + 0.5) for x in range(4) for y in range(4)]
+    for a, b in zip(points, points[1:]):
+        assert abs(a[0] - b[0]) + abs(a[1] - b[1]) == 1.0
+
+    assert checker.set_polyline_checkpoints([[0.0, 0.0], [2.5, 0.0], [2.5, 2.0]], 1.0, 1.5) == 6
+    assert checker.checkpoints[-1] == [2.5, 2.0, 1.5]
+
+    count = checker.set_grid_checkpoints([[-6.0, -8.0], [6.0, -8.0], [6.0, 8.0], [-6.0, 8.0]], 1.0, 1.5)
+    checker.horizon_search = skyratio_calc.HorizonSearch.Descend
+    expected = checker.check(scene)
+    checker.horizon_search = skyratio_calc.HorizonSearch.Guided
+    for threads in [1, 3]:
+        checker.num_threads = threads
+        assert checker.check(scene) == expected
+    print(f"✓ 格子の測定点とGuided探索: {count}点 PASS")
+
+
+def test_far_field_culling():
+    """
+    テスト10: 領域ごとに遠くの形状を除いたシーンでの計算
+
+    Exactは結果が変わらず、Pruneは遮蔽を小さく、Mergeは遮蔽を大きく見積もることを確認
+    """
+    scene = skyratio_calc.SceneRaycaster()
+    # 近くの建物と、低すぎて仰角20度に届かない遠くの建物
+    scene.add_box([0.0, 15.0, 10.0], [30.0, 2.0, 20.0], [0.0, 0.0, 0.0])
+    for i in range(20):
+        angle = 2.0 * math.pi * i / 20
+        scene.add_box([200.0 * math.cos(angle), 200.0 * math.sin(angle), 10.0], [10.0, 10.0, 20.0], [0.0, 0.0, angle])
+    # 見かけの大きさが刻み幅より小さい高所の小物
+    for i in range(12):
+        scene.add_box([-20.0 + i * 3.5, -25.0, 15.0], [0.2, 0.2, 0.2], [0.0, 0.0, 0.0])
+    scene.build()
+
+    # 遠くの低い建物は除かれる（extract_region のシーンは未構築なので、三角形は build で作られる）
+    local = scene.extract_region([-10.0, -10.0, 1.5], [10.0, 10.0, 1.5])
+    local.build()
+    # 近くの建物と小物の13個のボックスが残る。近くの建物の底面（z=0）は測定点より低く、上向きのレイが届かないので2三角形が除かれる
+    assert local.triangle_count() == 12 * 13 - 2, f"Unexpected triangle count: {local.triangle_count()}"
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 2.0
+    checker.set_grid_checkpoints([[-20.0, -20.0], [20.0, -20.0], [20.0, 20.0], [-20.0, 20.0]], 4.0, 1.5)
+    checker.culling_region_size = 16.0
+
+    results = {}
+    for mode in [skyratio_calc.FarFieldCulling.Off, skyratio_calc.FarFieldCulling.Exact, skyratio_calc.FarFieldCulling.Prune, skyratio_calc.FarFieldCulling.Merge]:
+        checker.far_field_culling = mode
+        results[mode] = checker.check(scene)
+
+    off = results[skyratio_calc.FarFieldCulling.Off]
+    assert results[skyratio_calc.FarFieldCulling.Exact] == off
+    for o, p, m in zip(off, results[skyratio_calc.FarFieldCulling.Prune], results[skyratio_calc.FarFieldCulling.Merge]):
+        assert p >= o - 1e-6 and m <= o + 1e-6, f"Off {o}, Prune {p}, Merge {m}"
+    print("✓ 遠くの形状の除去: PASS")
+
+
+def test_design_variants():
+    """
+    テスト11: 複数のシーン・共通シーンへの重ね合わせのまとめて評価が個別のcheckと一致することを確認
+    """
+    def wall(scene):
+        scene.add_box([0.0, 10.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+
+    def tower(scene):
+        scene.add_box([-8.0, 0.0, 10.0], [1.0, 30.0, 20.0], [0.0, 0.0, 0.3])
+
+    def dome(scene):
+        scene.add_sphere([5.0, -5.0, 8.0], 3.0)
+
+    base, a, b, empty, full_a, full_b = (skyratio_calc.SceneRaycaster() for _ in range(6))
+    wall(base)
+    tower(a)
+    dome(b)
+    for f in [wall, tower]:
+        f(full_a)
+    for f in [wall, dome]:
+        f(full_b)
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 2.0
+    checker.checkpoints = [[0.0, 0.0, 1.5], [2.0, -3.0, 1.5], [-3.0, 4.0, 6.0]]
+    expected = [checker.check(full_a), checker.check(full_b), checker.check(base)]
+
+    overlays = checker.check_overlays(base, [a, b, empty])
+    assert overlays["ratios"].shape == (3, 3)
+    assert overlays["ratios"].tolist() == expected
+    assert abs(overlays["differences"][1] - (overlays["ratios"][1] - overlays["ratios"][0])).max() < 1e-6
+
+    scenes = checker.check_scenes([full_a, full_b, base])
+    assert scenes["ratios"].tolist() == expected
+
+    # 遠くの形状の除去もシーンごとに check と同じように適用する
+    checker.far_field_culling = skyratio_calc.FarFieldCulling.Prune
+    checker.culling_region_size = 4.0
+    pruned = [checker.check(full_a), checker.check(full_b), checker.check(base)]
+    assert checker.check_scenes([full_a, full_b, base])["ratios"].tolist() == pruned
+    print("✓ 設計案のまとめて評価: PASS")
+
+
+def test_check_stream():
+    """
+    テスト12: チャンクごとの結果の受け取りと中断・再開
+
+    途中で中断して続きから再開しても、check と同じ結果になることを確認
+    """
+    scene = skyratio_calc.SceneRaycaster()
+    scene.add_box([0.0, 10.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+    scene.add_sphere([5.0, -5.0, 8.0], 3.0)
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 4.0
+    count = checker.set_grid_checkpoints([[-10.0, -10.0], [10.0, -10.0], [10.0, 10.0], [-10.0, 10.0]], 1.0, 1.5)
+    expected = checker.check(scene)
+
+    results = [None] * count
+    chunks = []
+
+    def store(first, ratios):
+        results[first:first + len(ratios)] = ratios.tolist()
+
+    def on_chunk(first, ratios):
+        store(first, ratios)
+        chunks.append((first, len(ratios)))
+        return len(chunks) < 2  # 2チャンクで中断
+
+    # チャンクの境界は64の倍数にそろえられる
+    next_start = checker.check_stream(scene, on_chunk, chunk_size=100)
+    assert chunks == [(0, 128), (128, 128)]
+    assert next_start == 256
+
+    # 続きから再開する（Noneを返すコールバックは最後まで続ける）
+    assert checker.check_stream(scene, store, start=next_start) == count
+    assert results == expected
+    assert checker.check_stream(scene, on_chunk, start=count) == count
+    print(f"✓ チャンクごとの評価と再開: {count}点 PASS")
+
+
+def test_analytic_primitives():
+    """
+    テスト13: ボックス・球の解析的な交差判定
+
+    ボックスは三角形に分割した場合と同じ天空率になり、球は分割による誤差なしに交点が求まることを確認
+    """
+    def make_scene(analytic):
+        scene = skyratio_calc.SceneRaycaster()
+        options = skyratio_calc.BuildOptions()
+        options.analytic_primitives = analytic
+        scene.build_options = options
+        scene.add_mesh([[-50.0, -50.0, 0.0], [50.0, -50.0, 0.0], [0.0, 50.0, 0.0]])
+        scene.add_box([0.0, 10.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+        scene.add_box([-8.0, 0.0, 10.0], [1.0, 30.0, 20.0], [0.1, 0.2, 0.3])
+        scene.add_sphere([5.0, -5.0, 8.0], 3.0)
+        return scene
+
+    analytic = make_scene(True)
+    tessellated = make_scene(False)
+    analytic.build()
+    assert analytic.triangle_count() == 1 and analytic.has_geometry()
+
+    # 球の中心へ向かうレイは半径ちょうどの位置で当たる
+    hit = analytic.raycast([[5.0, -5.0, 0.0]], [[0.0, 0.0, 1.0]])[0]
+    assert hit.hit and abs(hit.distance - 5.0) < 1e-4, f"Expected 5.0, got {hit.distance}"
+    # 面を含む平面上から面に沿って飛ばすレイも当たり、平面の外からなら外れる（方向の成分が0でも NaN で外れにならない）
+    hit, miss = analytic.raycast([[20.0, 0.0, 5.0], [20.5, 0.0, 5.0]], [[0.0, 1.0, 0.0], [0.0, 1.0, 0.0]])
+    assert hit.hit and abs(hit.distance - 9.5) < 1e-4, f"Expected 9.5, got {hit.distance}"
+    assert not miss.hit
+    assert analytic.is_occluded([20.0, 0.0, 5.0], [0.0, 1.0, 0.0])
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 2.0
+    checker.set_grid_checkpoints([[-6.0, -8.0], [8.0, -8.0], [8.0, 8.0], [-6.0, 8.0]], 2.0, 1.5)
+    # 分割した球は内接する多面体なので、解析的な球の方が遮蔽が大きい
+    for a, t in zip(checker.check(analytic), checker.check(tessellated)):
+        assert a <= t + 1e-6, f"Analytic {a}, tessellated {t}"
+    # ボックスだけなら同じ形なので同じ天空率になる
+    analytic.remove_sphere(0)
+    tessellated.remove_sphere(0)
+    for a, t in zip(checker.check(analytic), checker.check(tessellated)):
+        assert abs(a - t) < 1e-3, f"Analytic {a}, tessellated {t}"
+
+    # 形状の変更・削除と、領域ごとのシーン（ボックス・球をそのまま移す）でも結果が変わらない
+    analytic.update_sphere(0, [5.0, -3.0, 8.0], 2.0)
+    analytic.remove_box(1)
+    expected = checker.check(analytic)
+    checker.far_field_culling = skyratio_calc.FarFieldCulling.Exact
+    checker.culling_region_size = 4.0
+    assert checker.check(analytic) == expected
+    print("✓ ボックス・球の解析的な交差判定: PASS")
+
+
+def test_projection_horizon():
+    """
+    テスト14: 投影によるホライズン（HorizonSearch.Projection）
+
+    長い壁では方位角ごとの仰角から求めた天空率と一致し、一般のシーンでは use_safe_side の有無による Sweep の結果の間に入ることを確認
+    """
+    resolution = 2.0
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = resolution
+    checker.horizon_search = skyratio_calc.HorizonSearch.Projection
+    checker.checkpoints = [[0.0, 0.0, 0.0]]
+
+    # y = 9.5 の面を持つ高さ10の長い壁。方位角 phi の仰角の正接は 10 sin(phi) / 9.5
+    wall = skyratio_calc.SceneRaycaster()
+    wall.add_box([0.0, 10.0, 5.0], [2000.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+    wall.build()
+    phi_steps = int(360.0 / resolution)
+    min_tan = math.tan(math.radians(20.0))
+    c = []
+    for p in range(phi_steps):
+        t = 10.0 * math.sin(2.0 * math.pi * p / phi_steps) / 9.5
+        c.append(1.0 if t <= min_tan else 1.0 / math.sqrt(1.0 + t * t))
+    expected = sum(c[p] * c[(p + 1) % phi_steps] for p in range(phi_steps)) / phi_steps
+    actual = checker.check(wall)[0]
+    assert abs(actual - expected) < 1e-5, f"Expected {expected}, got {actual}"
+
+    # 地面から立つボックスでは、仰角を刻んだ Sweep の外接近似と安全側評価の間に入る
+    # （浮いた形状は刻みより薄い部分をレイが通り抜けることがあるので、この関係は成り立たない）
+    checker.set_grid_checkpoints([[-6.0, -8.0], [8.0, -8.0], [8.0, 8.0], [-6.0, 8.0]], 2.0, 1.5)
+    scenes = []
+    for analytic in (False, True):
+        scene = skyratio_calc.SceneRaycaster()
+        options = skyratio_calc.BuildOptions()
+        options.analytic_primitives = analytic
+        scene.build_options = options
+        scene.add_box([0.0, 10.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+        scene.add_box([-8.0, 0.0, 10.0], [1.0, 30.0, 20.0], [0.0, 0.0, 0.3])
+        scene.add_box([12.0, -6.0, 15.0], [6.0, 6.0, 30.0], [0.0, 0.0, 0.7])
+        scene.build()
+        scenes.append(scene)
+
+        checker.horizon_search = skyratio_calc.HorizonSearch.Projection
+        checker.collect_stats = True
+        projected = checker.check(scene)
+        assert checker.stats().rays == 0 and checker.stats().projected > 0
+        checker.collect_stats = False
+        checker.horizon_search = skyratio_calc.HorizonSearch.Sweep
+        outer = checker.check(scene)
+        checker.use_safe_side = True
+        safe = checker.check(scene)
+        checker.use_safe_side = False
+        for s, p, o in zip(safe, projected, outer):
+            assert s - 1e-3 <= p <= o + 1e-3, f"Expected {s} <= {p} <= {o}"
+
+    # 分割した球は内接する多面体なので、解析的な球の方が遮蔽が大きい
+    checker.horizon_search = skyratio_calc.HorizonSearch.Projection
+    for scene in scenes:
+        scene.add_sphere([5.0, -5.0, 8.0], 8.0)
+    for t, a in zip(checker.check(scenes[0]), checker.check(scenes[1])):
+        assert a <= t + 1e-6, f"Analytic {a}, tessellated {t}"
+    print("✓ 投影によるホライズン: PASS")
+
+
+def test_horizon_profiles():
+    """
+    テスト15: ホライズンの再利用（check_horizons / integrate_horizons）
+
+    1回の check_horizons から、安全側評価・外接近似の check と同じ天空率が求まり、方位角の範囲ごとの天空率の平均が全周の値になることを確認
+    """
+    scene = skyratio_calc.SceneRaycaster()
+    scene.add_box([0.0, 10.0, 5.0], [40.0, 1.0, 10.0], [0.0, 0.0, 0.0])
+    scene.add_box([-8.0, 0.0, 10.0], [1.0, 30.0, 20.0], [0.0, 0.0, 0.3])
+    scene.add_sphere([6.0, -6.0, 8.0], 4.0)
+    scene.build()
+
+    checker = skyratio_calc.SkyRatioChecker()
+    checker.ray_resolution = 2.0
+    checker.set_grid_checkpoints([[-6.0, -8.0], [8.0, -8.0], [8.0, 8.0], [-6.0, 8.0]], 2.0, 1.5)
+    for search in (skyratio_calc.HorizonSearch.Sweep, skyratio_calc.HorizonSearch.Descend, skyratio_calc.HorizonSearch.Guided):
+        checker.horizon_search = search
+        checker.use_safe_side = False
+        outer = checker.check(scene)
+        checker.use_safe_side = True
+        safe = checker.check(scene)
+
+        profiles = checker.check_horizons(scene)
+        assert len(profiles) == len(checker.checkpoints)
+        assert profiles.horizon.shape == (len(checker.checkpoints), profiles.phi_steps)
+        assert list(checker.integrate_horizons(profiles, False)) == outer, f"{search}: 外接近似が check と一致しない"
+        assert list(checker.integrate_horizons(profiles, True)) == safe, f"{search}: 安全側評価が check と一致しない"
+
+    # 4つの方位角の範囲（360度をまたぐものを含む）の平均は全周の値
+    quadrants = [checker.integrate_horizons(profiles, True, a - 45.0, a + 45.0) for a in (0.0, 90.0, 180.0, 270.0)]
+    for i, whole in enumerate(safe):
+        average = sum(q[i] for q in quadrants) / 4.0
+        assert abs(average - whole) < 1e-6, f"Expected {whole}, got {average}"
+
+    # 保存した配列から戻しても同じ値になる
+    restored = skyratio_calc.HorizonProfiles()
+    restored.resolution = profiles.resolution
+    restored.theta_steps = profiles.theta_steps
+    restored.horizon = profiles.horizon
+    assert (checker.integrate_horizons(restored, True) == checker.integrate_horizons(profiles, True)).all()
+    print("✓ ホライズンの再利用: PASS")
+
+
+def test_sunlight_hours():
+    """
+    テスト16: 日照時間（SunlightChecker）
+
+    遮蔽のない測定点は可照時間、北半球の冬至に高い壁のすぐ北にある測定点は日照なしになり、パケット走査と1本ずつの遮蔽判定が一致することを確認
+    """
+    scene = skyratio_calc.SceneRaycaster()
+    # 東西に長い高さ20mの壁（+y が北）
+    scene.add_box([0.0, -5.0, 10.0], [40.0, 1.0, 20.0], [0.0, 0.0, 0.0])
+    scene.build()
+
+    sun = skyratio_calc.SunlightChecker()
+    sun.checkpoints = [[0.0, 0.0, 1.5], [0.0, -30.0, 1.5], [200.0, 200.0, 1.5]]
+    hours = sun.check(scene)
+    assert abs(sun.possible_hours() - 8.0) < 1e-9, "冬至の8時から16時は太陽が地平線より上にあるはず"
+    assert hours[0] == 0.0, f"壁の北側は日影のはず: {hours[0]}"
+    assert abs(hours[1] - 8.0) < 1e-4 and abs(hours[2] - 8.0) < 1e-4, "壁の南側と遠くの点は終日日照のはず"
+
+    # 夏至を含む複数日・終日では地平線より下の時刻を除き、1日の可照時間が12時間を超える
+    sun.first_day, sun.last_day = 160, 190
+    sun.start_hour, sun.end_hour = 0.0, 24.0
+    sun.time_step_minutes = 15.0
+    per_day = sun.possible_hours() / 31
+    assert 13.5 < per_day < 15.0, f"Unexpected day length: {per_day}"
+    assert sun.sun_directions().shape == (len(sun.sun_hours()), 3)
+    assert (sun.sun_directions()[:, 2] > 0.0).all()
+
+    # 複数日では日付 x 時刻のタイルがパケットになる（1日だけではタイルが64本に満たず全て1本ずつになる）
+    assert sun.packet_count() > 0, "複数日の太陽方向がパケットにまとめられていない"
+    packets = sun.check(scene)
+    sun.use_packets = False
+    assert sun.packet_count() == 0
+    scalar = sun.check(scene)
+    assert (packets == scalar).all(), "パケット走査と遮蔽判定で結果が異なる"
+    print("✓ 日照時間: PASS")
+
+
 if __name__ == "__main__":
     print("=== 天空率積分計算のテスト ===\n")
 
@@ -178,4 +628,37 @@ if __name__ == "__main__":
     test_completely_enclosed()
     print()
 
+    test_horizon_search_modes()
+    print()
+
+    test_build_options()
+    print()
+
+    test_packet_traversal()
+    print()
+
+    test_grid_checkpoints()
+    print()
+
+    test_far_field_culling()
+    print()
+
+    test_design_variants()
+    print()
+
+    test_check_stream()
+    print()
+
+    test_analytic_primitives()
+    print()
+
+    test_projection_horizon()
+    print()
+
+    test_horizon_profiles()
+    print()
+
+    test_sunlight_hours()
+    print()
+
     print("=== すべてのテストが成功しました！ ===")